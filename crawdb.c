@@ -1,735 +1,3673 @@
 #include "crawdb.h"
+#ifndef CRAWDB_NO_URING
+#include <linux/io_uring.h>
+#endif
+
+/* Async internals stay private; callers only see crawdb_async_t */
+#define CRAWDB_ASYNC_STATE_MPH         1
+#define CRAWDB_ASYNC_STATE_BSEARCH     2
+#define CRAWDB_ASYNC_STATE_DATA        3
+#define CRAWDB_ASYNC_STATE_DUPS        4
+
+typedef struct crawdb_async_op_s crawdb_async_op_t;
+
+struct crawdb_async_op_s {
+    uint64_t user;
+    int state;
+    int rv;
+    int found;
+    uchar *key;
+    uchar *rec;
+    uchar *val;
+    uint32_t nval_alloc;
+    uint64_t start;
+    uint64_t end;
+    uint64_t look;
+    uint64_t offset;
+    uint32_t len;
+    uint16_t cksum;
+    int read_fd;
+    uchar *read_buf;
+    uint32_t read_len;
+    uint64_t read_offset;
+    crawdb_async_op_t *next;
+};
+
+struct crawdb_async_s {
+    crawdb_t *craw;
+    uint32_t depth;
+    uint32_t ninflight;
+    uint32_t ndone;
+    crawdb_async_op_t *ops;
+    crawdb_async_op_t *free_ops;
+    crawdb_async_op_t *ready_head;
+    crawdb_async_op_t *ready_tail;
+    crawdb_async_op_t *done_head;
+    crawdb_async_op_t *done_tail;
+    crawdb_async_op_t *retired;
+    int ring_fd;
+    uchar *sq_map;
+    size_t nsq_map;
+    uchar *cq_map;
+    size_t ncq_map;
+    uchar *sqes;
+    size_t nsqes;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    uchar *cqes;
+    uint32_t nsubmit;
+};
 
 static int _crawdb_get_ex(crawdb_t *craw, int by_key, uchar *orig_key, uint32_t orig_nkey, uint64_t key_i, uchar **out_key, uint32_t *out_nkey, uchar **out_val, uint32_t *out_nval, uint64_t *out_key_i);
-static int _crawdb_get_bsearch(crawdb_t *craw, uchar *key, int *out_found, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del, uint64_t *out_key_i);
-static int _crawdb_get_lsearch(crawdb_t *craw, uchar *key, int *out_found, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del, uint64_t *out_key_i);
+static int _crawdb_find(crawdb_t *craw, uchar *orig_key, uint32_t orig_nkey, int *out_found, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del, uint64_t *out_key_i);
+static int _crawdb_get_bsearch(crawdb_t *craw, uchar *key, uint32_t nkey, int *out_found, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del, uint64_t *out_key_i);
+static int _crawdb_get_lsearch(crawdb_t *craw, uchar *key, uint32_t nkey, int *out_found, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del, uint64_t *out_key_i);
+static int _crawdb_get_mph(crawdb_t *craw, uchar *key, uint32_t nkey, int *out_found, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del, uint64_t *out_key_i);
 static int _crawdb_read_idx_record(crawdb_t *craw, uint64_t key_i);
+static int _crawdb_key_cmp(crawdb_t *craw, uchar *key, uint32_t nkey);
+static int _crawdb_key_cmp_full(crawdb_t *craw, uchar *a, uchar *b);
+static int _crawdb_kernel(uint32_t nkey);
 static int _crawdb_parse_idx_record(crawdb_t *craw, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del);
 static int _crawdb_get_data(crawdb_t *craw, uint64_t offset, uint32_t len, uint16_t cksum, uchar **out_val, uint32_t *out_nval);
+static int _crawdb_read_data(crawdb_t *craw, uint64_t offset, uint32_t len, uint16_t cksum, uchar *buf);
+static void _crawdb_async_start(crawdb_async_t *async, crawdb_async_op_t *op);
+static void _crawdb_async_step(crawdb_async_t *async, crawdb_async_op_t *op, ssize_t res);
+static void _crawdb_async_tail(crawdb_async_t *async, crawdb_async_op_t *op);
+static void _crawdb_async_fetch(crawdb_async_t *async, crawdb_async_op_t *op, uint8_t del);
+static void _crawdb_async_read_idx(crawdb_async_t *async, crawdb_async_op_t *op);
+static void _crawdb_async_read(crawdb_async_t *async, crawdb_async_op_t *op, int fd, uchar *buf, uint32_t len, uint64_t offset);
+static void _crawdb_async_finish(crawdb_async_t *async, crawdb_async_op_t *op, int rv);
+static int _crawdb_async_pump(crawdb_async_t *async, uint32_t min_complete);
+static int _crawdb_async_ring_setup(crawdb_async_t *async);
+static void _crawdb_async_ring_push(crawdb_async_t *async, crawdb_async_op_t *op);
+static int _crawdb_async_ring_enter(crawdb_async_t *async, uint32_t min_complete);
 static int _crawdb_index_copy(crawdb_t *craw, int *out_fd_copy, char **out_path_copy);
 static int _crawdb_index_sort_cmp(const void *a, const void *b, void *arg);
+static int _crawdb_index_sort_ptr_cmp(const void *a, const void *b, void *arg);
+static uint64_t *_crawdb_index_sort_kernel(crawdb_t *craw, uchar *buf);
 static int _crawdb_index_sort(crawdb_t *craw, char *path_copy, int *inout_fd_copy, char **out_path_new, int *out_fd_new, long *out_size_new);
 static int _crawdb_index_swap(crawdb_t *craw, char *path_new, int fd_new, long size_new);
+static int _crawdb_prewarm_idx(crawdb_t *craw, int fd, size_t nheader, uint64_t nsorted, int flags);
+static int _crawdb_prewarm_levels(crawdb_t *craw, int fd, size_t nheader, uchar *rec, uint64_t start, uint64_t end, int depth);
+static void _crawdb_prewarm_unmap(crawdb_t *craw);
+static int _crawdb_scrub_keys(crawdb_t *craw, uchar *buf, uint64_t nsorted, crawdb_scrub_t *out_scrub);
+static int _crawdb_scrub_order_cmp(const void *a, const void *b, void *arg);
+static void *_crawdb_scrub_run(void *arg);
+static int _crawdb_freeze_build(crawdb_t *craw, uchar *buf, uint64_t n, uint64_t **out_words, uint64_t *out_nwords, uint64_t *levels, uint32_t *out_nlevels);
+static int _crawdb_freeze_write(crawdb_t *craw, uint64_t *words, uint64_t nwords, uint64_t *levels, uint32_t nlevels, uint64_t *table, uint64_t n);
+static int _crawdb_mph_slot(crawdb_mph_t *mph, uchar *key, uint32_t nkey, uint32_t width, uint64_t *out_rank);
+static int _crawdb_mph_load(crawdb_t *craw);
+static int _crawdb_mph_unload(crawdb_t *craw);
+static uint64_t _crawdb_hash(uchar *key, uint32_t nkey, uint32_t width, uint64_t seed);
+static uint16_t _crawdb_cksum_update(uint16_t crc, uchar *val, uint32_t len);
+static uint16_t _crawdb_cksum_final(uint16_t crc);
 static int _crawdb_reload_for_index(crawdb_t *craw);
-static int _crawdb_open(int is_new, int for_index, crawdb_t *reload, char *idx_path, char *dat_path, uint32_t nkey, crawdb_t **out_craw);
+static int _crawdb_open(int is_new, int mode, crawdb_t *reload, char *idx_path, char *dat_path, uint32_t nkey, crawdb_t **out_craw);
 static int _crawdb_set_idx_size(crawdb_t *craw, uint64_t idx_size);
+static int _crawdb_open_rw(crawdb_t *craw);
+static int _crawdb_read_ends(crawdb_t *craw, uint8_t *out_dead, off_t *out_idx_end, off_t *out_dat_end);
+static int _crawdb_prealloc_ensure(int fd, uint64_t *inout_alloc, uint64_t end, uint64_t chunk);
+static int _crawdb_set_begin(crawdb_t *craw, uchar *key, uint32_t nkey, int staged);
+static int _crawdb_set_check(crawdb_t *craw, uchar *key, uint32_t nkey, off_t *out_dat_end);
+static int _crawdb_set_unstage(crawdb_t *craw, off_t dat_end);
+static char *_crawdb_segment_path(crawdb_t *craw, uint32_t seg);
+static int _crawdb_segment_acquire(crawdb_t *craw, uint64_t *out_offset);
+static int _crawdb_dat_fd(crawdb_t *craw, uint64_t offset, int *out_fd, uint64_t *out_pos);
+static char *_crawdb_live_path(crawdb_t *craw, char *suffix);
+static int _crawdb_live_create(char *path, uint64_t gen, uint64_t *live, uint32_t nlive);
+static void _crawdb_live_open(crawdb_t *craw);
+static void _crawdb_live_count(crawdb_t *craw, uchar *recs, uint64_t n, uint64_t *live);
+static int _crawdb_live_add_fd(int fd, uint64_t offset, int64_t delta);
+static int _crawdb_live_add(crawdb_t *craw, uint64_t offset, int64_t delta);
+static int _crawdb_live_swap(crawdb_t *craw, int fd_new, long size_new, uint64_t nnew);
 static int _crawdb_lock(crawdb_t *craw);
 static int _crawdb_unlock(crawdb_t *craw);
 static int _crawdb_unlock_if_locked(crawdb_t *craw);
+static int _crawdb_del_log(crawdb_t *craw, uint64_t *key_is, uint64_t n);
+static uint64_t _crawdb_now_ns(void);
 
 int crawdb_new(char *idx_path, char *dat_path, uint32_t nkey, crawdb_t **out_craw) {
-    return _crawdb_open(1, 0, NULL, idx_path, dat_path, nkey, out_craw);
+    return _crawdb_open(1, CRAWDB_OPEN_APPEND, NULL, idx_path, dat_path, nkey, out_craw);
 }
 
 int crawdb_open(char *idx_path, char *dat_path, crawdb_t **out_craw) {
-    return _crawdb_open(0, 0, NULL, idx_path, dat_path, 0, out_craw);
+    return _crawdb_open(0, CRAWDB_OPEN_APPEND, NULL, idx_path, dat_path, 0, out_craw);
 }
 
 int crawdb_reload(crawdb_t *craw) {
     crawdb_t *craw_ignore;
-    return _crawdb_open(0, 0, craw, craw->idx_path, craw->dat_path, 0, &craw_ignore);
+    return _crawdb_open(0, craw->snapshot ? CRAWDB_OPEN_SNAPSHOT : CRAWDB_OPEN_APPEND, craw, craw->idx_path, craw->dat_path, 0, &craw_ignore);
 }
 
-int crawdb_set(crawdb_t *craw, uchar *key, uint32_t nkey, uchar *val, uint32_t nval) {
+int crawdb_refresh(crawdb_t *craw) {
     int rv;
-    off_t offset;
-    ssize_t iorv;
-    uint16_t cksum;
-    uint64_t offset64;
     uint8_t dead;
-    uchar *get_val;
-    uint32_t get_nval;
-    uint8_t deleted;
-    uint64_t key_i;
-
-    /* Check key len */
-    goto_if_err(nkey > craw->nkey, CRAWDB_ERR_SET_BAD_KEY, crawdb_set_err);
-    goto_if_err(nkey < 1,          CRAWDB_ERR_SET_BAD_KEY, crawdb_set_err);
-
-    /* Calc checksum */
-    crawdb_cksum(val, nval, &cksum);
+    off_t idx_size;
 
-    /* Lock */
-    try(_crawdb_lock(craw));
+    /* Reload would drop a batch lock */
+    return_if_err(craw->batch, CRAWDB_ERR_BATCH_ACTIVE);
 
-    /* Check dead flag */
-    dead = 0;
-    iorv = pread(craw->fd_idx, &dead, 1, CRAWDB_OFFSET_DEAD);
-    goto_if_err(iorv != 1, CRAWDB_ERR_SET_PREAD_DEAD, crawdb_set_err);
-    goto_if_err(dead != 0, CRAWDB_ERR_SET_IDX_DEAD, crawdb_set_err);
+    /* Snapshots move to the latest view */
+    if (craw->snapshot) return crawdb_reload(craw);
 
-    /* Ensure key does not already exist */
-    if (crawdb_get(craw, key, nkey, &get_val, &get_nval, &key_i) == CRAWDB_OK && get_val != NULL) {
-        rv = CRAWDB_ERR_SET_ALREADY_EXISTS;
-        goto crawdb_set_err;
+    /* Reopen only if the idx was swapped */
+    try(_crawdb_read_ends(craw, &dead, &idx_size, NULL));
+    if (dead != 0) {
+        craw->stats.dead_flags += 1;
+        return crawdb_reload(craw);
     }
 
-    /* Get dat offset */
-    offset = lseek(craw->fd_dat, 0, SEEK_END);
-    goto_if_err(offset < 0, CRAWDB_ERR_SET_LSEEK, crawdb_set_err);
-
-    /* Set offset in index record */
-    offset64 = (uint64_t)offset;
+    /* Otherwise pick up whole records appended since open */
+    return_if_err(idx_size < (off_t)craw->nheader, CRAWDB_ERR_SET_LSEEK);
+    return _crawdb_set_idx_size(craw, craw->nheader + (((idx_size - craw->nheader) / craw->nrec) * craw->nrec));
+}
 
-    /* Prep index record */
-    if (!craw->rec) {
-        craw->rec = malloc(craw->nrec);
-    }
-    deleted = 0;
-    memset(craw->rec, 0, craw->nrec);
-    memcpy(craw->rec,                   key,    nkey);  /* [0    -> n]    key    (n) */
-    memcpy(craw->rec + craw->nkey,      &offset64,  8); /* [n    -> n+8]  offset (8) */
-    memcpy(craw->rec + craw->nkey + 8,  &nval,  4);     /* [n+8  -> n+12] len    (4) */
-    memcpy(craw->rec + craw->nkey + 12, &cksum, 2);     /* [n+12 -> n+14] cksum  (2) */
-    memcpy(craw->rec + craw->nkey + 14, &deleted, 1);   /* [n+14 -> n+15] del    (1) */
+int crawdb_prealloc(crawdb_t *craw) {
+    int rv;
+    int rc;
+    uint8_t dead;
+    uint8_t flags;
+    off_t idx_end;
+    off_t dat_end;
+    uint64_t ends[2];
 
-    /* Write dat */
-    iorv = write(craw->fd_dat, val, (size_t)nval);
-    goto_if_err(iorv != (ssize_t)nval, CRAWDB_ERR_SET_WRITE_DAT, crawdb_set_err);
+    return_if_err(craw->snapshot, CRAWDB_ERR_SNAPSHOT_WRITE);
 
-    /* Write idx rec */
-    iorv = write(craw->fd_idx, craw->rec, craw->nrec);
-    goto_if_err(iorv != (ssize_t)craw->nrec, CRAWDB_ERR_SET_WRITE_IDX, crawdb_set_err);
+    /* Version 1 headers have no room for the ends */
+    return_if_err(craw->vers < 2, CRAWDB_ERR_PREALLOC_VERS);
 
-    /* Unlock */
-    try(_crawdb_unlock(craw));
-    return CRAWDB_OK;
+    /* Lock */
+    try(_crawdb_lock(craw));
 
-crawdb_set_err:
-    _crawdb_unlock_if_locked(craw);
-    return rv;
+    /* Check dead flag and current ends */
+    rc = _crawdb_read_ends(craw, &dead, &idx_end, &dat_end);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_prealloc_end);
+    goto_if_err(dead != 0, CRAWDB_ERR_SET_IDX_DEAD, crawdb_prealloc_end);
+    rv = CRAWDB_OK;
+    if (craw->flags & CRAWDB_FLAG_PREALLOC) goto crawdb_prealloc_end;
+
+    /* Preallocated ends track a single dat file */
+    goto_if_err(craw->flags & CRAWDB_FLAG_SEGMENTED, CRAWDB_ERR_SEGMENT_MODE, crawdb_prealloc_end);
+
+    /* Open a non-append fd for header writes */
+    rc = _crawdb_open_rw(craw);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_prealloc_end);
+
+    /* Write ends before the flag that tells writers to trust them */
+    ends[0] = craw->nheader + (((idx_end - craw->nheader) / craw->nrec) * craw->nrec);
+    ends[1] = (uint64_t)dat_end;
+    goto_if_err(pwrite(craw->fd_idx_rw, ends, 16, CRAWDB_OFFSET_IDX_END) != 16, CRAWDB_ERR_SET_WRITE_IDX, crawdb_prealloc_end);
+    flags = craw->flags | CRAWDB_FLAG_PREALLOC;
+    goto_if_err(pwrite(craw->fd_idx_rw, &flags, 1, CRAWDB_OFFSET_FLAGS) != 1, CRAWDB_ERR_SET_WRITE_IDX, crawdb_prealloc_end);
+    craw->flags = flags;
+    rv = _crawdb_set_idx_size(craw, ends[0]);
+
+crawdb_prealloc_end:
+    rc = _crawdb_unlock_if_locked(craw);
+    return rv != CRAWDB_OK ? rv : rc;
 }
 
-int crawdb_delete(crawdb_t *craw, uchar *key, uint32_t nkey) {
+int crawdb_segment(crawdb_t *craw, uint64_t seg_size) {
     int rv;
-    ssize_t iorv;
+    int rc;
     uint8_t dead;
-    uchar *get_val;
-    uint32_t get_nval;
-    uint64_t deleted_offset;
-    uint8_t deleted_val;
-    uint64_t key_i;
+    uint8_t flags;
+    off_t idx_end;
+    uint64_t state[2];
+    char *path;
 
-    /* Check key len */
-    goto_if_err(nkey > craw->nkey, CRAWDB_ERR_SET_BAD_KEY, crawdb_delete_err);
-    goto_if_err(nkey < 1,          CRAWDB_ERR_SET_BAD_KEY, crawdb_delete_err);
+    return_if_err(craw->snapshot, CRAWDB_ERR_SNAPSHOT_WRITE);
+
+    /* Version 1 headers have no room for segment state */
+    return_if_err(craw->vers < 2, CRAWDB_ERR_SEGMENT_MODE);
+    if (seg_size == 0) seg_size = CRAWDB_SEGMENT_SIZE;
+    return_if_err(seg_size > CRAWDB_SEGMENT_MASK, CRAWDB_ERR_SEGMENT_MODE);
 
     /* Lock */
     try(_crawdb_lock(craw));
 
-    /* Reload without O_APPEND */
-    rv = _crawdb_reload_for_index(craw);
-    goto_if_err(rv != CRAWDB_OK, rv, crawdb_delete_err);
+    /* Check dead flag and mode */
+    rc = _crawdb_read_ends(craw, &dead, &idx_end, NULL);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_segment_end);
+    goto_if_err(dead != 0, CRAWDB_ERR_SET_IDX_DEAD, crawdb_segment_end);
+    rv = CRAWDB_OK;
+    if (craw->flags & CRAWDB_FLAG_SEGMENTED) goto crawdb_segment_end;
+    goto_if_err(craw->flags & CRAWDB_FLAG_PREALLOC, CRAWDB_ERR_SEGMENT_MODE, crawdb_segment_end);
+
+    /* Open a non-append fd for header writes */
+    rc = _crawdb_open_rw(craw);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_segment_end);
+
+    /* Existing values stay in dat as segment 0; new ones start at segment 1 */
+    state[0] = seg_size;
+    state[1] = 1;
+    goto_if_err(pwrite(craw->fd_idx_rw, state, 16, CRAWDB_OFFSET_SEG_SIZE) != 16, CRAWDB_ERR_SET_WRITE_IDX, crawdb_segment_end);
+    flags = craw->flags | CRAWDB_FLAG_SEGMENTED;
+    goto_if_err(pwrite(craw->fd_idx_rw, &flags, 1, CRAWDB_OFFSET_FLAGS) != 1, CRAWDB_ERR_SET_WRITE_IDX, crawdb_segment_end);
+    craw->flags = flags;
+
+    /* No segment has records yet */
+    if (craw->fd_live >= 0) close(craw->fd_live);
+    craw->fd_live = -1;
+    path = _crawdb_live_path(craw, ".live");
+    rv = _crawdb_live_create(path, craw->gen, NULL, 0);
+    free(path);
+
+crawdb_segment_end:
+    rc = _crawdb_unlock_if_locked(craw);
+    return rv != CRAWDB_OK ? rv : rc;
+}
+
+int crawdb_reclaim(crawdb_t *craw, uint64_t *out_nunlinked) {
+    int rv;
+    int rc;
+    int fd;
+    int pinned;
+    struct stat st;
+    uint8_t dead;
+    off_t idx_size;
+    ssize_t iorv;
+    uint64_t state[2];
+    uint64_t *live;
+    uchar *chunk;
+    uint64_t per_chunk;
+    uint64_t n;
+    uint64_t i;
+    uint32_t seg;
+    char *path;
 
-    /* Check dead flag */
-    dead = 0;
-    iorv = pread(craw->fd_idx, &dead, 1, CRAWDB_OFFSET_DEAD);
-    goto_if_err(iorv != 1, CRAWDB_ERR_SET_PREAD_DEAD, crawdb_delete_err);
-    goto_if_err(dead != 0, CRAWDB_ERR_SET_IDX_DEAD, crawdb_delete_err);
+    live = NULL;
+    chunk = NULL;
+    pinned = 0;
+    *out_nunlinked = 0;
+    return_if_err(craw->snapshot, CRAWDB_ERR_SNAPSHOT_WRITE);
+
+    /* Hold the lock so no record commits while segments are counted */
+    try(_crawdb_lock(craw));
 
-    /* Get key index */
-    if (crawdb_get(craw, key, nkey, &get_val, &get_nval, &key_i) != CRAWDB_OK || get_val == NULL) {
-        rv = CRAWDB_ERR_DELETE_NOT_FOUND;
-        goto crawdb_delete_err;
+    /* Check dead flag and refresh idx size */
+    rc = _crawdb_read_ends(craw, &dead, &idx_size, NULL);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_reclaim_end);
+    goto_if_err(dead != 0, CRAWDB_ERR_SET_IDX_DEAD, crawdb_reclaim_end);
+    rc = _crawdb_set_idx_size(craw, idx_size);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_reclaim_end);
+    rv = CRAWDB_OK;
+    if (!(craw->flags & CRAWDB_FLAG_SEGMENTED)) goto crawdb_reclaim_end;
+    iorv = pread(craw->fd_idx, state, 16, CRAWDB_OFFSET_SEG_SIZE);
+    goto_if_err(iorv != 16, CRAWDB_ERR_RECLAIM_READ, crawdb_reclaim_end);
+
+    /* Indexing and snapshots hold dat shared while an older idx may still be read */
+    goto_if_err(flock(craw->fd_dat, LOCK_EX | LOCK_NB) != 0, CRAWDB_ERR_RECLAIM_PINNED, crawdb_reclaim_end);
+    pinned = 1;
+
+    /* Read the live record counts writers keep per segment */
+    live = calloc(CRAWDB_SEGMENT_MAX + 1, sizeof(uint64_t));
+    _crawdb_live_open(craw);
+    if (craw->fd_live >= 0) {
+        iorv = pread(craw->fd_live, live, state[1] * 8, CRAWDB_LIVE_HEADER);
+        goto_if_err(iorv < 0, CRAWDB_ERR_RECLAIM_READ, crawdb_reclaim_end);
+    } else {
+        /* Without counts for this gen (until the next index), count in one pass over the idx */
+        per_chunk = (CRAWDB_SORT_CHUNK / craw->nrec) + 1;
+        chunk = malloc(per_chunk * craw->nrec);
+        for (i = 0; i < craw->ntotal; i += n) {
+            n = craw->ntotal - i < per_chunk ? craw->ntotal - i : per_chunk;
+            iorv = pread(craw->fd_idx, chunk, n * craw->nrec, craw->nheader + (i * craw->nrec));
+            goto_if_err(iorv != (ssize_t)(n * craw->nrec), CRAWDB_ERR_RECLAIM_READ, crawdb_reclaim_end);
+            _crawdb_live_count(craw, chunk, n, live);
+        }
     }
 
-    /* Set del flag on index record */
-    deleted_offset = CRAWDB_HEADER_SIZE + (key_i * craw->nrec) + craw->nkey + 8 + 4 + 2;
-    deleted_val = 1;
-    if (pwrite(craw->fd_idx, &deleted_val, 1, (off_t)deleted_offset) != 1) {
-        rv = CRAWDB_ERR_DELETE_WRITE_FLAG;
-        goto crawdb_delete_err;
+    /* Unlink sealed segments with no live records that no writer holds; no dat is rewritten */
+    for (seg = 1; seg < state[1]; seg++) {
+        if (live[seg] > 0) continue;
+        path = _crawdb_segment_path(craw, seg);
+        fd = open(path, O_RDONLY);
+        if (fd >= 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_size >= state[0]
+            && flock(fd, LOCK_EX | LOCK_NB) == 0 && unlink(path) == 0
+        ) {
+            *out_nunlinked += 1;
+            if (seg < craw->nseg_fds && craw->seg_fds[seg] >= 0) {
+                close(craw->seg_fds[seg]);
+                craw->seg_fds[seg] = -1;
+            }
+        }
+        if (fd >= 0) close(fd);
+        free(path);
     }
 
-    /* Reload for O_APPEND */
-    rv = crawdb_reload(craw);
-    goto_if_err(rv != CRAWDB_OK, rv, crawdb_delete_err);
+crawdb_reclaim_end:
+    if (pinned) flock(craw->fd_dat, LOCK_UN);
+    rc = _crawdb_unlock_if_locked(craw);
+    if (live) free(live);
+    if (chunk) free(chunk);
+    return rv != CRAWDB_OK ? rv : rc;
+}
 
-    /* Unlock */
-    try(_crawdb_unlock(craw));
-    return CRAWDB_OK;
+int crawdb_snapshot(crawdb_t *craw, crawdb_t **out_snap) {
+    return crawdb_open_snapshot(craw->idx_path, craw->dat_path, out_snap);
+}
 
-crawdb_delete_err:
-    _crawdb_unlock_if_locked(craw);
-    return rv;
+int crawdb_open_snapshot(char *idx_path, char *dat_path, crawdb_t **out_snap) {
+    /* Read-only handle pinned to the current idx and its record count; never creates files */
+    return _crawdb_open(0, CRAWDB_OPEN_SNAPSHOT, NULL, idx_path, dat_path, 0, out_snap);
 }
 
-int crawdb_get(crawdb_t *craw, uchar *key, uint32_t nkey, uchar **out_val, uint32_t *out_nval, uint64_t *out_key_i) {
-    return _crawdb_get_ex(craw, 1, key, nkey, 0, NULL, NULL, out_val, out_nval, out_key_i);
+int crawdb_set(crawdb_t *craw, uchar *key, uint32_t nkey, uchar *val, uint32_t nval) {
+    int rv;
+
+    /* Write value as a single chunk straight to dat */
+    try(_crawdb_set_begin(craw, key, nkey, 0));
+    try(crawdb_set_chunk(craw, val, nval));
+    try(crawdb_set_commit(craw));
+
+    return CRAWDB_OK;
 }
 
-int crawdb_get_i(crawdb_t *craw, uint64_t i, uchar **out_key, uint32_t *out_nkey, uchar **out_val, uint32_t *out_nval) {
-    return _crawdb_get_ex(craw, 0, NULL, 0, i, out_key, out_nkey, out_val, out_nval, &i);
+int crawdb_set_begin(crawdb_t *craw, uchar *key, uint32_t nkey) {
+    /* Chunks may be far apart, so stage them rather than hold the lock */
+    return _crawdb_set_begin(craw, key, nkey, 1);
 }
 
-int crawdb_cksum(uchar *val, uint32_t len, uint16_t *out_cksum) {
-    int i;
-    uint16_t data;
-    uint16_t crc;
+static int _crawdb_set_begin(crawdb_t *craw, uchar *key, uint32_t nkey, int staged) {
+    int rv;
+    int rc;
+    off_t offset;
+    char *path;
+    size_t npath;
 
-    /* Apply CRC-16 checksum algorithm */
+    /* Check stream state */
+    return_if_err(craw->set_active, CRAWDB_ERR_SET_STREAM);
+    return_if_err(craw->snapshot, CRAWDB_ERR_SNAPSHOT_WRITE);
 
-    crc = 0xffff;
+    /* Check key len */
+    goto_if_err(nkey > craw->nkey, CRAWDB_ERR_SET_BAD_KEY, _crawdb_set_begin_err);
+    goto_if_err(nkey < 1,          CRAWDB_ERR_SET_BAD_KEY, _crawdb_set_begin_err);
+
+    offset = 0;
+    if (craw->flags & CRAWDB_FLAG_SEGMENTED) {
+        /* Stream into this handle's own segment and lock only to commit */
+        rc = _crawdb_segment_acquire(craw, &craw->set_offset);
+        staged = 0;
+    } else if (staged) {
+        /* Stream into an unlinked staging file beside dat; commit locks and copies it in */
+        rc = CRAWDB_OK;
+        if (craw->fd_stage < 0) {
+            npath = strlen(craw->dat_path) + 14; /* ".stage.XXXXXX" (13) */
+            path = malloc(npath);
+            snprintf(path, npath, "%s.stage.XXXXXX", craw->dat_path);
+            craw->fd_stage = mkstemp(path);
+            if (craw->fd_stage >= 0) unlink(path);
+            free(path);
+            rc = craw->fd_stage < 0 ? CRAWDB_ERR_SET_STAGE : CRAWDB_OK;
+        }
+        craw->set_offset = 0;
+    } else {
+        /* Lock and ensure key does not already exist */
+        rc = _crawdb_set_check(craw, key, nkey, &offset);
+        craw->set_offset = (uint64_t)offset;
+    }
+    goto_if_err(rc != CRAWDB_OK, rc, _crawdb_set_begin_err);
 
-    if (len <= 0) {
-        *out_cksum = ~crc;
-        return CRAWDB_OK;
+    /* Start stream */
+    if (!craw->set_key) {
+        craw->set_key = malloc(craw->nkey);
     }
+    memset(craw->set_key, 0, craw->nkey);
+    memcpy(craw->set_key, key, nkey);
+    craw->set_len = 0;
+    craw->set_crc = CRAWDB_CKSUM_INIT;
+    craw->set_staged = staged;
+    craw->set_active = 1;
+    return CRAWDB_OK;
 
-    do {
-        for (i = 0, data=0x00ff & (uint16_t)(*val++); i < 8; i++, data >>= 1) {
-            if ((crc & 0x0001) ^ (data & 0x0001)) {
-                crc = (crc >> 1) ^ 0x8408;
-            } else {
-                crc >>= 1;
-            }
-        }
-    } while (--len);
+_crawdb_set_begin_err:
+    _crawdb_unlock_if_locked(craw);
+    return rv;
+}
 
-    crc = ~crc;
-    data = crc;
-    crc = (crc << 8) | (data >> 8 & 0xff);
+int crawdb_set_chunk(crawdb_t *craw, uchar *val, uint32_t nval) {
+    int rv;
+    int rc;
+    ssize_t iorv;
+
+    /* Check stream state */
+    return_if_err(!craw->set_active, CRAWDB_ERR_SET_STREAM);
+
+    /* Values are capped by the 4-byte len field */
+    goto_if_err(craw->set_len + nval > UINT32_MAX, CRAWDB_ERR_SET_TOO_LARGE, crawdb_set_chunk_err);
+
+    /* Write dat */
+    if (craw->set_staged) {
+        iorv = pwrite(craw->fd_stage, val, (size_t)nval, (off_t)craw->set_len);
+    } else if (craw->flags & CRAWDB_FLAG_PREALLOC) {
+        rc = _crawdb_prealloc_ensure(craw->fd_dat_rw, &craw->dat_alloc, craw->set_offset + craw->set_len + nval, CRAWDB_PREALLOC_DAT_CHUNK);
+        goto_if_err(rc != CRAWDB_OK, rc, crawdb_set_chunk_err);
+        iorv = pwrite(craw->fd_dat_rw, val, (size_t)nval, (off_t)(craw->set_offset + craw->set_len));
+    } else if (craw->set_offset >> CRAWDB_SEGMENT_SHIFT) {
+        iorv = write(craw->fd_seg, val, (size_t)nval);
+    } else {
+        iorv = write(craw->fd_dat, val, (size_t)nval);
+    }
+    goto_if_err(iorv != (ssize_t)nval, CRAWDB_ERR_SET_WRITE_DAT, crawdb_set_chunk_err);
 
-    *out_cksum = crc;
+    /* Update checksum */
+    craw->set_crc = _crawdb_cksum_update(craw->set_crc, val, nval);
+    craw->set_len += nval;
     return CRAWDB_OK;
+
+crawdb_set_chunk_err:
+    crawdb_set_abort(craw);
+    return rv;
 }
 
-int crawdb_index(crawdb_t *craw) {
+int crawdb_set_commit(crawdb_t *craw) {
     int rv;
     int rc;
-    char *path_copy;
-    char *path_new;
-    int fd_copy;
-    int fd_new;
-    long size_new;
+    ssize_t iorv;
+    uint64_t ends[2];
+    off_t dat_end;
+    uint16_t cksum;
+    uint32_t nval;
+    uint8_t deleted;
 
-    path_copy = NULL;
-    path_new = NULL;
-    fd_copy = -1;
-    fd_new = -1;
+    /* Check stream state */
+    return_if_err(!craw->set_active, CRAWDB_ERR_SET_STREAM);
+
+    /* Segment streams lock and check for a dupe only now */
+    if (craw->set_offset >> CRAWDB_SEGMENT_SHIFT) {
+        rc = _crawdb_set_check(craw, craw->set_key, craw->nkey, &dat_end);
+        goto_if_err(rc != CRAWDB_OK, rc, crawdb_set_commit_err);
+
+        /* Count the record before it commits, so a failure can only overcount */
+        rc = _crawdb_live_add(craw, craw->set_offset, 1);
+        goto_if_err(rc != CRAWDB_OK, rc, crawdb_set_commit_err);
+    } else if (craw->set_staged) {
+        /* Staged streams too, then move their value to the end of dat */
+        rc = _crawdb_set_check(craw, craw->set_key, craw->nkey, &dat_end);
+        goto_if_err(rc != CRAWDB_OK, rc, crawdb_set_commit_err);
+        rc = _crawdb_set_unstage(craw, dat_end);
+        goto_if_err(rc != CRAWDB_OK, rc, crawdb_set_commit_err);
+    }
 
-    /* Copy index */
-    rc =_crawdb_index_copy(craw, &fd_copy, &path_copy);
-    goto_if_err(rc != CRAWDB_OK, rc, crawdb_index_end);
+    /* Prep index record */
+    if (!craw->rec) {
+        craw->rec = malloc(craw->nrec);
+    }
+    cksum = _crawdb_cksum_final(craw->set_crc);
+    nval = (uint32_t)craw->set_len;
+    deleted = 0;
+    memset(craw->rec, 0, craw->nrec);
+    memcpy(craw->rec,                   craw->set_key, craw->nkey); /* [0    -> n]    key    (n) */
+    memcpy(craw->rec + craw->nkey,      &craw->set_offset, 8);     /* [n    -> n+8]  offset (8) */
+    memcpy(craw->rec + craw->nkey + 8,  &nval,  4);                 /* [n+8  -> n+12] len    (4) */
+    memcpy(craw->rec + craw->nkey + 12, &cksum, 2);                 /* [n+12 -> n+14] cksum  (2) */
+    memcpy(craw->rec + craw->nkey + 14, &deleted, 1);               /* [n+14 -> n+15] del    (1) */
 
-    /* Sort into new index */
-    fd_new = -1;
-    rc = _crawdb_index_sort(craw, path_copy, &fd_copy, &path_new, &fd_new, &size_new);
-    goto_if_err(rc != CRAWDB_OK, rc, crawdb_index_end);
+    /* Write idx rec */
+    if (craw->flags & CRAWDB_FLAG_PREALLOC) {
+        rc = _crawdb_prealloc_ensure(craw->fd_idx_rw, &craw->idx_alloc, craw->idx_size + craw->nrec, CRAWDB_PREALLOC_IDX_CHUNK);
+        goto_if_err(rc != CRAWDB_OK, rc, crawdb_set_commit_err);
+        iorv = pwrite(craw->fd_idx_rw, craw->rec, craw->nrec, (off_t)craw->idx_size);
+        goto_if_err(iorv != (ssize_t)craw->nrec, CRAWDB_ERR_SET_WRITE_IDX, crawdb_set_commit_err);
+
+        /* Moving the ends in the header commits the record */
+        ends[0] = craw->idx_size + craw->nrec;
+        ends[1] = craw->set_offset + craw->set_len;
+        iorv = pwrite(craw->fd_idx_rw, ends, 16, CRAWDB_OFFSET_IDX_END);
+        goto_if_err(iorv != 16, CRAWDB_ERR_SET_WRITE_IDX, crawdb_set_commit_err);
+    } else {
+        iorv = write(craw->fd_idx, craw->rec, craw->nrec);
+        goto_if_err(iorv != (ssize_t)craw->nrec, CRAWDB_ERR_SET_WRITE_IDX, crawdb_set_commit_err);
+    }
 
-    /* Swap in new index and copy intermediate records */
-    rc = _crawdb_index_swap(craw, path_new, fd_new, size_new);
-    goto_if_err(rc != CRAWDB_OK, rc, crawdb_index_end);
+    /* Make record visible to this handle */
+    _crawdb_set_idx_size(craw, craw->idx_size + craw->nrec);
 
-    rv = CRAWDB_OK;
+    /* Seal a full segment so it can be reclaimed once its records are dead */
+    if ((craw->set_offset >> CRAWDB_SEGMENT_SHIFT) && (craw->set_offset & CRAWDB_SEGMENT_MASK) + craw->set_len >= craw->seg_size) {
+        close(craw->fd_seg);
+        craw->fd_seg = -1;
+    }
 
-crawdb_index_end:
-    if (path_copy) free(path_copy);
-    if (path_new) free(path_new);
-    if (fd_copy >= 0) close(fd_copy);
-    if (fd_new >= 0) close(fd_new);
+    /* Unlock */
+    craw->set_active = 0;
+    craw->set_staged = 0;
+    try(_crawdb_unlock(craw));
+    return CRAWDB_OK;
+
+crawdb_set_commit_err:
+    crawdb_set_abort(craw);
     return rv;
 }
 
-int crawdb_get_nkey(crawdb_t *craw, uint32_t *out_nkey) {
-    *out_nkey = craw->nkey;
-    return CRAWDB_OK;
-}
+int crawdb_set_abort(crawdb_t *craw) {
+    int rv;
+    int rc;
 
-int crawdb_get_ntotal(crawdb_t *craw, uint64_t *out_ntotal) {
-    *out_ntotal = craw->ntotal;
-    return CRAWDB_OK;
+    /* Segment streams own their segment and drop their bytes; dat bytes stay unreferenced */
+    rv = CRAWDB_OK;
+    if (craw->set_active && (craw->set_offset >> CRAWDB_SEGMENT_SHIFT) && craw->fd_seg >= 0) {
+        if (ftruncate(craw->fd_seg, (off_t)(craw->set_offset & CRAWDB_SEGMENT_MASK)) != 0) {
+            /* Give up the segment rather than append after stray bytes */
+            close(craw->fd_seg);
+            craw->fd_seg = -1;
+            rv = CRAWDB_ERR_SET_TRUNCATE;
+        }
+    }
+
+    /* Drop staged bytes, or the staging file if they will not go */
+    if (craw->set_active && craw->set_staged && ftruncate(craw->fd_stage, 0) != 0) {
+        close(craw->fd_stage);
+        craw->fd_stage = -1;
+    }
+    craw->set_active = 0;
+    craw->set_staged = 0;
+    rc = _crawdb_unlock_if_locked(craw);
+    return rv != CRAWDB_OK ? rv : rc;
 }
 
-int crawdb_get_nsorted(crawdb_t *craw, uint64_t *out_nsorted) {
-    *out_nsorted = craw->nsorted;
+int crawdb_batch_begin(crawdb_t *craw) {
+    int rv;
+
+    /* Hold the lock across sets until crawdb_batch_end */
+    return_if_err(craw->batch, CRAWDB_ERR_BATCH_ACTIVE);
+    try(_crawdb_lock(craw));
+    craw->batch = 1;
+
     return CRAWDB_OK;
 }
 
-int crawdb_get_nunsorted(crawdb_t *craw, uint64_t *out_nunsorted) {
-    *out_nunsorted = craw->nunsorted;
-    return CRAWDB_OK;
+int crawdb_batch_end(crawdb_t *craw) {
+    return_if_err(!craw->batch, CRAWDB_ERR_BATCH_ACTIVE);
+    craw->batch = 0;
+    return _crawdb_unlock(craw);
 }
 
-int crawdb_free(crawdb_t *craw) {
-    if (craw->fd_idx >= 0) close(craw->fd_idx);
-    if (craw->fd_dat >= 0) close(craw->fd_dat);
-    if (craw->rec) free(craw->rec);
-    if (craw->data) free(craw->data);
-    free(craw->idx_path);
-    free(craw->dat_path);
-    free(craw);
-    return CRAWDB_OK;
+int crawdb_delete(crawdb_t *craw, uchar *key, uint32_t nkey) {
+    int rv;
+    int key_rv;
+    uint64_t ndeleted;
+
+    try(crawdb_delete_many(craw, &key, &nkey, 1, &key_rv, &ndeleted));
+    return key_rv;
 }
 
-static int _crawdb_get_ex(crawdb_t *craw, int by_key, uchar *orig_key, uint32_t orig_nkey, uint64_t key_i, uchar **out_key, uint32_t *out_nkey, uchar **out_val, uint32_t *out_nval, uint64_t *out_key_i) {
+int crawdb_delete_many(crawdb_t *craw, uchar **keys, uint32_t *nkeys, uint64_t n, int *out_rvs, uint64_t *out_ndeleted) {
     int rv;
     int rc;
+    int key_rv;
     int found;
+    uint8_t dead;
+    off_t idx_size;
     uint64_t offset;
     uint32_t len;
     uint16_t cksum;
-    uchar *key;
     uint8_t del;
+    uint64_t deleted_offset;
+    uint8_t deleted_val;
+    uint64_t key_i;
+    uint64_t *key_is;
+    uint64_t i;
 
-    key = NULL;
-
-    /* Validate key or key_i */
-    if (by_key) {
-        goto_if_err(orig_nkey > craw->nkey, CRAWDB_ERR_GET_BAD_KEY, _crawdb_get_ex_err);
-        goto_if_err(orig_nkey < 1,          CRAWDB_ERR_GET_BAD_KEY, _crawdb_get_ex_err);
-    } else {
-        goto_if_err(key_i >= craw->ntotal,  CRAWDB_ERR_GET_BAD_KEY, _crawdb_get_ex_err);
-    }
+    *out_ndeleted = 0;
+    return_if_err(craw->snapshot, CRAWDB_ERR_SNAPSHOT_WRITE);
+    key_is = NULL;
 
-    if (by_key) {
-        /* Maybe pad key */
-        if (orig_nkey < craw->nkey) {
-            key = calloc(1, craw->nkey); /* TODO scratch key buffer */
-            memcpy(key, orig_key, orig_nkey);
-        } else { /* orig_nkey == craw->nkey */
-            key = orig_key;
-        }
+    /* Lock once for all keys */
+    try(_crawdb_lock(craw));
 
-        found = 0;
+    /* Check dead flag and refresh idx size so records from other writers are found */
+    rc = _crawdb_read_ends(craw, &dead, &idx_size, NULL);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_delete_many_end);
+    if (dead != 0) craw->stats.dead_flags += 1;
+    goto_if_err(dead != 0, CRAWDB_ERR_SET_IDX_DEAD, crawdb_delete_many_end);
 
-        if (craw->nsorted > 0) {
-            /* Try binary search */
-            rc = _crawdb_get_bsearch(craw, key, &found, &offset, &len, &cksum, &del, out_key_i);
-            goto_if_err(rc != CRAWDB_OK, rc, _crawdb_get_ex_err);
+    /* Open a non-append fd for in-place writes */
+    rc = _crawdb_open_rw(craw);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_delete_many_end);
+    rc = _crawdb_set_idx_size(craw, idx_size);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_delete_many_end);
+    key_is = malloc(n * sizeof(uint64_t) + 1);
+
+    for (i = 0; i < n; i++) {
+        /* Find record without reading its value */
+        key_rv = _crawdb_find(craw, keys[i], nkeys[i], &found, &offset, &len, &cksum, &del, &key_i);
+        if (key_rv == CRAWDB_ERR_GET_BAD_KEY) {
+            key_rv = CRAWDB_ERR_SET_BAD_KEY;
+        } else if (key_rv == CRAWDB_OK && (!found || del)) {
+            key_rv = CRAWDB_ERR_DELETE_NOT_FOUND;
         }
 
-        if (!found) {
-            if (craw->nunsorted > 0) {
-                /* Try linear search */
-                rc =_crawdb_get_lsearch(craw, key, &found, &offset, &len, &cksum, &del, out_key_i);
-                goto_if_err(rc != CRAWDB_OK, rc, _crawdb_get_ex_err);
-            }
-        }
+        /* Set del flag on index record */
+        if (key_rv == CRAWDB_OK) {
+            deleted_offset = craw->nheader + (key_i * craw->nrec) + craw->nkey + 8 + 4 + 2;
+            deleted_val = 1;
+            if (pwrite(craw->fd_idx_rw, &deleted_val, 1, (off_t)deleted_offset) != 1) {
+                key_rv = CRAWDB_ERR_DELETE_WRITE_FLAG;
+            } else {
+                key_is[*out_ndeleted] = key_i;
+                *out_ndeleted += 1;
 
-        /* Key not found */
-        if (!found) {
-            *out_val = NULL;
-            *out_nval = 0;
-            goto _crawdb_get_ex_ok;
+                /* A missed decrement only delays reclaim until the next index */
+                _crawdb_live_add(craw, offset, -1);
+            }
         }
-    } else {
-        /* Read key at key_i */
-        rc = _crawdb_read_idx_record(craw, key_i);
-        goto_if_err(rc != CRAWDB_OK, rc, _crawdb_get_ex_err);
-        *out_key = craw->rec;
-        *out_nkey = craw->nkey;
-        *out_key_i = key_i;
 
-        _crawdb_parse_idx_record(craw, &offset, &len, &cksum, &del);
-    }
-
-    if (del) {
-        /* TODO different return for deleted keys? */
-        *out_val = NULL;
-        *out_nval = 0;
-        goto _crawdb_get_ex_ok;
+        if (out_rvs) out_rvs[i] = key_rv;
     }
 
-    /* Fetch data */
-    rc = _crawdb_get_data(craw, offset, len, cksum, out_val, out_nval);
-    goto_if_err(rc != CRAWDB_OK, rc, _crawdb_get_ex_err);
-
-_crawdb_get_ex_ok:
-    if (key && key != orig_key) free(key); /* TODO scratch key buffer */
-    return CRAWDB_OK;
+    /* Log deleted records so followers can replay their flags */
+    rv = _crawdb_del_log(craw, key_is, *out_ndeleted);
 
-_crawdb_get_ex_err:
-    return rv;
+crawdb_delete_many_end:
+    rc = _crawdb_unlock_if_locked(craw);
+    if (key_is) free(key_is);
+    return rv != CRAWDB_OK ? rv : rc;
 }
 
-static int _crawdb_get_bsearch(crawdb_t *craw, uchar *key, int *out_found, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del, uint64_t *out_key_i) {
-    uint64_t start;
-    uint64_t end;
-    uint64_t look;
-    int rv;
+int crawdb_get(crawdb_t *craw, uchar *key, uint32_t nkey, uchar **out_val, uint32_t *out_nval, uint64_t *out_key_i) {
+    return _crawdb_get_ex(craw, 1, key, nkey, 0, NULL, NULL, out_val, out_nval, out_key_i);
+}
 
-    start = 0;
-    end = craw->nsorted - 1;
+int crawdb_get_into(crawdb_t *craw, uchar *key, uint32_t nkey, uchar *buf, uint32_t nbuf, uint32_t *out_nval, int *out_found) {
+    int rv;
+    int found;
+    uint64_t offset;
+    uint32_t len;
+    uint16_t cksum;
+    uint8_t del;
+    uint64_t key_i;
 
-    /* Binary search sorted idx records for key */
-    while (end >= start) {
-        look = (start + end) / 2;
-        try(_crawdb_read_idx_record(craw, look));
-        rv = memcmp(craw->rec, key, craw->nkey);
-        if (rv == 0) {
-            _crawdb_parse_idx_record(craw, out_offset, out_len, out_cksum, out_del);
-            *out_key_i = look;
-            *out_found = 1;
-            return CRAWDB_OK;
-        } else if (rv < 0) {
-            start = look + 1;
-        } else if (rv > 0) {
-            end = look - 1;
-        }
+    /* Find key */
+    try(_crawdb_find(craw, key, nkey, &found, &offset, &len, &cksum, &del, &key_i));
+    if (!found || del) {
+        *out_nval = 0;
+        *out_found = 0;
+        return CRAWDB_OK;
     }
 
-    *out_found = 0;
-    return CRAWDB_OK;
+    /* Report required size if buf is too small */
+    *out_nval = len;
+    *out_found = 1;
+    return_if_err(len > nbuf, CRAWDB_ERR_GET_BUF);
+
+    /* Read straight into buf */
+    timer_start(t_data);
+    rv = _crawdb_read_data(craw, offset, len, cksum, buf);
+    timer_add(t_data, get_data_ns);
+    return rv;
 }
 
-static int _crawdb_get_lsearch(crawdb_t *craw, uchar *key, int *out_found, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del, uint64_t *out_key_i) {
-    uint64_t cur;
-    uint64_t look;
-    int rv;
+int crawdb_get_multi(crawdb_t *craw, uchar **keys, uint32_t *nkeys, uint64_t n, uchar *buf, uint64_t nbuf, uint64_t *out_offsets, uint32_t *out_nvals, int *out_rvs) {
+    int found;
+    uint64_t offset;
+    uint32_t len;
+    uint16_t cksum;
+    uint8_t del;
+    uint64_t key_i;
+    uint64_t pos;
+    uint64_t i;
 
-    /* Reverse linear search unsorted idx records for key */
-    for (cur = 0; cur < craw->nunsorted; ++cur) {
-        look = (craw->ntotal - 1) - cur;
-        try(_crawdb_read_idx_record(craw, look));
-        rv = memcmp(craw->rec, key, craw->nkey);
-        if (rv == 0) {
-            _crawdb_parse_idx_record(craw, out_offset, out_len, out_cksum, out_del);
-            *out_key_i = look;
-            *out_found = 1;
-            return CRAWDB_OK;
+    /* Pack values into buf; each key gets its own result */
+    pos = 0;
+    for (i = 0; i < n; i++) {
+        out_offsets[i] = pos;
+        out_nvals[i] = 0;
+        out_rvs[i] = _crawdb_find(craw, keys[i], nkeys[i], &found, &offset, &len, &cksum, &del, &key_i);
+        if (out_rvs[i] != CRAWDB_OK) continue;
+        if (!found || del) {
+            out_rvs[i] = CRAWDB_ERR_GET_NOT_FOUND;
+            continue;
+        }
+
+        /* Report required size for values that do not fit */
+        out_nvals[i] = len;
+        if (len > nbuf - pos) {
+            out_rvs[i] = CRAWDB_ERR_GET_BUF;
+            continue;
         }
+
+        timer_start(t_data);
+        out_rvs[i] = _crawdb_read_data(craw, offset, len, cksum, buf + pos);
+        timer_add(t_data, get_data_ns);
+        if (out_rvs[i] == CRAWDB_OK) pos += len;
     }
 
-    *out_found = 0;
     return CRAWDB_OK;
 }
 
-static int _crawdb_read_idx_record(crawdb_t *craw, uint64_t key_i) {
+int crawdb_get_i(crawdb_t *craw, uint64_t i, uchar **out_key, uint32_t *out_nkey, uchar **out_val, uint32_t *out_nval) {
+    return _crawdb_get_ex(craw, 0, NULL, 0, i, out_key, out_nkey, out_val, out_nval, &i);
+}
+
+int crawdb_get_begin(crawdb_t *craw, uchar *key, uint32_t nkey, uint32_t *out_nval, int *out_found) {
+    int rv;
+    int found;
     uint64_t offset;
+    uint32_t len;
+    uint16_t cksum;
+    uint8_t del;
+    uint64_t key_i;
 
-    /* Allocate rec if needed */
-    if (!craw->rec) {
-        craw->rec = malloc(craw->nrec);
-    }
+    craw->get_active = 0;
 
-    /* Read index record */
-    offset = CRAWDB_HEADER_SIZE + (key_i * craw->nrec);
-    if (pread(craw->fd_idx, craw->rec, craw->nrec, offset) != craw->nrec) {
-        return CRAWDB_ERR_READ_IDX_RECORD;
+    /* Find key */
+    try(_crawdb_find(craw, key, nkey, &found, &offset, &len, &cksum, &del, &key_i));
+    if (!found || del) {
+        *out_nval = 0;
+        *out_found = 0;
+        return CRAWDB_OK;
     }
 
-    return CRAWDB_OK;
-}
+    /* Start stream */
+    craw->get_offset = offset;
+    craw->get_len = len;
+    craw->get_pos = 0;
+    craw->get_cksum = cksum;
+    craw->get_crc = CRAWDB_CKSUM_INIT;
+    craw->get_verify = 1;
+    craw->get_active = 1;
 
-static int _crawdb_parse_idx_record(crawdb_t *craw, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del) {
-    memcpy(out_offset, craw->rec + craw->nkey, 8);
-    memcpy(out_len,    craw->rec + craw->nkey + 8, 4);
-    memcpy(out_cksum,  craw->rec + craw->nkey + 8 + 4, 2);
-    memcpy(out_del,    craw->rec + craw->nkey + 8 + 4 + 2, 1);
+    *out_nval = len;
+    *out_found = 1;
     return CRAWDB_OK;
 }
 
-static int _crawdb_get_data(crawdb_t *craw, uint64_t offset, uint32_t len, uint16_t cksum, uchar **out_val, uint32_t *out_nval) {
-    uint16_t dat_cksum;
+int crawdb_get_chunk(crawdb_t *craw, uint32_t pos, uchar *buf, uint32_t nbuf, uint32_t *out_nread) {
+    int rv;
+    uint32_t n;
+    int fd;
+    uint64_t dat_pos;
 
-    /* Allocate data buf */
-    if (!craw->data) {
-        craw->data = malloc(len);
-    } else if (len > craw->ndata) {
-        craw->data = realloc(craw->data, len);
-    }
+    /* Check stream state */
+    return_if_err(!craw->get_active,  CRAWDB_ERR_GET_STREAM);
+    return_if_err(pos > craw->get_len, CRAWDB_ERR_GET_STREAM);
 
     /* Read from dat file */
-    if (pread(craw->fd_dat, craw->data, len, offset) != len) {
+    try(_crawdb_dat_fd(craw, craw->get_offset, &fd, &dat_pos));
+    n = craw->get_len - pos;
+    if (n > nbuf) n = nbuf;
+    craw->stats.preads += 1;
+    craw->stats.pread_bytes += n;
+    if (pread(fd, buf, n, dat_pos + pos) != n) {
         return CRAWDB_ERR_GET_DATA_READ;
     }
+    *out_nread = n;
 
-    /* Calc and compare checksum */
-    dat_cksum = 0;
-    crawdb_cksum(craw->data, len, &dat_cksum);
-    if (dat_cksum != cksum) {
-        return CRAWDB_ERR_GET_DATA_CKSUM;
+    /* Checksum is only verifiable over a sequential read */
+    if (pos != craw->get_pos) {
+        craw->get_verify = 0;
+    }
+    if (!craw->get_verify || n == 0) {
+        return CRAWDB_OK;
+    }
+    craw->get_crc = _crawdb_cksum_update(craw->get_crc, buf, n);
+    craw->get_pos += n;
+    craw->stats.cksum_bytes += n;
+
+    /* Compare checksum on last chunk */
+    if (craw->get_pos == craw->get_len) {
+        craw->get_verify = 0;
+        if (_crawdb_cksum_final(craw->get_crc) != craw->get_cksum) {
+            craw->stats.cksum_failures += 1;
+            return CRAWDB_ERR_GET_DATA_CKSUM;
+        }
     }
 
-    *out_val = craw->data;
-    *out_nval = len;
     return CRAWDB_OK;
 }
 
-static int _crawdb_index_copy(crawdb_t *craw, int *out_fd_copy, char **out_path_copy) {
-    int rv;
-    int rc;
-    char *path_copy;
-    size_t path_copy_len;
-    int fd_copy;
-    ssize_t iorv;
-    off_t offset;
+int crawdb_async_new(crawdb_t *craw, uint32_t depth, int flags, crawdb_async_t **out_async) {
+    crawdb_async_t *async;
+    uint32_t i;
+
+    async = calloc(1, sizeof(crawdb_async_t));
+    async->craw = craw;
+    async->depth = depth < 1 ? CRAWDB_ASYNC_DEPTH : depth;
+    async->ring_fd = -1;
+
+    /* One op per lookup in flight, each with at most one read outstanding */
+    async->ops = calloc(async->depth, sizeof(crawdb_async_op_t));
+    for (i = 0; i < async->depth; i++) {
+        async->ops[i].key = malloc(craw->nkey);
+        async->ops[i].rec = malloc(craw->nrec);
+        async->ops[i].next = (i + 1 < async->depth) ? &async->ops[i + 1] : NULL;
+    }
+    async->free_ops = &async->ops[0];
 
-    path_copy = NULL;
-    fd_copy = -1;
+    /* Fall back to pread if io_uring is unavailable */
+    if (!(flags & CRAWDB_ASYNC_PREAD)) {
+        _crawdb_async_ring_setup(async);
+    }
 
-    /* Lock */
-    rc = _crawdb_lock(craw);
-    goto_if_err(rc != CRAWDB_OK, rc, _crawdb_index_copy_err);
+    *out_async = async;
+    return CRAWDB_OK;
+}
 
-    /* Reload without O_APPEND */
-    rc = _crawdb_reload_for_index(craw);
-    goto_if_err(rc != CRAWDB_OK, rc, _crawdb_index_copy_err);
+int crawdb_async_submit(crawdb_async_t *async, uchar *key, uint32_t nkey, uint64_t user) {
+    crawdb_async_op_t *op;
+
+    /* Take a free op */
+    return_if_err(!async->free_ops, CRAWDB_ERR_ASYNC_FULL);
+    op = async->free_ops;
+    async->free_ops = op->next;
+    op->next = NULL;
+    op->user = user;
+    op->found = 0;
+    op->look = 0;
+    async->ninflight += 1;
+
+    /* Validate and pad key */
+    if (nkey > async->craw->nkey || nkey < 1) {
+        _crawdb_async_finish(async, op, CRAWDB_ERR_GET_BAD_KEY);
+        return CRAWDB_OK;
+    }
+    memset(op->key, 0, async->craw->nkey);
+    memcpy(op->key, key, nkey);
 
-    /* Open copy file */
-    path_copy_len = strlen(craw->idx_path) + 5; /* ".copy" (5) */
-    path_copy = malloc(path_copy_len + 1);
-    snprintf(path_copy, path_copy_len + 1, "%s.copy", craw->idx_path);
-    fd_copy = open(path_copy, O_RDWR | O_CREAT | O_TRUNC, 00644);
-    goto_if_err(fd_copy < 0, CRAWDB_ERR_INDEX_OPEN_COPY, _crawdb_index_copy_err);
+    /* Reads are queued here and issued by crawdb_async_complete */
+    _crawdb_async_start(async, op);
+    return CRAWDB_OK;
+}
 
-    /* Copy index */
-    offset = lseek(craw->fd_idx, 0, SEEK_SET);
-    goto_if_err(offset < 0, CRAWDB_ERR_INDEX_LSEEK, _crawdb_index_copy_err);
-    offset = lseek(fd_copy, 0, SEEK_SET);
-    goto_if_err(offset < 0, CRAWDB_ERR_INDEX_LSEEK, _crawdb_index_copy_err);
-    iorv = copy_file_range(craw->fd_idx, NULL, fd_copy, NULL, (size_t)craw->idx_size, 0);
-    goto_if_err(iorv != (ssize_t)craw->idx_size, CRAWDB_ERR_INDEX_COPY, _crawdb_index_copy_err);
+int crawdb_async_complete(crawdb_async_t *async, uint32_t min_complete, crawdb_async_result_t *out_results, uint32_t nresults, uint32_t *out_n) {
+    int rv;
+    uint32_t n;
+    crawdb_async_op_t *op;
+
+    /* Recycle ops handed out by the previous call */
+    while ((op = async->retired)) {
+        async->retired = op->next;
+        op->next = async->free_ops;
+        async->free_ops = op;
+    }
 
-    /* Unlock */
-    rc = _crawdb_unlock(craw);
-    goto_if_err(rc != CRAWDB_OK, rc, _crawdb_index_copy_err);
+    /* Drive reads until enough lookups are done */
+    if (min_complete > nresults) min_complete = nresults;
+    if (min_complete > async->ninflight) min_complete = async->ninflight;
+    try(_crawdb_async_pump(async, min_complete));
+
+    /* Hand out results; vals stay valid until the next call */
+    for (n = 0; n < nresults && (op = async->done_head); n++) {
+        async->done_head = op->next;
+        if (!async->done_head) async->done_tail = NULL;
+        async->ndone -= 1;
+        async->ninflight -= 1;
+        out_results[n].user = op->user;
+        out_results[n].rv = op->rv;
+        out_results[n].found = op->found;
+        out_results[n].val = op->found ? op->val : NULL;
+        out_results[n].nval = op->found ? op->len : 0;
+        out_results[n].key_i = op->look;
+        op->next = async->retired;
+        async->retired = op;
+    }
 
-    *out_fd_copy = fd_copy;
-    *out_path_copy = path_copy;
+    *out_n = n;
     return CRAWDB_OK;
-
-_crawdb_index_copy_err:
-    _crawdb_unlock_if_locked(craw);
-    if (path_copy) free(path_copy);
-    if (fd_copy >= 0) close(fd_copy);
-    return rv;
 }
 
-static int _crawdb_index_sort_cmp(const void *a, const void *b, void *arg) {
-    crawdb_t *craw;
-    craw = arg;
-    return memcmp(a, b, craw->nkey);
+int crawdb_async_free(crawdb_async_t *async) {
+    crawdb_async_result_t *results;
+    uint32_t n;
+    uint32_t i;
+
+    /* Wait out reads still owned by the kernel */
+    results = malloc(async->depth * sizeof(crawdb_async_result_t));
+    while (async->ninflight > 0) {
+        if (crawdb_async_complete(async, async->ninflight, results, async->depth, &n) != CRAWDB_OK) break;
+    }
+    free(results);
+
+    if (async->sq_map) munmap(async->sq_map, async->nsq_map);
+    if (async->cq_map) munmap(async->cq_map, async->ncq_map);
+    if (async->sqes) munmap(async->sqes, async->nsqes);
+    if (async->ring_fd >= 0) close(async->ring_fd);
+    for (i = 0; i < async->depth; i++) {
+        free(async->ops[i].key);
+        free(async->ops[i].rec);
+        free(async->ops[i].val);
+    }
+    free(async->ops);
+    free(async);
+    return CRAWDB_OK;
 }
 
-static int _crawdb_index_sort(crawdb_t *craw, char *path_copy, int *inout_fd_copy, char **out_path_new, int *out_fd_new, long *out_size_new) {
+int crawdb_tail(crawdb_t *craw, uint64_t gen, uint64_t idx_pos, uint64_t dat_pos, uint64_t del_pos, uchar *buf, uint64_t nbuf, crawdb_tail_t *out_tail) {
     int rv;
-    char *path_new;
-    int fd_new;
-    long size_new;
-    size_t path_new_len;
+    int fd;
     ssize_t iorv;
-    uchar *buf;
-    uint64_t i;
-    off_t offset;
+    uint8_t dead;
+    off_t idx_end;
+    off_t dat_end;
+    uint64_t room;
+    uint64_t ndel;
+    uint64_t log_gen;
+    char *path_del;
+    size_t path_len;
+
+    /* Buf must fit a header and a record to make progress */
+    return_if_err(nbuf < CRAWDB_HEADER_SIZE + craw->nrec, CRAWDB_ERR_TAIL_BUF);
+
+    /* Follow index swaps */
+    return_if_err(_crawdb_read_ends(craw, &dead, &idx_end, &dat_end) != CRAWDB_OK, CRAWDB_ERR_TAIL_READ);
+    if (dead != 0) {
+        craw->stats.dead_flags += 1;
+        try(crawdb_reload(craw));
+        return_if_err(_crawdb_read_ends(craw, &dead, &idx_end, &dat_end) != CRAWDB_OK, CRAWDB_ERR_TAIL_READ);
+    }
+    return_if_err(idx_end < (off_t)craw->nheader, CRAWDB_ERR_TAIL_READ);
 
-    path_new = NULL;
-    fd_new = -1;
-    buf = NULL;
+    /* Deletes count up in place */
+    ndel = 0;
+    if (craw->vers > 1) {
+        return_if_err(pread(craw->fd_idx, &ndel, 8, CRAWDB_OFFSET_NDEL) != 8, CRAWDB_ERR_TAIL_READ);
+    }
 
-    /* Open file */
-    path_new_len = strlen(craw->idx_path) + 4; /* ".new" (4) */
-    path_new = malloc(path_new_len + 1);
-    snprintf(path_new, path_new_len + 1, "%s.new", craw->idx_path);
-    fd_new = open(path_new, O_RDWR | O_CREAT | O_TRUNC, 00644);
-    goto_if_err(fd_new < 0, CRAWDB_ERR_SORT_OPEN_NEW, _crawdb_index_sort_err);
+    /* Tail ships a single dat stream */
+    return_if_err(craw->flags & CRAWDB_FLAG_SEGMENTED, CRAWDB_ERR_SEGMENT_MODE);
+    idx_end = craw->nheader + (((idx_end - craw->nheader) / craw->nrec) * craw->nrec);
 
-    /* Read copy into memory for sorting */
-    buf = malloc(craw->idx_size);
-    iorv = pread(*inout_fd_copy, buf, craw->idx_size - CRAWDB_HEADER_SIZE, CRAWDB_HEADER_SIZE);
-    goto_if_err(iorv != craw->idx_size - CRAWDB_HEADER_SIZE, CRAWDB_ERR_SORT_READ, _crawdb_index_sort_err);
+    /* Resend idx from the start on a new generation */
+    if (gen != craw->gen || idx_pos == 0 || idx_pos > (uint64_t)idx_end || del_pos > ndel) {
+        idx_pos = 0;
+    }
+    return_if_err(idx_pos > 0 && (idx_pos < craw->nheader || (idx_pos - craw->nheader) % craw->nrec != 0), CRAWDB_ERR_TAIL_POS);
+    return_if_err(dat_pos > (uint64_t)dat_end, CRAWDB_ERR_TAIL_POS);
+
+    out_tail->gen = craw->gen;
+    out_tail->del_pos = del_pos;
+    out_tail->del_len = 0;
+
+    /* Ship record indexes deleted since del_pos from <idx>.del ahead of dat */
+    if (idx_pos > 0 && del_pos < ndel) {
+        out_tail->del_len = ndel - del_pos;
+        room = (nbuf - CRAWDB_HEADER_SIZE - craw->nrec) / 8;
+        if (out_tail->del_len > room) {
+            out_tail->del_len = room;
+        }
+        path_len = strlen(craw->idx_path) + 4; /* ".del" (4) */
+        path_del = malloc(path_len + 1);
+        snprintf(path_del, path_len + 1, "%s.del", craw->idx_path);
+        fd = open(path_del, O_RDONLY);
+        free(path_del);
+
+        /* Gen is checked again after the read in case an index restarted the log */
+        if (fd < 0
+            || pread(fd, &log_gen, 8, 0) != 8 || log_gen != craw->gen
+            || pread(fd, buf, out_tail->del_len * 8, CRAWDB_DEL_LOG_HEADER + (del_pos * 8)) != (ssize_t)(out_tail->del_len * 8)
+            || pread(fd, &log_gen, 8, 0) != 8 || log_gen != craw->gen
+        ) {
+            /* Without the log, resend the idx, which carries the flags */
+            out_tail->del_len = 0;
+            idx_pos = 0;
+        }
+        if (fd >= 0) close(fd);
+        buf += out_tail->del_len * 8;
+        nbuf -= out_tail->del_len * 8;
+    }
 
-    /* Copy header */
-    offset = lseek(*inout_fd_copy, 0, SEEK_SET);
-    goto_if_err(offset < 0, CRAWDB_ERR_SORT_LSEEK, _crawdb_index_sort_err);
-    iorv = copy_file_range(*inout_fd_copy, NULL, fd_new, NULL, CRAWDB_HEADER_SIZE, 0);
-    goto_if_err(iorv != CRAWDB_HEADER_SIZE, CRAWDB_ERR_SORT_COPY_HEADER, _crawdb_index_sort_err);
+    out_tail->idx_pos = idx_pos;
+    out_tail->idx_len = 0;
+    out_tail->idx_end = (uint64_t)idx_end;
+    out_tail->dat_pos = dat_pos;
+    out_tail->dat_len = (uint64_t)dat_end - dat_pos;
 
-    /* Set nsorted */
-    iorv = pwrite(fd_new, &craw->ntotal, 8, CRAWDB_OFFSET_NSORTED);
-    goto_if_err(iorv != 8, CRAWDB_ERR_SORT_WRITE_NSORTED, _crawdb_index_sort_err);
+    /* Ship dat first */
+    if (out_tail->dat_len > nbuf) {
+        out_tail->dat_len = nbuf;
+    }
+    iorv = pread(craw->fd_dat, buf, out_tail->dat_len, dat_pos);
+    return_if_err(iorv != (ssize_t)out_tail->dat_len, CRAWDB_ERR_TAIL_READ);
+    craw->stats.preads += 1;
+    craw->stats.pread_bytes += out_tail->dat_len;
 
-    /* Close and delete copy file */
-    close(*inout_fd_copy);
-    *inout_fd_copy = -1;
-    unlink(path_copy);
+    /* Ship whole idx records only once dat is caught up, so none point past it */
+    if (dat_pos + out_tail->dat_len < (uint64_t)dat_end) {
+        return CRAWDB_OK;
+    }
+    room = nbuf - out_tail->dat_len;
+    out_tail->idx_len = (uint64_t)idx_end - idx_pos;
+    if (out_tail->idx_len > room) {
+        if (idx_pos == 0) {
+            out_tail->idx_len = room < craw->nheader ? 0 : craw->nheader + (((room - craw->nheader) / craw->nrec) * craw->nrec);
+        } else {
+            out_tail->idx_len = (room / craw->nrec) * craw->nrec;
+        }
+    }
+    iorv = pread(craw->fd_idx, buf + out_tail->dat_len, out_tail->idx_len, idx_pos);
+    return_if_err(iorv != (ssize_t)out_tail->idx_len, CRAWDB_ERR_TAIL_READ);
+    craw->stats.preads += 1;
+    craw->stats.pread_bytes += out_tail->idx_len;
+
+    /* Replicas are not preallocated and take their ends from file size */
+    if (idx_pos == 0 && out_tail->idx_len >= CRAWDB_HEADER_SIZE && craw->vers > 1) {
+        buf[out_tail->dat_len + CRAWDB_OFFSET_FLAGS] &= ~CRAWDB_FLAG_PREALLOC;
+        memset(buf + out_tail->dat_len + CRAWDB_OFFSET_IDX_END, 0, 16);
+    }
 
-    /* Sort records */
-    qsort_r(buf, craw->ntotal, craw->nrec, _crawdb_index_sort_cmp, craw);
+    return CRAWDB_OK;
+}
 
-    /* Write sorted records to new */
-    for (i = 0; i < craw->ntotal; i++) {
-        /* TODO skip deleted keys? */
-        iorv = pwrite(fd_new, buf + (craw->nrec * i), craw->nrec, CRAWDB_HEADER_SIZE + (craw->nrec * i));
-        goto_if_err(iorv != craw->nrec, CRAWDB_ERR_SORT_WRITE_REC, _crawdb_index_sort_err);
+int crawdb_tail_pos(char *idx_path, char *dat_path, uint64_t *out_gen, uint64_t *out_idx_pos, uint64_t *out_dat_pos, uint64_t *out_del_pos) {
+    char *path_follow;
+    size_t path_len;
+    char *path;
+    struct stat st;
+    uchar header[CRAWDB_HEADER_SIZE];
+    int fd;
+
+    *out_gen = 0;
+    *out_idx_pos = 0;
+    *out_dat_pos = 0;
+    *out_del_pos = 0;
+
+    /* A resync in progress takes precedence over the live idx */
+    path_len = strlen(idx_path) + 7; /* ".follow" (7) */
+    path_follow = malloc(path_len + 1);
+    if (snprintf(path_follow, path_len + 1, "%s.follow", idx_path) != (int)path_len) {
+        free(path_follow);
+        return CRAWDB_ERR_TAIL_POS;
     }
-    free(buf);
+    path = stat(path_follow, &st) == 0 ? path_follow : idx_path;
+
+    /* Position in idx is its size, gen and deletes applied are from its header */
+    fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        memset(header, 0, sizeof(header));
+        if (fstat(fd, &st) == 0 && pread(fd, header, CRAWDB_HEADER_SIZE, 0) >= CRAWDB_HEADER_SIZE_V1) {
+            *out_idx_pos = (uint64_t)st.st_size;
+            if (header[4] > 1) memcpy(out_gen, header + CRAWDB_OFFSET_GEN, 8);
+            if (header[4] > 1) memcpy(out_del_pos, header + CRAWDB_OFFSET_NDEL, 8);
+        }
+        close(fd);
+    }
+    free(path_follow);
 
-    /* Get size of new file */
-    size_new = lseek(fd_new, 0, SEEK_END);
-    goto_if_err(size_new < 0, CRAWDB_ERR_SORT_LSEEK, _crawdb_index_sort_err);
+    if (stat(dat_path, &st) == 0) {
+        *out_dat_pos = (uint64_t)st.st_size;
+    }
 
-    *out_path_new = path_new;
-    *out_fd_new = fd_new;
-    *out_size_new = size_new;
     return CRAWDB_OK;
-
-_crawdb_index_sort_err:
-    if (path_new) free(path_new);
-    if (fd_new >= 0) close(fd_new);
-    if (buf) free(buf);
-    return rv;
 }
 
-static int _crawdb_index_swap(crawdb_t *craw, char *path_new, int fd_new, long size_new) {
+int crawdb_tail_apply(char *idx_path, char *dat_path, crawdb_tail_t *tail, uchar *buf) {
     int rv;
-    int rc;
+    int fd;
+    int resync;
+    char *path_follow;
+    size_t path_len;
+    struct stat st;
     ssize_t iorv;
-    loff_t offset_dst;
-    loff_t offset_src;
-    long idx_size_after;
-    size_t copy_len;
     uint8_t dead;
+    uchar *dels;
+    uint32_t nkey;
+    uint64_t ndel;
+    uint64_t key_i;
+    uint64_t i;
 
-    /* Lock */
-    try(_crawdb_lock(craw));
+    fd = -1;
+    dels = buf;
+    buf += tail->del_len * 8;
+    path_len = strlen(idx_path) + 7; /* ".follow" (7) */
+    path_follow = malloc(path_len + 1);
+    goto_if_err(snprintf(path_follow, path_len + 1, "%s.follow", idx_path) != (int)path_len, CRAWDB_ERR_APPLY_OPEN, crawdb_tail_apply_end);
+
+    /* Write dat first so idx records never point past it */
+    if (tail->dat_len > 0) {
+        fd = open(dat_path, O_WRONLY | O_CREAT, 00644);
+        goto_if_err(fd < 0, CRAWDB_ERR_APPLY_OPEN, crawdb_tail_apply_end);
+        iorv = pwrite(fd, buf, tail->dat_len, tail->dat_pos);
+        goto_if_err(iorv != (ssize_t)tail->dat_len, CRAWDB_ERR_APPLY_WRITE, crawdb_tail_apply_end);
+        close(fd);
+        fd = -1;
+    }
 
-    /* Determine idx size again */
-    /* TODO ensure value makes sense */
-    idx_size_after = lseek(craw->fd_idx, 0, SEEK_END);
-    return_if_err(idx_size_after < 0, CRAWDB_ERR_SWAP_LSEEK);
+    /* A new generation is rebuilt beside the live idx */
+    if (tail->idx_len > 0) {
+        if (tail->idx_pos == 0) {
+            fd = open(path_follow, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+        } else if (stat(path_follow, &st) == 0) {
+            fd = open(path_follow, O_WRONLY);
+        } else {
+            fd = open(idx_path, O_WRONLY);
+        }
+        goto_if_err(fd < 0, CRAWDB_ERR_APPLY_OPEN, crawdb_tail_apply_end);
+        iorv = pwrite(fd, buf + tail->dat_len, tail->idx_len, tail->idx_pos);
+        goto_if_err(iorv != (ssize_t)tail->idx_len, CRAWDB_ERR_APPLY_WRITE, crawdb_tail_apply_end);
+        close(fd);
+        fd = -1;
+    }
 
-    /* Copy records that came in while we were indexing */
-    if (idx_size_after > craw->idx_size) {
-        copy_len = (size_t)(idx_size_after - craw->idx_size);
-        offset_src = (loff_t)craw->idx_size;
-        offset_dst = (loff_t)size_new;
-        iorv = copy_file_range(craw->fd_idx, &offset_src, fd_new, &offset_dst, copy_len, 0);
-        return_if_err(iorv != (ssize_t)copy_len, CRAWDB_ERR_SWAP_COPY);
+    /* Swap in the rebuilt idx once it has caught up */
+    resync = stat(path_follow, &st) == 0;
+    if (resync && tail->idx_pos + tail->idx_len == tail->idx_end && (uint64_t)st.st_size == tail->idx_end) {
+        fd = open(idx_path, O_WRONLY);
+        if (fd >= 0) {
+            dead = 1;
+            iorv = pwrite(fd, &dead, 1, CRAWDB_OFFSET_DEAD);
+            goto_if_err(iorv != 1, CRAWDB_ERR_APPLY_WRITE, crawdb_tail_apply_end);
+            close(fd);
+            fd = -1;
+        }
+        goto_if_err(rename(path_follow, idx_path) != 0, CRAWDB_ERR_APPLY_RENAME, crawdb_tail_apply_end);
     }
 
-    /* Rename idx to new */
-    rc = rename(path_new, craw->idx_path);
-    return_if_err(rc != CRAWDB_OK, CRAWDB_ERR_SWAP_RENAME);
+    /* Replay deletes on records we have; later ones arrive with the flag set */
+    if (tail->del_len > 0) {
+        fd = open(idx_path, O_RDWR);
+        goto_if_err(fd < 0, CRAWDB_ERR_APPLY_OPEN, crawdb_tail_apply_end);
+        goto_if_err(fstat(fd, &st) != 0, CRAWDB_ERR_APPLY_OPEN, crawdb_tail_apply_end);
+        iorv = pread(fd, &nkey, 4, 5);
+        goto_if_err(iorv != 4 || nkey < 1, CRAWDB_ERR_APPLY_OPEN, crawdb_tail_apply_end);
+        dead = 1;
+        for (i = 0; i < tail->del_len; i++) {
+            memcpy(&key_i, dels + (i * 8), 8);
+            if (CRAWDB_HEADER_SIZE + ((key_i + 1) * (nkey + 15)) > (uint64_t)st.st_size) continue;
+            iorv = pwrite(fd, &dead, 1, CRAWDB_HEADER_SIZE + (key_i * (nkey + 15)) + nkey + 8 + 4 + 2);
+            goto_if_err(iorv != 1, CRAWDB_ERR_APPLY_WRITE, crawdb_tail_apply_end);
+        }
+        ndel = tail->del_pos + tail->del_len;
+        iorv = pwrite(fd, &ndel, 8, CRAWDB_OFFSET_NDEL);
+        goto_if_err(iorv != 8, CRAWDB_ERR_APPLY_WRITE, crawdb_tail_apply_end);
+        close(fd);
+        fd = -1;
+    }
 
-    /* Write dead byte on old idx */
-    dead = 1;
-    iorv = pwrite(craw->fd_idx, &dead, 1, CRAWDB_OFFSET_DEAD);
-    return_if_err(iorv != 1, CRAWDB_ERR_SWAP_WRITE_DEAD);
+    rv = CRAWDB_OK;
+
+crawdb_tail_apply_end:
+    if (fd >= 0) close(fd);
+    free(path_follow);
+    return rv;
+}
+
+int crawdb_cksum(uchar *val, uint32_t len, uint16_t *out_cksum) {
+    *out_cksum = _crawdb_cksum_final(_crawdb_cksum_update(CRAWDB_CKSUM_INIT, val, len));
+    return CRAWDB_OK;
+}
+
+int crawdb_index(crawdb_t *craw) {
+    int rv;
+    int rc;
+    char *path_copy;
+    char *path_new;
+    int fd_copy;
+    int fd_new;
+    long size_new;
+
+    path_copy = NULL;
+    path_new = NULL;
+    fd_copy = -1;
+    fd_new = -1;
+    size_new = 0;
+
+    /* Index reopens files which would drop a batch lock */
+    return_if_err(craw->batch, CRAWDB_ERR_BATCH_ACTIVE);
+    return_if_err(craw->snapshot, CRAWDB_ERR_SNAPSHOT_WRITE);
+
+    /* Copy index */
+    timer_start(t_copy);
+    rc =_crawdb_index_copy(craw, &fd_copy, &path_copy);
+    timer_add(t_copy, index_copy_ns);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_index_end);
+
+    /* Sort into new index */
+    fd_new = -1;
+    timer_start(t_sort);
+    rc = _crawdb_index_sort(craw, path_copy, &fd_copy, &path_new, &fd_new, &size_new);
+    timer_add(t_sort, index_sort_ns);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_index_end);
+
+    /* Swap in new index and copy intermediate records */
+    timer_start(t_swap);
+    rc = _crawdb_index_swap(craw, path_new, fd_new, size_new);
+    timer_add(t_swap, index_swap_ns);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_index_end);
+
+    rv = CRAWDB_OK;
+
+crawdb_index_end:
+    if (rv != CRAWDB_OK) flock(craw->fd_dat, LOCK_UN);
+    if (path_copy) free(path_copy);
+    if (path_new) free(path_new);
+    if (fd_copy >= 0) close(fd_copy);
+    if (fd_new >= 0) close(fd_new);
+    return rv;
+}
+
+int crawdb_freeze(crawdb_t *craw) {
+    int rv;
+    int rc;
+    uchar *buf;
+    uint64_t *words;
+    uint64_t nwords;
+    uint64_t levels[CRAWDB_MPH_MAX_LEVELS + 1];
+    uint32_t nlevels;
+    uint64_t *table;
+    uint64_t *key_is;
+    uint64_t nlive;
+    uint64_t rank;
+    uint64_t i;
+    uchar *rec;
+    size_t nbuf;
+    ssize_t iorv;
+    crawdb_mph_t mph;
+
+    buf = NULL;
+    words = NULL;
+    table = NULL;
+    key_is = NULL;
+
+    /* Sort any unsorted records first */
+    if (craw->nunsorted > 0) {
+        rc = crawdb_index(craw);
+        goto_if_err(rc != CRAWDB_OK, rc, crawdb_freeze_end);
+    }
+
+    /* Writes raced the index; caller should retry */
+    goto_if_err(craw->nunsorted > 0, CRAWDB_ERR_FREEZE_UNSORTED, crawdb_freeze_end);
+
+    /* Read sorted records into memory */
+    nbuf = craw->ntotal * craw->nrec;
+    buf = malloc(nbuf > 0 ? nbuf : 1);
+    iorv = pread(craw->fd_idx, buf, nbuf, craw->nheader);
+    goto_if_err(iorv != (ssize_t)nbuf, CRAWDB_ERR_FREEZE_READ, crawdb_freeze_end);
+
+    /* Keep the last live record per key, remembering where each came from */
+    table = malloc(craw->ntotal > 0 ? craw->ntotal * 8 : 1);
+    key_is = malloc(craw->ntotal > 0 ? craw->ntotal * 8 : 1);
+    for (i = 0, nlive = 0; i < craw->ntotal; i++) {
+        rec = buf + (craw->nrec * i);
+        if (rec[craw->nkey + 14]) continue;
+        if (nlive > 0 && _crawdb_key_cmp_full(craw, buf + (craw->nrec * (nlive - 1)), rec) == 0) {
+            nlive -= 1;
+        }
+        if (nlive != i) memcpy(buf + (craw->nrec * nlive), rec, craw->nrec);
+        key_is[nlive++] = i;
+    }
+
+    /* Build hash levels */
+    rc = _crawdb_freeze_build(craw, buf, nlive, &words, &nwords, levels, &nlevels);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_freeze_end);
+
+    /* Build rank table and map each slot to its key_i */
+    mph.nlevels = nlevels;
+    mph.ntotal = craw->ntotal;
+    mph.nkeys = nlive;
+    mph.levels = levels;
+    mph.words = words;
+    mph.ranks = words + nwords;
+    for (i = 0, rank = 0; i < nwords; i++) {
+        mph.ranks[i] = rank;
+        rank += __builtin_popcountll(words[i]);
+    }
+    for (i = 0; i < nlive; i++) {
+        rc = _crawdb_mph_slot(&mph, buf + (craw->nrec * i), craw->nkey, craw->nkey, &rank);
+        goto_if_err(rc != CRAWDB_OK || rank >= nlive, CRAWDB_ERR_FREEZE_LEVELS, crawdb_freeze_end);
+        table[rank] = key_is[i];
+    }
+
+    /* Write sidecar */
+    rc = _crawdb_freeze_write(craw, words, nwords, levels, nlevels, table, nlive);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_freeze_end);
+
+    /* Reload to map sidecar */
+    rc = crawdb_reload(craw);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_freeze_end);
+
+    rv = CRAWDB_OK;
+
+crawdb_freeze_end:
+    if (buf) free(buf);
+    if (words) free(words);
+    if (table) free(table);
+    if (key_is) free(key_is);
+    return rv;
+}
+
+int crawdb_prewarm(crawdb_t *craw, int flags) {
+    int rv;
+    uchar *map;
+
+    /* Values are fetched at random */
+    posix_fadvise(craw->fd_dat, 0, 0, POSIX_FADV_RANDOM);
+
+    /* Perfect hash is probed once per lookup */
+    if (craw->mph) {
+        madvise(craw->mph->map, craw->mph->nmap, MADV_WILLNEED);
+    }
+
+    /* Fault in the binary search path, or the whole idx */
+    try(_crawdb_prewarm_idx(craw, craw->fd_idx, craw->nheader, craw->nsorted, flags));
+
+    /* Pin idx until free or reload */
+    if (flags & CRAWDB_PREWARM_MLOCK) {
+        _crawdb_prewarm_unmap(craw);
+        map = mmap(NULL, craw->idx_size, PROT_READ, MAP_SHARED, craw->fd_idx, 0);
+        return_if_err(map == MAP_FAILED, CRAWDB_ERR_PREWARM_MLOCK);
+        madvise(map, craw->idx_size, MADV_WILLNEED);
+        if (mlock(map, craw->idx_size) != 0) {
+            munmap(map, craw->idx_size);
+            return CRAWDB_ERR_PREWARM_MLOCK;
+        }
+        craw->warm_map = map;
+        craw->nwarm_map = craw->idx_size;
+    }
+
+    return CRAWDB_OK;
+}
+
+int crawdb_scrub(crawdb_t *craw, uint32_t nthreads, int flags, crawdb_scrub_t *out_scrub) {
+    int rv;
+    int rc;
+    uint64_t t;
+    uchar header[CRAWDB_HEADER_SIZE];
+    uint32_t nkey;
+    uint64_t nsorted;
+    off_t idx_size;
+    off_t idx_end;
+    off_t dat_end;
+    struct stat st_idx;
+    struct stat st_dat;
+    ssize_t iorv;
+    uchar *buf;
+    uint64_t *order;
+    uchar *bad;
+    crawdb_scrub_job_t jobs[CRAWDB_SCRUB_MAX_THREADS];
+    pthread_t threads[CRAWDB_SCRUB_MAX_THREADS];
+    uint32_t nstarted;
+    uint64_t deleted_offset;
+    uint8_t deleted_val;
+    uint8_t dead;
+    uint64_t *seg_sizes;
+    uint32_t max_seg;
+    uint32_t seg;
+    uint64_t offset;
+    struct stat st_seg;
+    int fd;
+    uint64_t i;
+
+    buf = NULL;
+    order = NULL;
+    bad = NULL;
+    seg_sizes = NULL;
+    nstarted = 0;
+    memset(out_scrub, 0, sizeof(crawdb_scrub_t));
+    t = _crawdb_now_ns();
+
+    /* Check header against the handle */
+    iorv = pread(craw->fd_idx, header, craw->nheader, 0);
+    return_if_err(iorv != (ssize_t)craw->nheader, CRAWDB_ERR_SCRUB_READ);
+    return_if_err(header[CRAWDB_OFFSET_DEAD] != 0 && !craw->snapshot, CRAWDB_ERR_SET_IDX_DEAD);
+    memcpy(&nkey, header + 5, 4);
+    memcpy(&nsorted, header + CRAWDB_OFFSET_NSORTED, 8);
+    try(_crawdb_read_ends(craw, &dead, &idx_end, &dat_end));
+    idx_size = craw->snapshot ? craw->idx_size : idx_end;
+    rc = fstat(craw->fd_idx, &st_idx) | fstat(craw->fd_dat, &st_dat);
+    return_if_err(rc != 0, CRAWDB_ERR_SCRUB_READ);
+    if (memcmp(header, "CRAW", 4) != 0
+        || header[4] != craw->vers
+        || nkey != craw->nkey
+        || nsorted != craw->nsorted
+        || idx_end > st_idx.st_size
+        || dat_end > st_dat.st_size
+        || _crawdb_set_idx_size(craw, idx_size) != CRAWDB_OK
+    ) {
+        out_scrub->bad_header = 1;
+        out_scrub->ns = _crawdb_now_ns() - t;
+        return CRAWDB_ERR_SCRUB_BAD;
+    }
+    out_scrub->nrecs = craw->ntotal;
+
+    /* Read all records */
+    buf = malloc((craw->ntotal * craw->nrec) + 1);
+    iorv = pread(craw->fd_idx, buf, craw->ntotal * craw->nrec, craw->nheader);
+    goto_if_err(iorv != (ssize_t)(craw->ntotal * craw->nrec), CRAWDB_ERR_SCRUB_READ, crawdb_scrub_end);
+
+    /* Check key order and duplicates */
+    _crawdb_scrub_keys(craw, buf, nsorted, out_scrub);
+
+    /* Visit records in dat order so each thread reads its part of dat sequentially */
+    order = malloc((craw->ntotal * 8) + 1);
+    for (i = 0; i < craw->ntotal; i++) order[i] = i;
+    jobs[0].craw = craw;
+    jobs[0].buf = buf;
+    qsort_r(order, craw->ntotal, 8, _crawdb_scrub_order_cmp, &jobs[0]);
+    bad = calloc(1, craw->ntotal + 1);
+
+    /* Size every segment a live record points into; segment 0 is dat */
+    max_seg = 0;
+    for (i = 0; i < craw->ntotal; i++) {
+        if (buf[(craw->nrec * i) + craw->nkey + 8 + 4 + 2]) continue;
+        memcpy(&offset, buf + (craw->nrec * i) + craw->nkey, 8);
+        if ((offset >> CRAWDB_SEGMENT_SHIFT) > max_seg) max_seg = (uint32_t)(offset >> CRAWDB_SEGMENT_SHIFT);
+    }
+    seg_sizes = calloc(max_seg + 1, sizeof(uint64_t));
+    seg_sizes[0] = (uint64_t)dat_end;
+    for (seg = 1; seg <= max_seg; seg++) {
+        if (_crawdb_dat_fd(craw, (uint64_t)seg << CRAWDB_SEGMENT_SHIFT, &fd, &offset) != CRAWDB_OK) continue;
+        if (fstat(fd, &st_seg) == 0) seg_sizes[seg] = (uint64_t)st_seg.st_size;
+    }
+
+    /* Check dat bounds and checksums across threads */
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > CRAWDB_SCRUB_MAX_THREADS) nthreads = CRAWDB_SCRUB_MAX_THREADS;
+    for (i = 0; i < nthreads; i++) {
+        memset(&jobs[i], 0, sizeof(crawdb_scrub_job_t));
+        jobs[i].craw = craw;
+        jobs[i].buf = buf;
+        jobs[i].order = order;
+        jobs[i].start = (craw->ntotal * i) / nthreads;
+        jobs[i].end = (craw->ntotal * (i + 1)) / nthreads;
+        jobs[i].seg_sizes = seg_sizes;
+        jobs[i].bad = bad;
+    }
+    rv = CRAWDB_OK;
+    for (nstarted = 1; nstarted < nthreads; nstarted++) {
+        if (pthread_create(&threads[nstarted], NULL, _crawdb_scrub_run, &jobs[nstarted]) != 0) {
+            rv = CRAWDB_ERR_SCRUB_THREAD;
+            break;
+        }
+    }
+    if (rv == CRAWDB_OK) _crawdb_scrub_run(&jobs[0]);
+    for (i = 1; i < nstarted; i++) pthread_join(threads[i], NULL);
+    goto_if_err(rv != CRAWDB_OK, rv, crawdb_scrub_end);
+    for (i = 0; i < nthreads; i++) {
+        out_scrub->bad_bounds += jobs[i].bad_bounds;
+        out_scrub->bad_cksum += jobs[i].bad_cksum;
+        out_scrub->dat_bytes += jobs[i].dat_bytes;
+    }
+    for (i = 0; i < craw->ntotal; i++) {
+        out_scrub->ndeleted += buf[(craw->nrec * i) + craw->nkey + 8 + 4 + 2];
+    }
+
+    /* Quarantine records with bad values by setting their del flag */
+    if ((flags & CRAWDB_SCRUB_QUARANTINE) && out_scrub->bad_bounds + out_scrub->bad_cksum > 0) {
+        goto_if_err(craw->snapshot, CRAWDB_ERR_SNAPSHOT_WRITE, crawdb_scrub_end);
+        rc = _crawdb_lock(craw);
+        goto_if_err(rc != CRAWDB_OK, rc, crawdb_scrub_end);
+        dead = 0;
+        iorv = pread(craw->fd_idx, &dead, 1, CRAWDB_OFFSET_DEAD);
+        goto_if_err(iorv != 1, CRAWDB_ERR_SET_PREAD_DEAD, crawdb_scrub_end);
+        goto_if_err(dead != 0, CRAWDB_ERR_SET_IDX_DEAD, crawdb_scrub_end);
+        rc = _crawdb_open_rw(craw);
+        goto_if_err(rc != CRAWDB_OK, rc, crawdb_scrub_end);
+        deleted_val = 1;
+        /* Order is done with; it collects the quarantined records for the delete log */
+        for (i = 0; i < craw->ntotal; i++) {
+            if (!bad[i]) continue;
+            deleted_offset = craw->nheader + (i * craw->nrec) + craw->nkey + 8 + 4 + 2;
+            iorv = pwrite(craw->fd_idx_rw, &deleted_val, 1, (off_t)deleted_offset);
+            goto_if_err(iorv != 1, CRAWDB_ERR_DELETE_WRITE_FLAG, crawdb_scrub_end);
+            order[out_scrub->quarantined] = i;
+            out_scrub->quarantined += 1;
+            memcpy(&offset, buf + (craw->nrec * i) + craw->nkey, 8);
+            _crawdb_live_add(craw, offset, -1);
+        }
+        rc = _crawdb_del_log(craw, order, out_scrub->quarantined);
+        goto_if_err(rc != CRAWDB_OK, rc, crawdb_scrub_end);
+    }
+
+    if (out_scrub->bad_order + out_scrub->dups + out_scrub->bad_bounds + out_scrub->bad_cksum > 0) {
+        rv = CRAWDB_ERR_SCRUB_BAD;
+    }
+
+crawdb_scrub_end:
+    rc = _crawdb_unlock_if_locked(craw);
+    if (buf) free(buf);
+    if (order) free(order);
+    if (bad) free(bad);
+    if (seg_sizes) free(seg_sizes);
+    out_scrub->ns = _crawdb_now_ns() - t;
+    return rv != CRAWDB_OK ? rv : rc;
+}
+
+int crawdb_get_nkey(crawdb_t *craw, uint32_t *out_nkey) {
+    *out_nkey = craw->nkey;
+    return CRAWDB_OK;
+}
+
+int crawdb_get_ntotal(crawdb_t *craw, uint64_t *out_ntotal) {
+    *out_ntotal = craw->ntotal;
+    return CRAWDB_OK;
+}
+
+int crawdb_get_nsorted(crawdb_t *craw, uint64_t *out_nsorted) {
+    *out_nsorted = craw->nsorted;
+    return CRAWDB_OK;
+}
+
+int crawdb_get_nunsorted(crawdb_t *craw, uint64_t *out_nunsorted) {
+    *out_nunsorted = craw->nunsorted;
+    return CRAWDB_OK;
+}
+
+int crawdb_stats(crawdb_t *craw, crawdb_stats_t *out_stats) {
+    *out_stats = craw->stats;
+    return CRAWDB_OK;
+}
+
+int crawdb_stats_reset(crawdb_t *craw) {
+    memset(&craw->stats, 0, sizeof(crawdb_stats_t));
+    return CRAWDB_OK;
+}
+
+int crawdb_free(crawdb_t *craw) {
+    uint32_t i;
+
+    _crawdb_mph_unload(craw);
+    _crawdb_prewarm_unmap(craw);
+    if (craw->fd_idx >= 0) close(craw->fd_idx);
+    if (craw->fd_dat >= 0) close(craw->fd_dat);
+    if (craw->fd_idx_rw >= 0) close(craw->fd_idx_rw);
+    if (craw->fd_dat_rw >= 0) close(craw->fd_dat_rw);
+    if (craw->fd_seg >= 0) close(craw->fd_seg);
+    if (craw->fd_stage >= 0) close(craw->fd_stage);
+    if (craw->fd_live >= 0) close(craw->fd_live);
+    for (i = 0; i < craw->nseg_fds; i++) {
+        if (craw->seg_fds[i] >= 0) close(craw->seg_fds[i]);
+    }
+    if (craw->seg_fds) free(craw->seg_fds);
+    if (craw->rec) free(craw->rec);
+    if (craw->data) free(craw->data);
+    if (craw->set_key) free(craw->set_key);
+    free(craw->idx_path);
+    free(craw->dat_path);
+    free(craw);
+    return CRAWDB_OK;
+}
+
+static int _crawdb_get_ex(crawdb_t *craw, int by_key, uchar *orig_key, uint32_t orig_nkey, uint64_t key_i, uchar **out_key, uint32_t *out_nkey, uchar **out_val, uint32_t *out_nval, uint64_t *out_key_i) {
+    int rv;
+    int found;
+    uint64_t offset;
+    uint32_t len;
+    uint16_t cksum;
+    uint8_t del;
+
+    if (by_key) {
+        /* Find key */
+        try(_crawdb_find(craw, orig_key, orig_nkey, &found, &offset, &len, &cksum, &del, out_key_i));
+
+        /* Key not found */
+        if (!found) {
+            *out_val = NULL;
+            *out_nval = 0;
+            return CRAWDB_OK;
+        }
+    } else {
+        /* Validate key_i */
+        return_if_err(key_i >= craw->ntotal, CRAWDB_ERR_GET_BAD_KEY);
+
+        /* Read key at key_i */
+        try(_crawdb_read_idx_record(craw, key_i));
+        *out_key = craw->rec;
+        *out_nkey = craw->nkey;
+        *out_key_i = key_i;
+
+        _crawdb_parse_idx_record(craw, &offset, &len, &cksum, &del);
+    }
+
+    if (del) {
+        /* TODO different return for deleted keys? */
+        *out_val = NULL;
+        *out_nval = 0;
+        return CRAWDB_OK;
+    }
+
+    /* Fetch data */
+    timer_start(t_data);
+    rv = _crawdb_get_data(craw, offset, len, cksum, out_val, out_nval);
+    timer_add(t_data, get_data_ns);
+    return_if_err(rv != CRAWDB_OK, rv);
+
+    return CRAWDB_OK;
+}
+
+static int _crawdb_find(crawdb_t *craw, uchar *key, uint32_t nkey, int *out_found, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del, uint64_t *out_key_i) {
+    int rv;
+
+    /* Validate key; short keys compare as if zero-padded to craw->nkey */
+    return_if_err(nkey > craw->nkey, CRAWDB_ERR_GET_BAD_KEY);
+    return_if_err(nkey < 1,          CRAWDB_ERR_GET_BAD_KEY);
+
+    *out_found = 0;
+
+    if (craw->mph && craw->mph->ntotal == craw->ntotal) {
+        /* Try perfect hash; a miss is authoritative as all keys are sorted */
+        try(_crawdb_get_mph(craw, key, nkey, out_found, out_offset, out_len, out_cksum, out_del, out_key_i));
+        if (*out_found) craw->stats.mph_hits += 1;
+    } else if (craw->nsorted > 0) {
+        /* Try binary search */
+        timer_start(t_bsearch);
+        rv = _crawdb_get_bsearch(craw, key, nkey, out_found, out_offset, out_len, out_cksum, out_del, out_key_i);
+        timer_add(t_bsearch, bsearch_ns);
+        return_if_err(rv != CRAWDB_OK, rv);
+        if (*out_found) craw->stats.bsearch_hits += 1;
+    }
+
+    /* A deleted key may have been set again since the last index */
+    if (*out_found && *out_del) *out_found = 0;
+
+    if (!*out_found && craw->nunsorted > 0) {
+        /* Try linear search */
+        timer_start(t_lsearch);
+        rv = _crawdb_get_lsearch(craw, key, nkey, out_found, out_offset, out_len, out_cksum, out_del, out_key_i);
+        timer_add(t_lsearch, lsearch_ns);
+        return_if_err(rv != CRAWDB_OK, rv);
+        if (*out_found) craw->stats.lsearch_hits += 1;
+    }
+
+    if (!*out_found) craw->stats.misses += 1;
+
+    return CRAWDB_OK;
+}
+
+static int _crawdb_get_bsearch(crawdb_t *craw, uchar *key, uint32_t nkey, int *out_found, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del, uint64_t *out_key_i) {
+    uint64_t start;
+    uint64_t end;
+    uint64_t look;
+    int rv;
+
+    start = 0;
+    end = craw->nsorted - 1;
+
+    /* Binary search sorted idx records for key */
+    while (end >= start) {
+        look = (start + end) / 2;
+        try(_crawdb_read_idx_record(craw, look));
+        rv = _crawdb_key_cmp(craw, key, nkey);
+        if (rv == 0) {
+            /* Deleted copies of a key sort before its live one; step past them */
+            _crawdb_parse_idx_record(craw, out_offset, out_len, out_cksum, out_del);
+            while (*out_del && look + 1 < craw->nsorted) {
+                try(_crawdb_read_idx_record(craw, look + 1));
+                if (_crawdb_key_cmp(craw, key, nkey) != 0) break;
+                _crawdb_parse_idx_record(craw, out_offset, out_len, out_cksum, out_del);
+                look += 1;
+            }
+            *out_key_i = look;
+            *out_found = 1;
+            return CRAWDB_OK;
+        } else if (rv < 0) {
+            start = look + 1;
+        } else if (rv > 0) {
+            if (look == 0) break;
+            end = look - 1;
+        }
+    }
+
+    *out_found = 0;
+    return CRAWDB_OK;
+}
+
+static int _crawdb_get_lsearch(crawdb_t *craw, uchar *key, uint32_t nkey, int *out_found, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del, uint64_t *out_key_i) {
+    uint64_t cur;
+    uint64_t look;
+    int rv;
+
+    /* Reverse linear search unsorted idx records for key */
+    for (cur = 0; cur < craw->nunsorted; ++cur) {
+        look = (craw->ntotal - 1) - cur;
+        try(_crawdb_read_idx_record(craw, look));
+        rv = _crawdb_key_cmp(craw, key, nkey);
+        if (rv == 0) {
+            _crawdb_parse_idx_record(craw, out_offset, out_len, out_cksum, out_del);
+            *out_key_i = look;
+            *out_found = 1;
+            return CRAWDB_OK;
+        }
+    }
+
+    *out_found = 0;
+    return CRAWDB_OK;
+}
+
+static int _crawdb_get_mph(crawdb_t *craw, uchar *key, uint32_t nkey, int *out_found, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del, uint64_t *out_key_i) {
+    uint64_t rank;
+    uint64_t look;
+    int rv;
+
+    *out_found = 0;
+
+    /* Hash key to a slot */
+    if (_crawdb_mph_slot(craw->mph, key, nkey, craw->nkey, &rank) != CRAWDB_OK || rank >= craw->mph->nkeys) {
+        return CRAWDB_OK;
+    }
+
+    /* Read the one candidate record */
+    look = craw->mph->table[rank];
+    if (look >= craw->ntotal) {
+        return CRAWDB_OK;
+    }
+    try(_crawdb_read_idx_record(craw, look));
+    if (_crawdb_key_cmp(craw, key, nkey) == 0) {
+        _crawdb_parse_idx_record(craw, out_offset, out_len, out_cksum, out_del);
+        *out_key_i = look;
+        *out_found = 1;
+    }
+
+    return CRAWDB_OK;
+}
+
+static int _crawdb_read_idx_record(crawdb_t *craw, uint64_t key_i) {
+    uint64_t offset;
+
+    /* Read index record */
+    offset = craw->nheader + (key_i * craw->nrec);
+    craw->stats.idx_probes += 1;
+    craw->stats.preads += 1;
+    craw->stats.pread_bytes += craw->nrec;
+    if (pread(craw->fd_idx, craw->rec, craw->nrec, offset) != craw->nrec) {
+        return CRAWDB_ERR_READ_IDX_RECORD;
+    }
+
+    return CRAWDB_OK;
+}
+
+static int _crawdb_key_cmp(crawdb_t *craw, uchar *key, uint32_t nkey) {
+    int rv;
+    uint32_t i;
+
+    if (nkey == craw->nkey) {
+        return _crawdb_key_cmp_full(craw, craw->rec, key);
+    }
+
+    /* Compare rec key against key zero-padded to craw->nkey */
+    rv = memcmp(craw->rec, key, nkey);
+    if (rv != 0) return rv;
+    for (i = nkey; i < craw->nkey; i++) {
+        if (craw->rec[i]) return 1;
+    }
+    return 0;
+}
+
+CRAWDB_INLINE uint64_t _crawdb_load_be64(uchar *p) {
+    uint64_t x;
+    memcpy(&x, p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+CRAWDB_INLINE int _crawdb_key_cmp_words(uchar *a, uchar *b, const uint32_t nwords) {
+    uint32_t i;
+    uint64_t x;
+    uint64_t y;
+
+    /* Keys compare as big-endian words; only a differing word is byte-swapped */
+    for (i = 0; i < nwords; i++) {
+        memcpy(&x, a + (i * 8), 8);
+        memcpy(&y, b + (i * 8), 8);
+        if (x != y) {
+            x = _crawdb_load_be64(a + (i * 8));
+            y = _crawdb_load_be64(b + (i * 8));
+            return x < y ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+static int _crawdb_key_cmp_full(crawdb_t *craw, uchar *a, uchar *b) {
+    switch (craw->kernel) {
+        case CRAWDB_KERNEL_8:  return _crawdb_key_cmp_words(a, b, CRAWDB_KERNEL_8);
+        case CRAWDB_KERNEL_16: return _crawdb_key_cmp_words(a, b, CRAWDB_KERNEL_16);
+        case CRAWDB_KERNEL_32: return _crawdb_key_cmp_words(a, b, CRAWDB_KERNEL_32);
+        case CRAWDB_KERNEL_64: return _crawdb_key_cmp_words(a, b, CRAWDB_KERNEL_64);
+    }
+    return memcmp(a, b, craw->nkey);
+}
+
+static int _crawdb_kernel(uint32_t nkey) {
+    switch (nkey) {
+        case 8:  return CRAWDB_KERNEL_8;
+        case 16: return CRAWDB_KERNEL_16;
+        case 32: return CRAWDB_KERNEL_32;
+        case 64: return CRAWDB_KERNEL_64;
+    }
+    return CRAWDB_KERNEL_GENERIC;
+}
+
+static int _crawdb_parse_idx_record(crawdb_t *craw, uint64_t *out_offset, uint32_t *out_len, uint16_t *out_cksum, uint8_t *out_del) {
+    memcpy(out_offset, craw->rec + craw->nkey, 8);
+    memcpy(out_len,    craw->rec + craw->nkey + 8, 4);
+    memcpy(out_cksum,  craw->rec + craw->nkey + 8 + 4, 2);
+    memcpy(out_del,    craw->rec + craw->nkey + 8 + 4 + 2, 1);
+    return CRAWDB_OK;
+}
+
+static int _crawdb_get_data(crawdb_t *craw, uint64_t offset, uint32_t len, uint16_t cksum, uchar **out_val, uint32_t *out_nval) {
+    int rv;
+
+    /* Grow data buf */
+    if (!craw->data || len > craw->ndata) {
+        craw->data = realloc(craw->data, len);
+        craw->ndata = len;
+    }
+
+    try(_crawdb_read_data(craw, offset, len, cksum, craw->data));
+
+    *out_val = craw->data;
+    *out_nval = len;
+    return CRAWDB_OK;
+}
+
+static int _crawdb_read_data(crawdb_t *craw, uint64_t offset, uint32_t len, uint16_t cksum, uchar *buf) {
+    int rv;
+    uint16_t dat_cksum;
+    int fd;
+    uint64_t dat_pos;
+
+    /* Read from dat file */
+    try(_crawdb_dat_fd(craw, offset, &fd, &dat_pos));
+    craw->stats.preads += 1;
+    craw->stats.pread_bytes += len;
+    if (pread(fd, buf, len, dat_pos) != len) {
+        return CRAWDB_ERR_GET_DATA_READ;
+    }
+
+    /* Calc and compare checksum */
+    dat_cksum = 0;
+    crawdb_cksum(buf, len, &dat_cksum);
+    craw->stats.cksum_bytes += len;
+    if (dat_cksum != cksum) {
+        craw->stats.cksum_failures += 1;
+        return CRAWDB_ERR_GET_DATA_CKSUM;
+    }
+
+    return CRAWDB_OK;
+}
+
+static void _crawdb_async_start(crawdb_async_t *async, crawdb_async_op_t *op) {
+    crawdb_t *craw;
+    uint64_t rank;
+
+    craw = async->craw;
+
+    if (craw->mph && craw->mph->ntotal == craw->ntotal) {
+        /* Perfect hash names the one candidate record */
+        op->state = CRAWDB_ASYNC_STATE_MPH;
+        if (_crawdb_mph_slot(craw->mph, op->key, craw->nkey, craw->nkey, &rank) != CRAWDB_OK
+            || rank >= craw->mph->nkeys
+            || (op->look = craw->mph->table[rank]) >= craw->ntotal
+        ) {
+            _crawdb_async_tail(async, op);
+            return;
+        }
+        _crawdb_async_read_idx(async, op);
+    } else if (craw->nsorted > 0) {
+        /* First binary search probe */
+        op->state = CRAWDB_ASYNC_STATE_BSEARCH;
+        op->start = 0;
+        op->end = craw->nsorted - 1;
+        op->look = op->end / 2;
+        _crawdb_async_read_idx(async, op);
+    } else {
+        _crawdb_async_tail(async, op);
+    }
+}
+
+static void _crawdb_async_step(crawdb_async_t *async, crawdb_async_op_t *op, ssize_t res) {
+    crawdb_t *craw;
+    uint16_t cksum;
+    uint8_t del;
+    int cmp;
+
+    craw = async->craw;
+
+    if (op->state == CRAWDB_ASYNC_STATE_DATA) {
+        /* Value read; compare checksum */
+        if (res != op->len) {
+            _crawdb_async_finish(async, op, CRAWDB_ERR_GET_DATA_READ);
+            return;
+        }
+        crawdb_cksum(op->val, op->len, &cksum);
+        craw->stats.cksum_bytes += op->len;
+        if (cksum != op->cksum) {
+            craw->stats.cksum_failures += 1;
+            _crawdb_async_finish(async, op, CRAWDB_ERR_GET_DATA_CKSUM);
+            return;
+        }
+        op->found = 1;
+        _crawdb_async_finish(async, op, CRAWDB_OK);
+        return;
+    }
+
+    /* Index record read */
+    if (res != craw->nrec) {
+        _crawdb_async_finish(async, op, CRAWDB_ERR_READ_IDX_RECORD);
+        return;
+    }
+    cmp = _crawdb_key_cmp_full(craw, op->rec, op->key);
+    if (cmp == 0) {
+        memcpy(&del, op->rec + craw->nkey + 8 + 4 + 2, 1);
+        if (del && op->state != CRAWDB_ASYNC_STATE_MPH && op->look + 1 < craw->nsorted) {
+            /* Deleted copies of a key sort before its live one; step past them */
+            op->state = CRAWDB_ASYNC_STATE_DUPS;
+            op->look += 1;
+            _crawdb_async_read_idx(async, op);
+            return;
+        }
+        if (!del) {
+            if (op->state == CRAWDB_ASYNC_STATE_MPH) craw->stats.mph_hits += 1;
+            else                                     craw->stats.bsearch_hits += 1;
+            memcpy(&op->offset, op->rec + craw->nkey, 8);
+            memcpy(&op->len,    op->rec + craw->nkey + 8, 4);
+            memcpy(&op->cksum,  op->rec + craw->nkey + 8 + 4, 2);
+            _crawdb_async_fetch(async, op, del);
+            return;
+        }
+
+        /* Every sorted copy is deleted; it may have been set again unsorted */
+        _crawdb_async_tail(async, op);
+        return;
+    }
+
+    /* Next binary search probe depends on this one, so probes cannot be linked */
+    if (op->state == CRAWDB_ASYNC_STATE_BSEARCH && !(cmp > 0 && op->look == 0)) {
+        if (cmp < 0) {
+            op->start = op->look + 1;
+        } else {
+            op->end = op->look - 1;
+        }
+        if (op->end >= op->start) {
+            op->look = (op->start + op->end) / 2;
+            _crawdb_async_read_idx(async, op);
+            return;
+        }
+    }
+
+    _crawdb_async_tail(async, op);
+}
+
+static void _crawdb_async_tail(crawdb_async_t *async, crawdb_async_op_t *op) {
+    crawdb_t *craw;
+    int found;
+    uint8_t del;
+    int rc;
+
+    craw = async->craw;
+
+    /* The unsorted tail is recently appended and likely cached; scan it inline */
+    found = 0;
+    if (craw->nunsorted > 0) {
+        rc = _crawdb_get_lsearch(craw, op->key, craw->nkey, &found, &op->offset, &op->len, &op->cksum, &del, &op->look);
+        if (rc != CRAWDB_OK) {
+            _crawdb_async_finish(async, op, rc);
+            return;
+        }
+    }
+
+    if (!found) {
+        craw->stats.misses += 1;
+        _crawdb_async_finish(async, op, CRAWDB_OK);
+        return;
+    }
+
+    craw->stats.lsearch_hits += 1;
+    _crawdb_async_fetch(async, op, del);
+}
+
+static void _crawdb_async_fetch(crawdb_async_t *async, crawdb_async_op_t *op, uint8_t del) {
+    crawdb_t *craw;
+    int fd;
+    uint64_t pos;
+
+    craw = async->craw;
+
+    if (del) {
+        _crawdb_async_finish(async, op, CRAWDB_OK);
+        return;
+    }
+
+    /* Grow val buf */
+    if (op->len > op->nval_alloc || !op->val) {
+        op->val = realloc(op->val, op->len > 0 ? op->len : 1);
+        op->nval_alloc = op->len;
+    }
+
+    /* Read value */
+    op->state = CRAWDB_ASYNC_STATE_DATA;
+    craw->stats.preads += 1;
+    craw->stats.pread_bytes += op->len;
+    if (op->len == 0) {
+        _crawdb_async_step(async, op, 0);
+        return;
+    }
+    if (_crawdb_dat_fd(craw, op->offset, &fd, &pos) != CRAWDB_OK) {
+        _crawdb_async_finish(async, op, CRAWDB_ERR_SEGMENT_OPEN);
+        return;
+    }
+    _crawdb_async_read(async, op, fd, op->val, op->len, pos);
+}
+
+static void _crawdb_async_read_idx(crawdb_async_t *async, crawdb_async_op_t *op) {
+    crawdb_t *craw;
+
+    craw = async->craw;
+    craw->stats.idx_probes += 1;
+    craw->stats.preads += 1;
+    craw->stats.pread_bytes += craw->nrec;
+    _crawdb_async_read(async, op, craw->fd_idx, op->rec, craw->nrec, craw->nheader + (op->look * craw->nrec));
+}
+
+static void _crawdb_async_read(crawdb_async_t *async, crawdb_async_op_t *op, int fd, uchar *buf, uint32_t len, uint64_t offset) {
+    op->read_fd = fd;
+    op->read_buf = buf;
+    op->read_len = len;
+    op->read_offset = offset;
+
+    /* Queue until the next pump */
+    op->next = NULL;
+    if (async->ready_tail) {
+        async->ready_tail->next = op;
+    } else {
+        async->ready_head = op;
+    }
+    async->ready_tail = op;
+}
+
+static void _crawdb_async_finish(crawdb_async_t *async, crawdb_async_op_t *op, int rv) {
+    op->rv = rv;
+    op->next = NULL;
+    if (async->done_tail) {
+        async->done_tail->next = op;
+    } else {
+        async->done_head = op;
+    }
+    async->done_tail = op;
+    async->ndone += 1;
+}
+
+static int _crawdb_async_pump(crawdb_async_t *async, uint32_t min_complete) {
+    int rv;
+    crawdb_async_op_t *op;
+    ssize_t res;
+
+    for (;;) {
+        /* Issue queued reads */
+        while ((op = async->ready_head)) {
+            async->ready_head = op->next;
+            if (!async->ready_head) async->ready_tail = NULL;
+            op->next = NULL;
+            if (async->ring_fd >= 0) {
+                _crawdb_async_ring_push(async, op);
+            } else {
+                res = pread(op->read_fd, op->read_buf, op->read_len, op->read_offset);
+                _crawdb_async_step(async, op, res);
+            }
+        }
+
+        /* Without a ring every read above already completed */
+        if (async->ring_fd < 0) {
+            return CRAWDB_OK;
+        }
+
+        /* Submit, and wait only if not enough are done */
+        if (async->ndone >= min_complete) {
+            if (async->nsubmit > 0) try(_crawdb_async_ring_enter(async, 0));
+            return CRAWDB_OK;
+        }
+        try(_crawdb_async_ring_enter(async, 1));
+    }
+}
+
+#ifndef CRAWDB_NO_URING
+static int _crawdb_async_ring_setup(crawdb_async_t *async) {
+    struct io_uring_params params;
+    int fd;
+
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, async->depth, &params);
+    if (fd < 0) {
+        return CRAWDB_ERR;
+    }
+
+    /* Map submission ring, completion ring, and sqe array */
+    async->nsq_map = params.sq_off.array + (params.sq_entries * sizeof(uint32_t));
+    async->ncq_map = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+    async->nsqes = params.sq_entries * sizeof(struct io_uring_sqe);
+    async->sq_map = mmap(NULL, async->nsq_map, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    async->cq_map = mmap(NULL, async->ncq_map, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    async->sqes   = mmap(NULL, async->nsqes,   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (async->sq_map == MAP_FAILED || async->cq_map == MAP_FAILED || async->sqes == MAP_FAILED) {
+        if (async->sq_map != MAP_FAILED) munmap(async->sq_map, async->nsq_map);
+        if (async->cq_map != MAP_FAILED) munmap(async->cq_map, async->ncq_map);
+        if (async->sqes != MAP_FAILED) munmap(async->sqes, async->nsqes);
+        async->sq_map = NULL;
+        async->cq_map = NULL;
+        async->sqes = NULL;
+        close(fd);
+        return CRAWDB_ERR;
+    }
+
+    async->sq_head  = (uint32_t*)(async->sq_map + params.sq_off.head);
+    async->sq_tail  = (uint32_t*)(async->sq_map + params.sq_off.tail);
+    async->sq_mask  = (uint32_t*)(async->sq_map + params.sq_off.ring_mask);
+    async->sq_array = (uint32_t*)(async->sq_map + params.sq_off.array);
+    async->cq_head  = (uint32_t*)(async->cq_map + params.cq_off.head);
+    async->cq_tail  = (uint32_t*)(async->cq_map + params.cq_off.tail);
+    async->cq_mask  = (uint32_t*)(async->cq_map + params.cq_off.ring_mask);
+    async->cqes     = async->cq_map + params.cq_off.cqes;
+    async->ring_fd = fd;
+
+    return CRAWDB_OK;
+}
+
+static void _crawdb_async_ring_push(crawdb_async_t *async, crawdb_async_op_t *op) {
+    struct io_uring_sqe *sqe;
+    uint32_t tail;
+    uint32_t idx;
+
+    /* Ring has depth entries and each op has one read at most, so it never overflows */
+    tail = *async->sq_tail;
+    idx = tail & *async->sq_mask;
+    sqe = (struct io_uring_sqe*)async->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = op->read_fd;
+    sqe->addr = (uint64_t)(uintptr_t)op->read_buf;
+    sqe->len = op->read_len;
+    sqe->off = op->read_offset;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    async->sq_array[idx] = idx;
+    __atomic_store_n(async->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    async->nsubmit += 1;
+}
+
+static int _crawdb_async_ring_enter(crawdb_async_t *async, uint32_t min_complete) {
+    struct io_uring_cqe *cqe;
+    crawdb_async_op_t *op;
+    uint32_t head;
+    int rc;
+
+    /* Submit queued sqes and maybe wait; busy rings are retried after reaping */
+    rc = syscall(__NR_io_uring_enter, async->ring_fd, async->nsubmit, min_complete, min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        return CRAWDB_ERR_ASYNC_ENTER;
+    } else if (rc > 0) {
+        async->nsubmit -= rc;
+    }
+
+    /* Reap completions; steps may queue follow-up reads */
+    head = *async->cq_head;
+    while (head != __atomic_load_n(async->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = (struct io_uring_cqe*)async->cqes + (head & *async->cq_mask);
+        op = (crawdb_async_op_t*)(uintptr_t)cqe->user_data;
+        rc = cqe->res;
+        head += 1;
+        __atomic_store_n(async->cq_head, head, __ATOMIC_RELEASE);
+        _crawdb_async_step(async, op, rc);
+    }
+
+    return CRAWDB_OK;
+}
+#else
+static int _crawdb_async_ring_setup(crawdb_async_t *async) {
+    return CRAWDB_ERR;
+}
+
+static void _crawdb_async_ring_push(crawdb_async_t *async, crawdb_async_op_t *op) {
+}
+
+static int _crawdb_async_ring_enter(crawdb_async_t *async, uint32_t min_complete) {
+    return CRAWDB_ERR_ASYNC_ENTER;
+}
+#endif
+
+static int _crawdb_index_copy(crawdb_t *craw, int *out_fd_copy, char **out_path_copy) {
+    int rv;
+    int rc;
+    char *path_copy;
+    size_t path_copy_len;
+    int fd_copy;
+    ssize_t iorv;
+    off_t offset;
+
+    path_copy = NULL;
+    fd_copy = -1;
+
+    /* Lock */
+    rc = _crawdb_lock(craw);
+    goto_if_err(rc != CRAWDB_OK, rc, _crawdb_index_copy_err);
+
+    /* Reload without O_APPEND */
+    rc = _crawdb_reload_for_index(craw);
+    goto_if_err(rc != CRAWDB_OK, rc, _crawdb_index_copy_err);
+
+    /* Hold dat shared until the swap reloads so reclaim cannot unlink segments the copy still references */
+    goto_if_err(flock(craw->fd_dat, LOCK_SH) != 0, CRAWDB_ERR_LOCK_SH, _crawdb_index_copy_err);
+
+    /* Open copy file */
+    path_copy_len = strlen(craw->idx_path) + 5; /* ".copy" (5) */
+    path_copy = malloc(path_copy_len + 1);
+    snprintf(path_copy, path_copy_len + 1, "%s.copy", craw->idx_path);
+    fd_copy = open(path_copy, O_RDWR | O_CREAT | O_TRUNC, 00644);
+    goto_if_err(fd_copy < 0, CRAWDB_ERR_INDEX_OPEN_COPY, _crawdb_index_copy_err);
+
+    /* Copy index */
+    offset = lseek(craw->fd_idx, 0, SEEK_SET);
+    goto_if_err(offset < 0, CRAWDB_ERR_INDEX_LSEEK, _crawdb_index_copy_err);
+    offset = lseek(fd_copy, 0, SEEK_SET);
+    goto_if_err(offset < 0, CRAWDB_ERR_INDEX_LSEEK, _crawdb_index_copy_err);
+    iorv = copy_file_range(craw->fd_idx, NULL, fd_copy, NULL, (size_t)craw->idx_size, 0);
+    goto_if_err(iorv != (ssize_t)craw->idx_size, CRAWDB_ERR_INDEX_COPY, _crawdb_index_copy_err);
+
+    /* Unlock */
+    rc = _crawdb_unlock(craw);
+    goto_if_err(rc != CRAWDB_OK, rc, _crawdb_index_copy_err);
+
+    *out_fd_copy = fd_copy;
+    *out_path_copy = path_copy;
+    return CRAWDB_OK;
+
+_crawdb_index_copy_err:
+    flock(craw->fd_dat, LOCK_UN);
+    _crawdb_unlock_if_locked(craw);
+    if (path_copy) free(path_copy);
+    if (fd_copy >= 0) close(fd_copy);
+    return rv;
+}
+
+static int _crawdb_index_sort_cmp(const void *a, const void *b, void *arg) {
+    crawdb_t *craw;
+    craw = arg;
+    return memcmp(a, b, craw->nkey);
+}
+
+static int _crawdb_index_sort_ptr_cmp(const void *a, const void *b, void *arg) {
+    crawdb_t *craw;
+    uchar *rec_a;
+    uchar *rec_b;
+    int cmp;
+
+    /* Records do not move, so their addresses break ties in record order */
+    craw = arg;
+    rec_a = *(uchar**)a;
+    rec_b = *(uchar**)b;
+    cmp = memcmp(rec_a, rec_b, craw->nkey);
+    if (cmp != 0) return cmp;
+    return rec_a < rec_b ? -1 : (rec_a > rec_b ? 1 : 0);
+}
+
+CRAWDB_INLINE int _crawdb_sort_ent_cmp(uint64_t *a, uint64_t *b, const uint32_t nwords) {
+    uint32_t i;
+    /* Equal keys fall through to the record index so duplicates keep their order */
+    for (i = 0; i <= nwords; i++) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+CRAWDB_INLINE void _crawdb_sort_ent_swap(uint64_t *a, uint64_t *b, const uint32_t nwords) {
+    uint32_t i;
+    uint64_t t;
+    for (i = 0; i <= nwords; i++) {
+        t = a[i];
+        a[i] = b[i];
+        b[i] = t;
+    }
+}
+
+CRAWDB_INLINE void _crawdb_sort_ent_sift(uint64_t *base, uint64_t root, uint64_t end, const uint32_t nwords) {
+    uint64_t child;
+    const uint32_t stride = nwords + 1;
+
+    while ((child = (2 * root) + 1) < end) {
+        if (child + 1 < end && _crawdb_sort_ent_cmp(base + (child * stride), base + ((child + 1) * stride), nwords) < 0) child += 1;
+        if (_crawdb_sort_ent_cmp(base + (root * stride), base + (child * stride), nwords) >= 0) break;
+        _crawdb_sort_ent_swap(base + (root * stride), base + (child * stride), nwords);
+        root = child;
+    }
+}
+
+CRAWDB_INLINE void _crawdb_sort_ents(uint64_t *ents, uint64_t n, const uint32_t nwords) {
+    const uint32_t stride = nwords + 1;
+    uint64_t tmp[CRAWDB_KERNEL_64 + 1];
+    uint64_t stack_lo[64];
+    uint64_t stack_hi[64];
+    int stack_depth[64];
+    int top;
+    int depth;
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t mid;
+    uint64_t i;
+    uint64_t j;
+
+    #define E(__i) (ents + ((__i) * stride))
+
+    /* Introsort over <key words> <record index> entries; compares inline for a fixed width */
+    top = 0;
+    lo = 0;
+    hi = n;
+    depth = 2 * (64 - __builtin_clzll(n | 1));
+    for (;;) {
+        if (hi - lo <= CRAWDB_SORT_INSERTION) {
+            /* Insertion sort small ranges */
+            for (i = lo + 1; i < hi; i++) {
+                memcpy(tmp, E(i), stride * 8);
+                for (j = i; j > lo && _crawdb_sort_ent_cmp(E(j - 1), tmp, nwords) > 0; j--) {
+                    memcpy(E(j), E(j - 1), stride * 8);
+                }
+                memcpy(E(j), tmp, stride * 8);
+            }
+        } else if (depth == 0) {
+            /* Heapsort ranges that partition badly */
+            for (i = (hi - lo) / 2; i-- > 0; ) {
+                _crawdb_sort_ent_sift(E(lo), i, hi - lo, nwords);
+            }
+            for (i = (hi - lo) - 1; i > 0; i--) {
+                _crawdb_sort_ent_swap(E(lo), E(lo + i), nwords);
+                _crawdb_sort_ent_sift(E(lo), 0, i, nwords);
+            }
+        } else {
+            /* Median of three pivot moved to lo */
+            depth -= 1;
+            mid = lo + ((hi - lo) / 2);
+            if (_crawdb_sort_ent_cmp(E(mid), E(lo), nwords) < 0)      _crawdb_sort_ent_swap(E(mid), E(lo), nwords);
+            if (_crawdb_sort_ent_cmp(E(hi - 1), E(lo), nwords) < 0)   _crawdb_sort_ent_swap(E(hi - 1), E(lo), nwords);
+            if (_crawdb_sort_ent_cmp(E(hi - 1), E(mid), nwords) < 0)  _crawdb_sort_ent_swap(E(hi - 1), E(mid), nwords);
+            _crawdb_sort_ent_swap(E(lo), E(mid), nwords);
+            memcpy(tmp, E(lo), stride * 8);
+
+            /* Hoare partition */
+            i = lo;
+            j = hi;
+            for (;;) {
+                do { i++; } while (i < hi && _crawdb_sort_ent_cmp(E(i), tmp, nwords) < 0);
+                do { j--; } while (_crawdb_sort_ent_cmp(E(j), tmp, nwords) > 0);
+                if (i >= j) break;
+                _crawdb_sort_ent_swap(E(i), E(j), nwords);
+            }
+            _crawdb_sort_ent_swap(E(lo), E(j), nwords);
+
+            /* Defer the larger side and continue with the smaller */
+            stack_depth[top] = depth;
+            if (j - lo > hi - (j + 1)) {
+                stack_lo[top] = lo;
+                stack_hi[top] = j;
+                lo = j + 1;
+            } else {
+                stack_lo[top] = j + 1;
+                stack_hi[top] = hi;
+                hi = j;
+            }
+            top += 1;
+            continue;
+        }
+
+        if (top == 0) break;
+        top -= 1;
+        lo = stack_lo[top];
+        hi = stack_hi[top];
+        depth = stack_depth[top];
+    }
+
+    #undef E
+}
+
+static uint64_t *_crawdb_index_sort_kernel(crawdb_t *craw, uchar *buf) {
+    uint64_t *ents;
+    uchar **ptrs;
+    uint64_t i;
+    uint32_t w;
+    uint32_t stride;
+
+    /* Pack keys as big-endian words followed by the record index */
+    stride = craw->kernel + 1;
+    ents = malloc(craw->ntotal * stride * 8);
+    for (i = 0; i < craw->ntotal; i++) {
+        for (w = 0; w < (uint32_t)craw->kernel; w++) {
+            ents[(i * stride) + w] = _crawdb_load_be64(buf + (craw->nrec * i) + (w * 8));
+        }
+        ents[(i * stride) + craw->kernel] = i;
+    }
+
+    switch (craw->kernel) {
+        case CRAWDB_KERNEL_GENERIC:
+            /* Other widths sort record pointers with memcmp */
+            ptrs = malloc((craw->ntotal * sizeof(uchar*)) + 1);
+            for (i = 0; i < craw->ntotal; i++) ptrs[i] = buf + (craw->nrec * i);
+            qsort_r(ptrs, craw->ntotal, sizeof(uchar*), _crawdb_index_sort_ptr_cmp, craw);
+            for (i = 0; i < craw->ntotal; i++) ents[i] = (uint64_t)(ptrs[i] - buf) / craw->nrec;
+            free(ptrs);
+            break;
+        case CRAWDB_KERNEL_8:  _crawdb_sort_ents(ents, craw->ntotal, CRAWDB_KERNEL_8);  break;
+        case CRAWDB_KERNEL_16: _crawdb_sort_ents(ents, craw->ntotal, CRAWDB_KERNEL_16); break;
+        case CRAWDB_KERNEL_32: _crawdb_sort_ents(ents, craw->ntotal, CRAWDB_KERNEL_32); break;
+        case CRAWDB_KERNEL_64: _crawdb_sort_ents(ents, craw->ntotal, CRAWDB_KERNEL_64); break;
+    }
+    return ents;
+}
+
+static int _crawdb_index_sort(crawdb_t *craw, char *path_copy, int *inout_fd_copy, char **out_path_new, int *out_fd_new, long *out_size_new) {
+    int rv;
+    char *path_new;
+    int fd_new;
+    long size_new;
+    size_t path_new_len;
+    ssize_t iorv;
+    uchar *buf;
+    uint64_t *ents;
+    uchar *chunk;
+    size_t nchunk;
+    uint64_t pos;
+    uint64_t i;
+    uchar header[CRAWDB_HEADER_SIZE];
+    uint64_t gen;
+    int rc;
+    uint64_t *live;
+    uint32_t nlive;
+    char *path_live;
+
+    path_new = NULL;
+    fd_new = -1;
+    buf = NULL;
+    ents = NULL;
+    chunk = NULL;
+    live = NULL;
+
+    /* Open file */
+    path_new_len = strlen(craw->idx_path) + 4; /* ".new" (4) */
+    path_new = malloc(path_new_len + 1);
+    snprintf(path_new, path_new_len + 1, "%s.new", craw->idx_path);
+    fd_new = open(path_new, O_RDWR | O_CREAT | O_TRUNC, 00644);
+    goto_if_err(fd_new < 0, CRAWDB_ERR_SORT_OPEN_NEW, _crawdb_index_sort_err);
+
+    /* Read copy into memory for sorting */
+    buf = malloc(craw->idx_size);
+    iorv = pread(*inout_fd_copy, buf, craw->idx_size - craw->nheader, craw->nheader);
+    goto_if_err(iorv != craw->idx_size - craw->nheader, CRAWDB_ERR_SORT_READ, _crawdb_index_sort_err);
+
+    /* Copy header, upgrading to current version */
+    memset(header, 0, CRAWDB_HEADER_SIZE);
+    iorv = pread(*inout_fd_copy, header, craw->nheader, 0);
+    goto_if_err(iorv != craw->nheader, CRAWDB_ERR_SORT_COPY_HEADER, _crawdb_index_sort_err);
+    gen = craw->gen + 1;
+    header[4] = CRAWDB_HEADER_VERS;
+    header[CRAWDB_OFFSET_DEAD] = 0;
+    memcpy(header + CRAWDB_OFFSET_GEN, &gen, 8);
+    memset(header + CRAWDB_OFFSET_NDEL, 0, 8); /* records move, so the delete log restarts */
+
+    /* Set nsorted */
+    memcpy(header + CRAWDB_OFFSET_NSORTED, &craw->ntotal, 8);
+    iorv = pwrite(fd_new, header, CRAWDB_HEADER_SIZE, 0);
+    goto_if_err(iorv != CRAWDB_HEADER_SIZE, CRAWDB_ERR_SORT_WRITE_NSORTED, _crawdb_index_sort_err);
+
+    /* Rebuild per-segment live counts for the new gen */
+    if (craw->flags & CRAWDB_FLAG_SEGMENTED) {
+        live = calloc(CRAWDB_SEGMENT_MAX + 1, sizeof(uint64_t));
+        _crawdb_live_count(craw, buf, craw->ntotal, live);
+        for (nlive = CRAWDB_SEGMENT_MAX + 1; nlive > 0 && live[nlive - 1] == 0; nlive--);
+        path_live = _crawdb_live_path(craw, ".live.new");
+        rc = _crawdb_live_create(path_live, gen, live, nlive);
+        free(path_live);
+        free(live);
+        live = NULL;
+        goto_if_err(rc != CRAWDB_OK, rc, _crawdb_index_sort_err);
+    }
+
+    /* Close and delete copy file */
+    close(*inout_fd_copy);
+    *inout_fd_copy = -1;
+    unlink(path_copy);
+
+    /* Sort records; common key widths use an inlined kernel */
+    ents = _crawdb_index_sort_kernel(craw, buf);
+
+    /* Write sorted records to new in chunks */
+    chunk = malloc(CRAWDB_SORT_CHUNK + craw->nrec);
+    nchunk = 0;
+    pos = CRAWDB_HEADER_SIZE;
+    for (i = 0; i < craw->ntotal; i++) {
+        /* TODO skip deleted keys? */
+        memcpy(chunk + nchunk, buf + (craw->nrec * ents[(i * (craw->kernel + 1)) + craw->kernel]), craw->nrec);
+        nchunk += craw->nrec;
+        if (nchunk >= CRAWDB_SORT_CHUNK || i == craw->ntotal - 1) {
+            iorv = pwrite(fd_new, chunk, nchunk, pos);
+            goto_if_err(iorv != (ssize_t)nchunk, CRAWDB_ERR_SORT_WRITE_REC, _crawdb_index_sort_err);
+            pos += nchunk;
+            nchunk = 0;
+        }
+    }
+    free(buf);
+    free(ents);
+    free(chunk);
+
+    /* Get size of new file */
+    size_new = lseek(fd_new, 0, SEEK_END);
+    goto_if_err(size_new < 0, CRAWDB_ERR_SORT_LSEEK, _crawdb_index_sort_err);
+
+    *out_path_new = path_new;
+    *out_fd_new = fd_new;
+    *out_size_new = size_new;
+    return CRAWDB_OK;
+
+_crawdb_index_sort_err:
+    if (path_new) free(path_new);
+    if (fd_new >= 0) close(fd_new);
+    if (buf) free(buf);
+    if (ents) free(ents);
+    if (chunk) free(chunk);
+    return rv;
+}
+
+static int _crawdb_index_swap(crawdb_t *craw, char *path_new, int fd_new, long size_new) {
+    int rv;
+    int rc;
+    ssize_t iorv;
+    loff_t offset_dst;
+    loff_t offset_src;
+    off_t idx_size_after;
+    off_t dat_end;
+    size_t copy_len;
+    uint8_t dead;
+    uint8_t flags;
+    uint64_t ends[2];
+
+    /* Warm new idx before readers switch over; best effort */
+    _crawdb_prewarm_idx(craw, fd_new, CRAWDB_HEADER_SIZE, craw->ntotal, 0);
+
+    /* Lock */
+    try(_crawdb_lock(craw));
+
+    /* Determine idx and dat ends again */
+    /* TODO ensure value makes sense */
+    goto_if_err(_crawdb_read_ends(craw, &dead, &idx_size_after, &dat_end) != CRAWDB_OK, CRAWDB_ERR_SWAP_LSEEK, _crawdb_index_swap_end);
+
+    /* Copy records that came in while we were indexing */
+    if (idx_size_after > craw->idx_size) {
+        copy_len = (size_t)(idx_size_after - craw->idx_size);
+        offset_src = (loff_t)craw->idx_size;
+        offset_dst = (loff_t)size_new;
+        iorv = copy_file_range(craw->fd_idx, &offset_src, fd_new, &offset_dst, copy_len, 0);
+        goto_if_err(iorv != (ssize_t)copy_len, CRAWDB_ERR_SWAP_COPY, _crawdb_index_swap_end);
+    }
+
+    /* Carry preallocated ends over to new; its header was copied before these writes */
+    if (craw->flags & CRAWDB_FLAG_PREALLOC) {
+        ends[0] = (uint64_t)size_new + (idx_size_after > craw->idx_size ? (uint64_t)(idx_size_after - craw->idx_size) : 0);
+        ends[1] = (uint64_t)dat_end;
+        flags = craw->flags;
+        iorv = pwrite(fd_new, ends, 16, CRAWDB_OFFSET_IDX_END);
+        goto_if_err(iorv != 16, CRAWDB_ERR_SWAP_COPY, _crawdb_index_swap_end);
+        iorv = pwrite(fd_new, &flags, 1, CRAWDB_OFFSET_FLAGS);
+        goto_if_err(iorv != 1, CRAWDB_ERR_SWAP_COPY, _crawdb_index_swap_end);
+    }
+
+    /* Likewise segment size and next id, which writers bump while we index */
+    if (craw->flags & CRAWDB_FLAG_SEGMENTED) {
+        rc = _crawdb_live_swap(craw, fd_new, size_new, idx_size_after > craw->idx_size ? (uint64_t)(idx_size_after - craw->idx_size) / craw->nrec : 0);
+        goto_if_err(rc != CRAWDB_OK, rc, _crawdb_index_swap_end);
+        flags = craw->flags;
+        goto_if_err(pread(craw->fd_idx, ends, 16, CRAWDB_OFFSET_SEG_SIZE) != 16, CRAWDB_ERR_SWAP_COPY, _crawdb_index_swap_end);
+        iorv = pwrite(fd_new, ends, 16, CRAWDB_OFFSET_SEG_SIZE);
+        goto_if_err(iorv != 16, CRAWDB_ERR_SWAP_COPY, _crawdb_index_swap_end);
+        iorv = pwrite(fd_new, &flags, 1, CRAWDB_OFFSET_FLAGS);
+        goto_if_err(iorv != 1, CRAWDB_ERR_SWAP_COPY, _crawdb_index_swap_end);
+    }
+
+    /* Rename idx to new */
+    rc = rename(path_new, craw->idx_path);
+    goto_if_err(rc != CRAWDB_OK, CRAWDB_ERR_SWAP_RENAME, _crawdb_index_swap_end);
+
+    /* Write dead byte on old idx */
+    dead = 1;
+    iorv = pwrite(craw->fd_idx, &dead, 1, CRAWDB_OFFSET_DEAD);
+    goto_if_err(iorv != 1, CRAWDB_ERR_SWAP_WRITE_DEAD, _crawdb_index_swap_end);
+
+    /* Reload for O_APPEND */
+    rc = crawdb_reload(craw);
+    goto_if_err(rc != CRAWDB_OK, rc, _crawdb_index_swap_end);
+
+    rv = CRAWDB_OK;
+
+_crawdb_index_swap_end:
+    rc = _crawdb_unlock_if_locked(craw);
+    return rv != CRAWDB_OK ? rv : rc;
+}
+
+static int _crawdb_prewarm_idx(crawdb_t *craw, int fd, size_t nheader, uint64_t nsorted, int flags) {
+    int rv;
+    uchar *buf;
+    uint64_t nbuf;
+    uint64_t len;
+    uint64_t pos;
+
+    if (nsorted == 0) {
+        return CRAWDB_OK;
+    }
+
+    if (!(flags & CRAWDB_PREWARM_ALL)) {
+        /* Touch each record the first levels of binary search land on */
+        buf = malloc(craw->nrec);
+        rv = _crawdb_prewarm_levels(craw, fd, nheader, buf, 0, nsorted - 1, 0);
+        free(buf);
+        return rv;
+    }
+
+    /* Hint then read the sorted region sequentially */
+    len = nsorted * craw->nrec;
+    posix_fadvise(fd, nheader, len, POSIX_FADV_WILLNEED);
+    buf = malloc(CRAWDB_PREWARM_CHUNK);
+    for (pos = 0, rv = CRAWDB_OK; pos < len && rv == CRAWDB_OK; pos += nbuf) {
+        nbuf = len - pos < CRAWDB_PREWARM_CHUNK ? len - pos : CRAWDB_PREWARM_CHUNK;
+        if (pread(fd, buf, nbuf, nheader + pos) != (ssize_t)nbuf) {
+            rv = CRAWDB_ERR_READ_IDX_RECORD;
+        }
+    }
+    free(buf);
+
+    return rv;
+}
+
+static int _crawdb_prewarm_levels(crawdb_t *craw, int fd, size_t nheader, uchar *rec, uint64_t start, uint64_t end, int depth) {
+    int rv;
+    uint64_t look;
+
+    if (depth >= CRAWDB_PREWARM_LEVELS) {
+        return CRAWDB_OK;
+    }
+
+    /* Same midpoints as _crawdb_get_bsearch */
+    look = (start + end) / 2;
+    if (pread(fd, rec, craw->nrec, nheader + (look * craw->nrec)) != craw->nrec) {
+        return CRAWDB_ERR_READ_IDX_RECORD;
+    }
+    if (look > start) {
+        try(_crawdb_prewarm_levels(craw, fd, nheader, rec, start, look - 1, depth + 1));
+    }
+    if (look < end) {
+        try(_crawdb_prewarm_levels(craw, fd, nheader, rec, look + 1, end, depth + 1));
+    }
+
+    return CRAWDB_OK;
+}
+
+static void _crawdb_prewarm_unmap(crawdb_t *craw) {
+    if (craw->warm_map) {
+        munmap(craw->warm_map, craw->nwarm_map);
+        craw->warm_map = NULL;
+        craw->nwarm_map = 0;
+    }
+}
+
+static int _crawdb_scrub_keys(crawdb_t *craw, uchar *buf, uint64_t nsorted, crawdb_scrub_t *out_scrub) {
+    uint64_t i;
+    uint64_t nlive;
+    uint64_t start;
+    uint64_t end;
+    uint64_t look;
+    uint64_t nunsorted;
+    uchar *rec;
+    uchar *tail;
+    int cmp;
+
+    #define DEL(__rec) ((__rec)[craw->nkey + 8 + 4 + 2])
+
+    /* Sorted records must ascend; a key may repeat only if all but one copy is deleted */
+    nlive = 0;
+    for (i = 0; i < nsorted; i++) {
+        rec = buf + (craw->nrec * i);
+        if (i > 0) {
+            cmp = _crawdb_key_cmp_full(craw, rec - craw->nrec, rec);
+            if (cmp > 0) out_scrub->bad_order += 1;
+            if (cmp != 0) nlive = 0;
+        }
+        if (!DEL(rec)) {
+            if (nlive > 0) out_scrub->dups += 1;
+            nlive += 1;
+        }
+    }
+
+    /* Live unsorted keys must not be live in the sorted records */
+    for (i = nsorted; i < craw->ntotal; i++) {
+        rec = buf + (craw->nrec * i);
+        if (DEL(rec) || nsorted == 0) continue;
+        start = 0;
+        end = nsorted;
+        while (start < end) {
+            look = (start + end) / 2;
+            if (_crawdb_key_cmp_full(craw, buf + (craw->nrec * look), rec) < 0) start = look + 1;
+            else end = look;
+        }
+        for (look = start; look < nsorted && _crawdb_key_cmp_full(craw, buf + (craw->nrec * look), rec) == 0; look++) {
+            if (!DEL(buf + (craw->nrec * look))) {
+                out_scrub->dups += 1;
+                break;
+            }
+        }
+    }
+
+    /* Or live twice among unsorted records */
+    nunsorted = 0;
+    tail = malloc(((craw->ntotal - nsorted) * craw->nrec) + 1);
+    for (i = nsorted; i < craw->ntotal; i++) {
+        rec = buf + (craw->nrec * i);
+        if (DEL(rec)) continue;
+        memcpy(tail + (craw->nrec * nunsorted), rec, craw->nrec);
+        nunsorted += 1;
+    }
+    qsort_r(tail, nunsorted, craw->nrec, _crawdb_index_sort_cmp, craw);
+    for (i = 1; i < nunsorted; i++) {
+        if (_crawdb_key_cmp_full(craw, tail + (craw->nrec * (i - 1)), tail + (craw->nrec * i)) == 0) out_scrub->dups += 1;
+    }
+    free(tail);
+
+    #undef DEL
+
+    return CRAWDB_OK;
+}
+
+static int _crawdb_scrub_order_cmp(const void *a, const void *b, void *arg) {
+    crawdb_scrub_job_t *job;
+    crawdb_t *craw;
+    uint64_t offset_a;
+    uint64_t offset_b;
+
+    job = arg;
+    craw = job->craw;
+    memcpy(&offset_a, job->buf + (craw->nrec * *(uint64_t*)a) + craw->nkey, 8);
+    memcpy(&offset_b, job->buf + (craw->nrec * *(uint64_t*)b) + craw->nkey, 8);
+    return offset_a < offset_b ? -1 : (offset_a > offset_b ? 1 : 0);
+}
+
+static void *_crawdb_scrub_run(void *arg) {
+    crawdb_scrub_job_t *job;
+    crawdb_t *craw;
+    uchar *win;
+    uint64_t win_offset;
+    uint64_t win_len;
+    uint64_t i;
+    uint64_t key_i;
+    uchar *rec;
+    uint64_t offset;
+    uint32_t len;
+    uint16_t cksum;
+    uint32_t pos;
+    uint32_t n;
+    uint16_t crc;
+    ssize_t iorv;
+    uint64_t seg;
+    int fd;
+
+    job = arg;
+    craw = job->craw;
+    win = malloc(CRAWDB_SCRUB_CHUNK);
+    win_offset = 0;
+    win_len = 0;
+
+    for (i = job->start; i < job->end; i++) {
+        key_i = job->order[i];
+        rec = job->buf + (craw->nrec * key_i);
+        if (rec[craw->nkey + 8 + 4 + 2]) continue; /* deleted */
+        memcpy(&offset, rec + craw->nkey, 8);
+        memcpy(&len,    rec + craw->nkey + 8, 4);
+        memcpy(&cksum,  rec + craw->nkey + 8 + 4, 2);
+
+        /* Value must lie within its segment; fds were opened before threads started */
+        seg = offset >> CRAWDB_SEGMENT_SHIFT;
+        fd = seg == 0 ? craw->fd_dat : craw->seg_fds[seg];
+        if ((offset & CRAWDB_SEGMENT_MASK) > job->seg_sizes[seg] || len > job->seg_sizes[seg] - (offset & CRAWDB_SEGMENT_MASK)) {
+            job->bad[key_i] = 1;
+            job->bad_bounds += 1;
+            continue;
+        }
+
+        /* Checksum value through a window of large sequential reads */
+        crc = CRAWDB_CKSUM_INIT;
+        for (pos = 0; pos < len; pos += n) {
+            if (offset + pos < win_offset || offset + pos >= win_offset + win_len) {
+                win_offset = offset + pos;
+                iorv = fd >= 0 ? pread(fd, win, CRAWDB_SCRUB_CHUNK, win_offset & CRAWDB_SEGMENT_MASK) : 0;
+                win_len = iorv > 0 ? iorv : 0;
+                if (win_len == 0) break;
+            }
+            n = win_offset + win_len - (offset + pos);
+            if (n > len - pos) n = len - pos;
+            crc = _crawdb_cksum_update(crc, win + (offset + pos - win_offset), n);
+        }
+        if (pos < len) {
+            job->bad[key_i] = 1;
+            job->bad_bounds += 1;
+            continue;
+        }
+        if (_crawdb_cksum_final(crc) != cksum) {
+            job->bad[key_i] = 1;
+            job->bad_cksum += 1;
+        }
+        job->dat_bytes += len;
+    }
+
+    free(win);
+    return NULL;
+}
+
+static int _crawdb_freeze_build(crawdb_t *craw, uchar *buf, uint64_t n, uint64_t **out_words, uint64_t *out_nwords, uint64_t *levels, uint32_t *out_nlevels) {
+    uint64_t *pending;
+    uint64_t npending;
+    uint64_t *words;
+    uint64_t nwords;
+    uint64_t *coll;
+    uint64_t lwords;
+    uint64_t *lvl;
+    uint64_t b;
+    uint64_t i;
+    uint64_t j;
+    uint32_t l;
+    uchar *key;
+
+    /* Every key starts pending at level 0 */
+    pending = malloc(n > 0 ? n * 8 : 1);
+    for (i = 0; i < n; i++) pending[i] = i;
+    npending = n;
+    words = NULL;
+    nwords = 0;
+    levels[0] = 0;
+
+    for (l = 0; npending > 0 && l < CRAWDB_MPH_MAX_LEVELS; l++) {
+        /* Size level at gamma bits per pending key */
+        lwords = (npending * CRAWDB_MPH_GAMMA + 63) / 64;
+        words = realloc(words, (nwords + lwords) * 8);
+        lvl = words + nwords;
+        memset(lvl, 0, lwords * 8);
+        coll = calloc(lwords, 8);
+
+        /* Mark occupied and colliding bits */
+        for (i = 0; i < npending; i++) {
+            key = buf + (craw->nrec * pending[i]);
+            b = _crawdb_hash(key, craw->nkey, craw->nkey, l) % (lwords * 64);
+            if (lvl[b / 64] & (1ULL << (b % 64))) {
+                coll[b / 64] |= 1ULL << (b % 64);
+            } else {
+                lvl[b / 64] |= 1ULL << (b % 64);
+            }
+        }
+
+        /* Colliding keys fall through to the next level */
+        for (i = 0, j = 0; i < npending; i++) {
+            key = buf + (craw->nrec * pending[i]);
+            b = _crawdb_hash(key, craw->nkey, craw->nkey, l) % (lwords * 64);
+            if (coll[b / 64] & (1ULL << (b % 64))) {
+                pending[j++] = pending[i];
+            }
+        }
+        npending = j;
+        for (i = 0; i < lwords; i++) {
+            lvl[i] &= ~coll[i];
+        }
+        free(coll);
+
+        nwords += lwords;
+        levels[l + 1] = nwords;
+    }
+    free(pending);
+
+    /* Give up on pathological inputs (e.g., duplicate keys) */
+    if (npending > 0) {
+        free(words);
+        return CRAWDB_ERR_FREEZE_LEVELS;
+    }
+
+    /* Leave room for the rank array directly after the bits */
+    words = realloc(words, (nwords > 0 ? nwords : 1) * 2 * 8);
+
+    *out_words = words;
+    *out_nwords = nwords;
+    *out_nlevels = l;
+    return CRAWDB_OK;
+}
+
+static int _crawdb_freeze_write(crawdb_t *craw, uint64_t *words, uint64_t nwords, uint64_t *levels, uint32_t nlevels, uint64_t *table, uint64_t nkeys) {
+    int rv;
+    char *path_new;
+    char *path_mph;
+    size_t path_len;
+    int fd;
+    uchar header[CRAWDB_MPH_HEADER_SIZE];
+    struct stat st;
+    uint64_t ino;
+    uint8_t vers;
+
+    path_len = strlen(craw->idx_path) + 8; /* ".mph.new" (8) */
+    path_new = malloc(path_len + 1);
+    path_mph = malloc(path_len + 1);
+    snprintf(path_new, path_len + 1, "%s.mph.new", craw->idx_path);
+    snprintf(path_mph, path_len + 1, "%s.mph", craw->idx_path);
+    fd = -1;
+
+    /* Note idx inode so a swapped index never uses a stale sidecar */
+    goto_if_err(fstat(craw->fd_idx, &st) != 0, CRAWDB_ERR_FREEZE_READ, _crawdb_freeze_write_end);
+    ino = (uint64_t)st.st_ino;
+
+    /* Prep header */
+    vers = CRAWDB_MPH_VERS;
+    memset(header, 0, CRAWDB_MPH_HEADER_SIZE);
+    memcpy(header,      "CMPH",     4); /* [0  -> 4]  magic   (4) */
+    memcpy(header + 4,  &vers,      1); /* [4  -> 5]  vers    (1) */
+    memcpy(header + 8,  &craw->nkey, 4); /* [8  -> 12] nkey    (4) */
+    memcpy(header + 12, &nlevels,   4); /* [12 -> 16] nlevels (4) */
+    memcpy(header + 16, &craw->ntotal, 8); /* [16 -> 24] ntotal  (8) */
+    memcpy(header + 24, &ino,       8); /* [24 -> 32] idx_ino (8) */
+    memcpy(header + 32, &nwords,    8); /* [32 -> 40] nwords  (8) */
+    memcpy(header + 40, &nkeys,     8); /* [40 -> 48] nkeys   (8) */
+
+    /* Write new sidecar */
+    fd = open(path_new, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+    goto_if_err(fd < 0, CRAWDB_ERR_FREEZE_OPEN, _crawdb_freeze_write_end);
+    goto_if_err(write(fd, header, CRAWDB_MPH_HEADER_SIZE) != CRAWDB_MPH_HEADER_SIZE, CRAWDB_ERR_FREEZE_WRITE, _crawdb_freeze_write_end);
+    goto_if_err(write(fd, levels, (nlevels + 1) * 8) != (ssize_t)((nlevels + 1) * 8), CRAWDB_ERR_FREEZE_WRITE, _crawdb_freeze_write_end);
+    goto_if_err(write(fd, words, nwords * 2 * 8) != (ssize_t)(nwords * 2 * 8), CRAWDB_ERR_FREEZE_WRITE, _crawdb_freeze_write_end); /* bits and ranks */
+    goto_if_err(write(fd, table, nkeys * 8) != (ssize_t)(nkeys * 8), CRAWDB_ERR_FREEZE_WRITE, _crawdb_freeze_write_end);
+    close(fd);
+    fd = -1;
+
+    /* Swap in sidecar */
+    goto_if_err(rename(path_new, path_mph) != 0, CRAWDB_ERR_FREEZE_RENAME, _crawdb_freeze_write_end);
+
+    rv = CRAWDB_OK;
+
+_crawdb_freeze_write_end:
+    if (fd >= 0) {
+        close(fd);
+        unlink(path_new);
+    }
+    free(path_new);
+    free(path_mph);
+    return rv;
+}
+
+static int _crawdb_mph_slot(crawdb_mph_t *mph, uchar *key, uint32_t nkey, uint32_t width, uint64_t *out_rank) {
+    uint32_t l;
+    uint64_t lwords;
+    uint64_t b;
+    uint64_t word;
+
+    /* Walk levels until the key lands on a set bit */
+    for (l = 0; l < mph->nlevels; l++) {
+        lwords = mph->levels[l + 1] - mph->levels[l];
+        b = (mph->levels[l] * 64) + (_crawdb_hash(key, nkey, width, l) % (lwords * 64));
+        word = mph->words[b / 64];
+        if (word & (1ULL << (b % 64))) {
+            *out_rank = mph->ranks[b / 64] + __builtin_popcountll(word & ((1ULL << (b % 64)) - 1));
+            return CRAWDB_OK;
+        }
+    }
+
+    return CRAWDB_ERR;
+}
+
+static int _crawdb_mph_load(crawdb_t *craw) {
+    char *path_mph;
+    size_t path_len;
+    int fd;
+    struct stat st;
+    uchar *map;
+    crawdb_mph_t *mph;
+    uint32_t nkey;
+    uint32_t nlevels;
+    uint64_t ntotal;
+    uint64_t ino;
+    uint64_t nwords;
+    uint64_t nkeys;
+    uint64_t size;
+
+    /* A missing or unusable sidecar just means the normal search path */
+    path_len = strlen(craw->idx_path) + 4; /* ".mph" (4) */
+    path_mph = malloc(path_len + 1);
+    snprintf(path_mph, path_len + 1, "%s.mph", craw->idx_path);
+    fd = open(path_mph, O_RDONLY);
+    free(path_mph);
+    if (fd < 0) {
+        return CRAWDB_OK;
+    }
+
+    map = NULL;
+    if (fstat(fd, &st) != 0 || st.st_size < CRAWDB_MPH_HEADER_SIZE) {
+        goto _crawdb_mph_load_end;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        goto _crawdb_mph_load_end;
+    }
+
+    /* Validate header against this idx */
+    memcpy(&nkey,    map + 8,  4);
+    memcpy(&nlevels, map + 12, 4);
+    memcpy(&ntotal,  map + 16, 8);
+    memcpy(&ino,     map + 24, 8);
+    memcpy(&nwords,  map + 32, 8);
+    memcpy(&nkeys,   map + 40, 8);
+    if (memcmp(map, "CMPH", 4) != 0 || map[4] != CRAWDB_MPH_VERS) goto _crawdb_mph_load_end;
+    if (nkey != craw->nkey || nlevels > CRAWDB_MPH_MAX_LEVELS) goto _crawdb_mph_load_end;
+    if (ntotal != craw->ntotal || ntotal != craw->nsorted || nkeys > ntotal) goto _crawdb_mph_load_end;
+    if (fstat(craw->fd_idx, &st) != 0 || ino != (uint64_t)st.st_ino) goto _crawdb_mph_load_end;
+    size = CRAWDB_MPH_HEADER_SIZE + ((nlevels + 1) * 8) + (nwords * 2 * 8) + (nkeys * 8);
+    if (fstat(fd, &st) != 0 || size != (uint64_t)st.st_size) goto _crawdb_mph_load_end;
+
+    /* Point into the mapping */
+    mph = calloc(1, sizeof(crawdb_mph_t));
+    mph->map = map;
+    mph->nmap = (size_t)size;
+    mph->nlevels = nlevels;
+    mph->ntotal = ntotal;
+    mph->nkeys = nkeys;
+    mph->levels = (uint64_t*)(map + CRAWDB_MPH_HEADER_SIZE);
+    mph->words = mph->levels + nlevels + 1;
+    mph->ranks = mph->words + nwords;
+    mph->table = mph->ranks + nwords;
+    craw->mph = mph;
+    map = NULL;
+
+_crawdb_mph_load_end:
+    if (map) munmap(map, (size_t)st.st_size);
+    close(fd);
+    return CRAWDB_OK;
+}
+
+static int _crawdb_mph_unload(crawdb_t *craw) {
+    if (craw->mph) {
+        munmap(craw->mph->map, craw->mph->nmap);
+        free(craw->mph);
+        craw->mph = NULL;
+    }
+    return CRAWDB_OK;
+}
+
+static uint64_t _crawdb_hash(uchar *key, uint32_t nkey, uint32_t width, uint64_t seed) {
+    uint64_t h;
+    uint32_t i;
+
+    /* FNV-1a with a splitmix64 finalizer; key is hashed as if zero-padded to width */
+    h = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+    for (i = 0; i < nkey; i++) {
+        h ^= key[i];
+        h *= 0x100000001b3ULL;
+    }
+    for (; i < width; i++) {
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static uint16_t _crawdb_cksum_update(uint16_t crc, uchar *val, uint32_t len) {
+    int i;
+    uint16_t data;
+
+    /* Apply CRC-16 checksum algorithm */
+    while (len-- > 0) {
+        for (i = 0, data=0x00ff & (uint16_t)(*val++); i < 8; i++, data >>= 1) {
+            if ((crc & 0x0001) ^ (data & 0x0001)) {
+                crc = (crc >> 1) ^ 0x8408;
+            } else {
+                crc >>= 1;
+            }
+        }
+    }
+
+    return crc;
+}
+
+static uint16_t _crawdb_cksum_final(uint16_t crc) {
+    uint16_t data;
+
+    crc = ~crc;
+    data = crc;
+    crc = (crc << 8) | (data >> 8 & 0xff);
+
+    return crc;
+}
+
+static int _crawdb_reload_for_index(crawdb_t *craw) {
+    crawdb_t *craw_ignore;
+    return _crawdb_open(0, CRAWDB_OPEN_INDEX, craw, craw->idx_path, craw->dat_path, 0, &craw_ignore);
+}
+
+static int _crawdb_open(int is_new, int mode, crawdb_t *reload, char *idx_path, char *dat_path, uint32_t nkey, crawdb_t **out_craw) {
+    int rv;
+    int rc;
+    crawdb_t *craw;
+    int fd_dat;
+    int fd_idx;
+    int flags;
+    off_t idx_size;
+    ssize_t iorv;
+    uchar header[CRAWDB_HEADER_SIZE];
+    char *craw_str;
+    uint8_t dead;
+
+    craw_str = "CRAW";
+    craw = NULL;
+    fd_idx = -1;
+    fd_dat = -1;
+
+    /* Set open flags */
+    flags = O_RDWR | O_CREAT;
+    if (is_new) {
+        flags |= O_TRUNC;
+    }
+    if (mode == CRAWDB_OPEN_APPEND) {
+        flags |= O_APPEND;
+    } else if (mode == CRAWDB_OPEN_SNAPSHOT) {
+        flags = O_RDONLY;
+    }
+
+    /* Open idx */
+    fd_idx = open(idx_path, flags, 00644);
+    goto_if_err(fd_idx < 0, CRAWDB_ERR_OPEN_IDX, _crawdb_open_err);
+
+    /* Open dat */
+    fd_dat = open(dat_path, flags, 00644);
+    goto_if_err(fd_dat < 0, CRAWDB_ERR_OPEN_DAT, _crawdb_open_err);
+
+    /* Snapshots hold dat shared so reclaim leaves the segments they pin */
+    if (mode == CRAWDB_OPEN_SNAPSHOT) {
+        goto_if_err(flock(fd_dat, LOCK_SH) != 0, CRAWDB_ERR_LOCK_SH, _crawdb_open_err);
+    }
+
+    if (is_new) {
+        /* Error if nkey lt 1 */
+        goto_if_err(nkey < 1, CRAWDB_ERR_OPEN_NKEY_ZERO, _crawdb_open_err);
+
+        /* Write idx header */
+        memcpy(header, craw_str, 4);
+        header[4] = CRAWDB_HEADER_VERS; /* version */
+        memcpy(header + 5, &nkey, 4);   /* keylen */
+        memset(header + 9, 0, 8);       /* nsorted */
+        header[CRAWDB_OFFSET_DEAD] = 0; /* deadflag */
+        memset(header + CRAWDB_OFFSET_GEN, 0, CRAWDB_HEADER_SIZE - CRAWDB_OFFSET_GEN); /* gen, reserved */
+        iorv = write(fd_idx, header, CRAWDB_HEADER_SIZE);
+        goto_if_err(iorv != CRAWDB_HEADER_SIZE, CRAWDB_ERR_OPEN_WRITE_HEADER, _crawdb_open_err);
+
+    } else {
+        /* Read idx header */
+        iorv = read(fd_idx, header, CRAWDB_HEADER_SIZE_V1);
+        goto_if_err(iorv != CRAWDB_HEADER_SIZE_V1, CRAWDB_ERR_OPEN_READ_HEADER, _crawdb_open_err);
+
+        /* Check header */
+        rc = strncmp((const char*)header, craw_str, 4);
+        goto_if_err(rc != 0, CRAWDB_ERR_OPEN_BAD_HEADER, _crawdb_open_err);
+
+        /* Check header version; vers 1 is upgraded on next index */
+        goto_if_err(header[4] < 1 || header[4] > CRAWDB_HEADER_VERS, CRAWDB_ERR_OPEN_BAD_VERS, _crawdb_open_err);
+        memset(header + CRAWDB_HEADER_SIZE_V1, 0, CRAWDB_HEADER_SIZE - CRAWDB_HEADER_SIZE_V1);
+        if (header[4] > 1) {
+            iorv = read(fd_idx, header + CRAWDB_HEADER_SIZE_V1, CRAWDB_HEADER_SIZE - CRAWDB_HEADER_SIZE_V1);
+            goto_if_err(iorv != CRAWDB_HEADER_SIZE - CRAWDB_HEADER_SIZE_V1, CRAWDB_ERR_OPEN_READ_HEADER, _crawdb_open_err);
+        }
+    }
+
+    /* Reuse or allocate new struct */
+    if (reload) {
+        craw = reload;
+        craw->stats.reloads += 1;
+        if (craw->fd_idx >= 0) close(craw->fd_idx);
+        if (craw->fd_dat >= 0) close(craw->fd_dat);
+        if (craw->fd_idx_rw >= 0) close(craw->fd_idx_rw);
+        if (craw->fd_dat_rw >= 0) close(craw->fd_dat_rw);
+        if (craw->fd_live >= 0) close(craw->fd_live);
+    } else {
+        craw = calloc(1, sizeof(crawdb_t));
+        craw->idx_path  = strdup(idx_path);
+        craw->dat_path  = strdup(dat_path);
+        craw->fd_seg    = -1;
+        craw->fd_stage  = -1;
+    }
+
+    /* Set fields */
+    craw->fd_idx = fd_idx;
+    craw->fd_dat = fd_dat;
+    craw->fd_idx_rw = -1;
+    craw->fd_dat_rw = -1;
+    craw->fd_live = -1;
+    craw->idx_alloc = 0;
+    craw->dat_alloc = 0;
+    craw->snapshot = mode == CRAWDB_OPEN_SNAPSHOT;
+    craw->vers = (uint8_t)header[4];
+    craw->nheader = craw->vers > 1 ? CRAWDB_HEADER_SIZE : CRAWDB_HEADER_SIZE_V1;
+    memcpy(&craw->gen, header + CRAWDB_OFFSET_GEN, 8);
+    memcpy(&craw->nkey, header + 5, 4); /* TODO endianness */
+    memcpy(&craw->nsorted, header + 9, 8);
+    craw->dead = (uint8_t)header[CRAWDB_OFFSET_DEAD];
+    craw->nrec = craw->nkey + 8 + 4 + 2 + 1; /* key (nkey) + offset (8) + len (4) + cksum (2) + del (1) */
+    craw->kernel = _crawdb_kernel(craw->nkey);
+
+    /* Get index size, from the header if preallocated */
+    rc = _crawdb_read_ends(craw, &dead, &idx_size, NULL);
+    goto_if_err(rc != CRAWDB_OK, rc, _crawdb_open_err);
+
+    /* Snapshots pin whole records; later appends and dat beyond them are never read */
+    if (craw->snapshot && idx_size > craw->nheader) {
+        idx_size = craw->nheader + (((idx_size - craw->nheader) / craw->nrec) * craw->nrec);
+    }
+
+    /* Set index size */
+    rc = _crawdb_set_idx_size(craw, idx_size);
+    goto_if_err(rc != CRAWDB_OK, rc, _crawdb_open_err);
+
+    /* Map perfect hash sidecar if present and current */
+    _crawdb_mph_unload(craw);
+    _crawdb_mph_load(craw);
+
+    /* Pinned pages belong to the old idx */
+    _crawdb_prewarm_unmap(craw);
+
+    /* Record buf is allocated up front so lookups do not allocate */
+    if (!craw->rec) craw->rec = malloc(craw->nrec);
+
+    *out_craw = craw;
+    return CRAWDB_OK;
+
+_crawdb_open_err:
+    if (!reload && craw) {
+        if (craw->idx_path) free(craw->idx_path);
+        if (craw->dat_path) free(craw->dat_path);
+        free(craw);
+    }
+    if (fd_idx >= 0) close(fd_idx);
+    if (fd_dat >= 0) close(fd_dat);
+    return rv;
+}
+
+static int _crawdb_open_rw(crawdb_t *craw) {
+    int rc;
+    struct stat st_idx;
+    struct stat st_rw;
+
+    /* Non-append fds for in-place writes are kept until reload */
+    if (craw->fd_idx_rw < 0) {
+        craw->fd_idx_rw = open(craw->idx_path, O_RDWR);
+        return_if_err(craw->fd_idx_rw < 0, CRAWDB_ERR_DELETE_OPEN);
+
+        /* Path may already name a newer idx */
+        rc = fstat(craw->fd_idx, &st_idx) | fstat(craw->fd_idx_rw, &st_rw);
+        if (rc != 0 || st_idx.st_ino != st_rw.st_ino) {
+            close(craw->fd_idx_rw);
+            craw->fd_idx_rw = -1;
+            return CRAWDB_ERR_SET_IDX_DEAD;
+        }
+    }
+
+    /* Preallocated appends write dat in place too */
+    if ((craw->flags & CRAWDB_FLAG_PREALLOC) && craw->fd_dat_rw < 0) {
+        craw->fd_dat_rw = open(craw->dat_path, O_RDWR);
+        return_if_err(craw->fd_dat_rw < 0, CRAWDB_ERR_OPEN_DAT);
+    }
+    return CRAWDB_OK;
+}
+
+static int _crawdb_read_ends(crawdb_t *craw, uint8_t *out_dead, off_t *out_idx_end, off_t *out_dat_end) {
+    uchar state[CRAWDB_OFFSET_DAT_END + 8 - CRAWDB_OFFSET_DEAD];
+    uchar again[CRAWDB_OFFSET_DAT_END + 8 - CRAWDB_OFFSET_DEAD];
+    size_t nstate;
+    uint64_t end;
+
+    /* One pread covers dead, flags, and ends; v1 headers end after dead */
+    nstate = craw->vers > 1 ? sizeof(state) : 1;
+    return_if_err(pread(craw->fd_idx, state, nstate, CRAWDB_OFFSET_DEAD) != (ssize_t)nstate, CRAWDB_ERR_SET_PREAD_DEAD);
+    craw->flags = craw->vers > 1 ? state[CRAWDB_OFFSET_FLAGS - CRAWDB_OFFSET_DEAD] : 0;
+    return_if_err(craw->flags & ~CRAWDB_FLAGS_KNOWN, CRAWDB_ERR_OPEN_BAD_FLAGS);
+    *out_dead = state[0];
+
+    /* Idx end before dat end, as sets write dat before idx */
+    if (!(craw->flags & CRAWDB_FLAG_PREALLOC)) {
+        *out_idx_end = lseek(craw->fd_idx, 0, SEEK_END);
+        return_if_err(*out_idx_end < 0, CRAWDB_ERR_SET_LSEEK);
+        if (out_dat_end) {
+            *out_dat_end = lseek(craw->fd_dat, 0, SEEK_END);
+            return_if_err(*out_dat_end < 0, CRAWDB_ERR_SET_LSEEK);
+        }
+        return CRAWDB_OK;
+    }
+
+    /* Without the lock a commit may land mid-read; reread until two reads agree */
+    while (!craw->locked) {
+        return_if_err(pread(craw->fd_idx, again, nstate, CRAWDB_OFFSET_DEAD) != (ssize_t)nstate, CRAWDB_ERR_SET_PREAD_DEAD);
+        if (memcmp(state, again, nstate) == 0) break;
+        memcpy(state, again, nstate);
+    }
+    memcpy(&end, state + CRAWDB_OFFSET_IDX_END - CRAWDB_OFFSET_DEAD, 8);
+    *out_idx_end = (off_t)end;
+    if (out_dat_end) {
+        memcpy(&end, state + CRAWDB_OFFSET_DAT_END - CRAWDB_OFFSET_DEAD, 8);
+        *out_dat_end = (off_t)end;
+    }
+    return CRAWDB_OK;
+}
+
+static int _crawdb_prealloc_ensure(int fd, uint64_t *inout_alloc, uint64_t end, uint64_t chunk) {
+    struct stat st;
+    uint64_t len;
+
+    if (end <= *inout_alloc) return CRAWDB_OK;
+
+    /* Another writer may have already extended the file */
+    return_if_err(fstat(fd, &st) != 0, CRAWDB_ERR_PREALLOC);
+    *inout_alloc = (uint64_t)st.st_size;
+    if (end <= *inout_alloc) return CRAWDB_OK;
+
+    /* Allocate whole chunks so appends land in large extents and never grow the file */
+    len = ((end - *inout_alloc + chunk - 1) / chunk) * chunk;
+    return_if_err(posix_fallocate(fd, (off_t)*inout_alloc, (off_t)len) != 0, CRAWDB_ERR_PREALLOC);
+    *inout_alloc += len;
+    return CRAWDB_OK;
+}
+
+static int _crawdb_set_check(crawdb_t *craw, uchar *key, uint32_t nkey, off_t *out_dat_end) {
+    int rc;
+    off_t idx_size;
+    uint8_t dead;
+    uchar *get_val;
+    uint32_t get_nval;
+    uint64_t key_i;
+
+    /* Lock; callers unlock on error */
+    rc = _crawdb_lock(craw);
+    if (rc != CRAWDB_OK) return rc;
+
+    /* Check dead flag and refresh ends so the dupe check sees records from other writers */
+    rc = _crawdb_read_ends(craw, &dead, &idx_size, out_dat_end);
+    if (rc != CRAWDB_OK) return rc;
+    if (dead != 0) craw->stats.dead_flags += 1;
+    return_if_err(dead != 0, CRAWDB_ERR_SET_IDX_DEAD);
+    rc = _crawdb_set_idx_size(craw, idx_size);
+    if (rc != CRAWDB_OK) return rc;
+
+    /* Preallocated appends write in place through non-append fds */
+    if (craw->flags & CRAWDB_FLAG_PREALLOC) {
+        rc = _crawdb_open_rw(craw);
+        if (rc != CRAWDB_OK) return rc;
+    }
+
+    /* Ensure key does not already exist */
+    if (crawdb_get(craw, key, nkey, &get_val, &get_nval, &key_i) == CRAWDB_OK && get_val != NULL) {
+        return CRAWDB_ERR_SET_ALREADY_EXISTS;
+    }
+    return CRAWDB_OK;
+}
 
-    /* Reload for O_APPEND */
-    try(crawdb_reload(craw));
+static int _crawdb_set_unstage(crawdb_t *craw, off_t dat_end) {
+    ssize_t iorv;
+    loff_t offset_src;
+    loff_t offset_dst;
+    int rc;
 
-    /* Unlock */
-    try(_crawdb_unlock(craw));
+    /* Caller holds the lock, so dat_end stays the end while we copy in place */
+    if (craw->fd_dat_rw < 0) {
+        craw->fd_dat_rw = open(craw->dat_path, O_RDWR);
+        return_if_err(craw->fd_dat_rw < 0, CRAWDB_ERR_OPEN_DAT);
+    }
+    if (craw->flags & CRAWDB_FLAG_PREALLOC) {
+        rc = _crawdb_prealloc_ensure(craw->fd_dat_rw, &craw->dat_alloc, (uint64_t)dat_end + craw->set_len, CRAWDB_PREALLOC_DAT_CHUNK);
+        if (rc != CRAWDB_OK) return rc;
+    }
+    offset_src = 0;
+    offset_dst = (loff_t)dat_end;
+    while ((uint64_t)offset_src < craw->set_len) {
+        iorv = copy_file_range(craw->fd_stage, &offset_src, craw->fd_dat_rw, &offset_dst, craw->set_len - (uint64_t)offset_src, 0);
+        return_if_err(iorv <= 0, CRAWDB_ERR_SET_WRITE_DAT);
+    }
+    craw->set_offset = (uint64_t)dat_end;
 
+    /* Give back the staged space; a later stream overwrites it anyway */
+    if (ftruncate(craw->fd_stage, 0) != 0) {
+        close(craw->fd_stage);
+        craw->fd_stage = -1;
+    }
     return CRAWDB_OK;
 }
 
-static int _crawdb_reload_for_index(crawdb_t *craw) {
-    crawdb_t *craw_ignore;
-    return _crawdb_open(0, 1, craw, craw->idx_path, craw->dat_path, 0, &craw_ignore);
+static char *_crawdb_segment_path(crawdb_t *craw, uint32_t seg) {
+    char *path;
+    size_t npath;
+
+    npath = strlen(craw->dat_path) + 12;
+    path = malloc(npath);
+    snprintf(path, npath, "%s.%u", craw->dat_path, seg);
+    return path;
 }
 
-static int _crawdb_open(int is_new, int for_index, crawdb_t *reload, char *idx_path, char *dat_path, uint32_t nkey, crawdb_t **out_craw) {
+static int _crawdb_segment_acquire(crawdb_t *craw, uint64_t *out_offset) {
     int rv;
     int rc;
-    crawdb_t *craw;
-    int fd_dat;
-    int fd_idx;
-    int flags;
-    off_t idx_size;
-    ssize_t iorv;
-    uchar header[CRAWDB_HEADER_SIZE];
-    char *craw_str;
-
-    craw_str = "CRAW";
-    craw = NULL;
-    fd_idx = -1;
-    fd_dat = -1;
+    int fd;
+    off_t size;
+    uint64_t state[2];
+    uint32_t seg;
+    uint32_t low;
+    char *path;
+    uint8_t dead;
+    off_t idx_end;
+
+    /* Keep appending to this handle's segment until it fills */
+    if (craw->fd_seg >= 0) {
+        size = lseek(craw->fd_seg, 0, SEEK_END);
+        return_if_err(size < 0, CRAWDB_ERR_SET_LSEEK);
+        if ((uint64_t)size < craw->seg_size) {
+            *out_offset = ((uint64_t)craw->seg << CRAWDB_SEGMENT_SHIFT) | (uint64_t)size;
+            return CRAWDB_OK;
+        }
+        close(craw->fd_seg);
+        craw->fd_seg = -1;
+    }
 
-    /* Set open flags */
-    flags = O_RDWR | O_CREAT;
-    if (is_new) {
-        flags |= O_TRUNC;
+    /* Lock only to pick a segment, not for the whole stream */
+    try(_crawdb_lock(craw));
+    rc = _crawdb_read_ends(craw, &dead, &idx_end, NULL);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_segment_acquire_end);
+    if (dead != 0) craw->stats.dead_flags += 1;
+    goto_if_err(dead != 0, CRAWDB_ERR_SET_IDX_DEAD, crawdb_segment_acquire_end);
+    rc = _crawdb_open_rw(craw);
+    goto_if_err(rc != CRAWDB_OK, rc, crawdb_segment_acquire_end);
+    goto_if_err(pread(craw->fd_idx, state, 16, CRAWDB_OFFSET_SEG_SIZE) != 16, CRAWDB_ERR_SEGMENT_OPEN, crawdb_segment_acquire_end);
+    craw->seg_size = state[0];
+
+    /* Take over an unfilled segment no other writer holds, e.g. from one that exited */
+    fd = -1;
+    low = state[1] > CRAWDB_SEGMENT_ACTIVE ? (uint32_t)state[1] - CRAWDB_SEGMENT_ACTIVE : 1;
+    for (seg = (uint32_t)state[1] - 1; seg >= low && fd < 0; seg--) {
+        path = _crawdb_segment_path(craw, seg);
+        fd = open(path, O_WRONLY | O_APPEND);
+        free(path);
+        if (fd < 0) continue;
+        size = lseek(fd, 0, SEEK_END);
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0 && size >= 0 && (uint64_t)size < craw->seg_size) break;
+        close(fd);
+        fd = -1;
     }
-    if (!for_index) {
-        flags |= O_APPEND;
+
+    /* Otherwise start a new segment */
+    if (fd < 0) {
+        seg = (uint32_t)state[1];
+        goto_if_err(state[1] > CRAWDB_SEGMENT_MAX, CRAWDB_ERR_SEGMENT_IDS, crawdb_segment_acquire_end);
+        path = _crawdb_segment_path(craw, seg);
+        fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 00644);
+        free(path);
+        goto_if_err(fd < 0, CRAWDB_ERR_SEGMENT_OPEN, crawdb_segment_acquire_end);
+        state[1] += 1;
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0 || pwrite(craw->fd_idx_rw, &state[1], 8, CRAWDB_OFFSET_SEG_NEXT) != 8) {
+            close(fd);
+            rv = CRAWDB_ERR_SEGMENT_OPEN;
+            goto crawdb_segment_acquire_end;
+        }
+
+        /* Reserve extents without growing the file; best effort */
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)craw->seg_size) != 0) {
+            /* Appends still work */
+        }
+        size = 0;
     }
+    craw->fd_seg = fd;
+    craw->seg = seg;
+    *out_offset = ((uint64_t)seg << CRAWDB_SEGMENT_SHIFT) | (uint64_t)size;
+    rv = CRAWDB_OK;
 
-    /* Open idx */
-    fd_idx = open(idx_path, flags, 00644);
-    goto_if_err(fd_idx < 0, CRAWDB_ERR_OPEN_IDX, _crawdb_open_err);
+crawdb_segment_acquire_end:
+    rc = _crawdb_unlock_if_locked(craw);
+    return rv != CRAWDB_OK ? rv : rc;
+}
 
-    /* Open dat */
-    fd_dat = open(dat_path, flags, 00644);
-    goto_if_err(fd_dat < 0, CRAWDB_ERR_OPEN_DAT, _crawdb_open_err);
+static int _crawdb_dat_fd(crawdb_t *craw, uint64_t offset, int *out_fd, uint64_t *out_pos) {
+    uint32_t seg;
+    uint32_t i;
+    char *path;
 
-    if (is_new) {
-        /* Error if nkey lt 1 */
-        goto_if_err(nkey < 1, CRAWDB_ERR_OPEN_NKEY_ZERO, _crawdb_open_err);
+    /* Segment 0 is the dat file */
+    seg = (uint32_t)(offset >> CRAWDB_SEGMENT_SHIFT);
+    *out_pos = offset & CRAWDB_SEGMENT_MASK;
+    if (seg == 0) {
+        *out_fd = craw->fd_dat;
+        return CRAWDB_OK;
+    }
 
-        /* Write idx header */
-        memcpy(header, craw_str, 4);
-        header[4] = CRAWDB_HEADER_VERS; /* version */
-        memcpy(header + 5, &nkey, 4);   /* keylen */
-        memset(header + 9, 0, 8);       /* nsorted */
-        header[CRAWDB_OFFSET_DEAD] = 0; /* deadflag */
-        iorv = write(fd_idx, header, CRAWDB_HEADER_SIZE);
-        goto_if_err(iorv != CRAWDB_HEADER_SIZE, CRAWDB_ERR_OPEN_WRITE_HEADER, _crawdb_open_err);
+    /* Other segments are opened on first read and kept until free */
+    if (seg >= craw->nseg_fds) {
+        craw->seg_fds = realloc(craw->seg_fds, (seg + 1) * sizeof(int));
+        for (i = craw->nseg_fds; i <= seg; i++) craw->seg_fds[i] = -1;
+        craw->nseg_fds = seg + 1;
+    }
+    if (craw->seg_fds[seg] < 0) {
+        path = _crawdb_segment_path(craw, seg);
+        craw->seg_fds[seg] = open(path, O_RDONLY);
+        free(path);
+        return_if_err(craw->seg_fds[seg] < 0, CRAWDB_ERR_SEGMENT_OPEN);
+    }
+    *out_fd = craw->seg_fds[seg];
+    return CRAWDB_OK;
+}
 
-    } else {
-        /* Read idx header */
-        iorv = read(fd_idx, header, CRAWDB_HEADER_SIZE);
-        goto_if_err(iorv != CRAWDB_HEADER_SIZE, CRAWDB_ERR_OPEN_READ_HEADER, _crawdb_open_err);
+static char *_crawdb_live_path(crawdb_t *craw, char *suffix) {
+    char *path;
+    size_t npath;
 
-        /* Check header */
-        rc = strncmp((const char*)header, craw_str, 4);
-        goto_if_err(rc != 0, CRAWDB_ERR_OPEN_BAD_HEADER, _crawdb_open_err);
+    npath = strlen(craw->idx_path) + strlen(suffix) + 1;
+    path = malloc(npath);
+    snprintf(path, npath, "%s%s", craw->idx_path, suffix);
+    return path;
+}
 
-        /* Check header version */
-        goto_if_err(header[4] != CRAWDB_HEADER_VERS, CRAWDB_ERR_OPEN_BAD_VERS, _crawdb_open_err);
-    }
+static int _crawdb_live_create(char *path, uint64_t gen, uint64_t *live, uint32_t nlive) {
+    int fd;
+    int ok;
+
+    /* Gen, then one live record count per segment id */
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+    return_if_err(fd < 0, CRAWDB_ERR_LIVE_WRITE);
+    ok = pwrite(fd, &gen, 8, 0) == 8
+        && (nlive == 0 || pwrite(fd, live, nlive * 8, CRAWDB_LIVE_HEADER) == (ssize_t)(nlive * 8));
+    close(fd);
+    return ok ? CRAWDB_OK : CRAWDB_ERR_LIVE_WRITE;
+}
 
-    /* Reuse or allocate new struct */
-    if (reload) {
-        craw = reload;
-        if (craw->fd_idx >= 0) close(craw->fd_idx);
-        if (craw->fd_dat >= 0) close(craw->fd_dat);
-    } else {
-        craw = calloc(1, sizeof(crawdb_t));
-        craw->idx_path  = strdup(idx_path);
-        craw->dat_path  = strdup(dat_path);
+static void _crawdb_live_open(crawdb_t *craw) {
+    char *path;
+    uint64_t gen;
+
+    /* Open once per idx; -2 marks a missing or stale file, which leaves reclaim to scan */
+    if (craw->fd_live != -1) return;
+    path = _crawdb_live_path(craw, ".live");
+    craw->fd_live = open(path, O_RDWR);
+    free(path);
+    if (craw->fd_live >= 0 && (pread(craw->fd_live, &gen, 8, 0) != 8 || gen != craw->gen)) {
+        close(craw->fd_live);
+        craw->fd_live = -1;
     }
+    if (craw->fd_live < 0) craw->fd_live = -2;
+}
 
-    /* Set fields */
-    craw->fd_idx = fd_idx;
-    craw->fd_dat = fd_dat;
-    craw->vers = (uint8_t)header[4];
-    memcpy(&craw->nkey, header + 5, 4); /* TODO endianness */
-    memcpy(&craw->nsorted, header + 9, 8);
-    craw->dead = (uint8_t)header[CRAWDB_OFFSET_DEAD];
-    craw->nrec = craw->nkey + 8 + 4 + 2 + 1; /* key (nkey) + offset (8) + len (4) + cksum (2) + del (1) */
+static void _crawdb_live_count(crawdb_t *craw, uchar *recs, uint64_t n, uint64_t *live) {
+    uchar *rec;
+    uint64_t offset;
+    uint64_t i;
 
-    /* Get index size */
-    idx_size = lseek(fd_idx, 0, SEEK_END);
-    goto_if_err(idx_size < 0, CRAWDB_ERR_OPEN_LSEEK, _crawdb_open_err);
+    for (i = 0; i < n; i++) {
+        rec = recs + (i * craw->nrec);
+        if (rec[craw->nkey + 8 + 4 + 2]) continue; /* deleted */
+        memcpy(&offset, rec + craw->nkey, 8);
+        live[offset >> CRAWDB_SEGMENT_SHIFT] += 1;
+    }
+}
 
-    /* Set index size */
-    rc = _crawdb_set_idx_size(craw, idx_size);
-    goto_if_err(rc != CRAWDB_OK, rc, _crawdb_open_err);
+static int _crawdb_live_add_fd(int fd, uint64_t offset, int64_t delta) {
+    uint64_t count;
+    off_t pos;
 
-    *out_craw = craw;
+    /* Counts past the end of the file are zero */
+    pos = CRAWDB_LIVE_HEADER + (off_t)((offset >> CRAWDB_SEGMENT_SHIFT) * 8);
+    count = 0;
+    return_if_err(pread(fd, &count, 8, pos) < 0, CRAWDB_ERR_LIVE_WRITE);
+    count = delta < 0 && count < (uint64_t)-delta ? 0 : count + (uint64_t)delta;
+    return_if_err(pwrite(fd, &count, 8, pos) != 8, CRAWDB_ERR_LIVE_WRITE);
     return CRAWDB_OK;
+}
 
-_crawdb_open_err:
-    if (!reload && craw) {
-        if (craw->idx_path) free(craw->idx_path);
-        if (craw->dat_path) free(craw->dat_path);
-        free(craw);
+static int _crawdb_live_add(crawdb_t *craw, uint64_t offset, int64_t delta) {
+    /* Only segments are counted; caller holds the lock */
+    if (!(craw->flags & CRAWDB_FLAG_SEGMENTED) || (offset >> CRAWDB_SEGMENT_SHIFT) == 0) return CRAWDB_OK;
+    _crawdb_live_open(craw);
+    if (craw->fd_live < 0) return CRAWDB_OK;
+    return _crawdb_live_add_fd(craw->fd_live, offset, delta);
+}
+
+static int _crawdb_live_swap(crawdb_t *craw, int fd_new, long size_new, uint64_t nnew) {
+    int rv;
+    int fd;
+    char *path_new;
+    char *path;
+    uchar *recs;
+    uint64_t gen;
+    uint64_t offset;
+    uint64_t i;
+
+    /* Sort left counts for the new gen; a missing file leaves reclaim to scan */
+    path_new = _crawdb_live_path(craw, ".live.new");
+    recs = NULL;
+    fd = open(path_new, O_RDWR);
+    rv = CRAWDB_OK;
+    if (fd < 0 || pread(fd, &gen, 8, 0) != 8 || gen != craw->gen + 1) goto _crawdb_live_swap_end;
+
+    /* Add records that came in while we were indexing, then swap counts in ahead of the idx */
+    recs = malloc((nnew * craw->nrec) + 1);
+    goto_if_err(pread(fd_new, recs, nnew * craw->nrec, size_new) != (ssize_t)(nnew * craw->nrec), CRAWDB_ERR_LIVE_WRITE, _crawdb_live_swap_end);
+    for (i = 0; i < nnew; i++) {
+        if (recs[(i * craw->nrec) + craw->nkey + 8 + 4 + 2]) continue; /* deleted */
+        memcpy(&offset, recs + (i * craw->nrec) + craw->nkey, 8);
+        if ((offset >> CRAWDB_SEGMENT_SHIFT) == 0) continue;
+        rv = _crawdb_live_add_fd(fd, offset, 1);
+        goto_if_err(rv != CRAWDB_OK, rv, _crawdb_live_swap_end);
     }
-    if (fd_idx >= 0) close(fd_idx);
-    if (fd_dat >= 0) close(fd_dat);
+    path = _crawdb_live_path(craw, ".live");
+    rv = rename(path_new, path) == 0 ? CRAWDB_OK : CRAWDB_ERR_LIVE_WRITE;
+    free(path);
+
+_crawdb_live_swap_end:
+    if (fd >= 0) close(fd);
+    if (recs) free(recs);
+    free(path_new);
     return rv;
 }
 
 static int _crawdb_set_idx_size(crawdb_t *craw, uint64_t idx_size) {
-    if ((idx_size - CRAWDB_HEADER_SIZE) % craw->nrec != 0) {
+    if (idx_size < craw->nheader || (idx_size - craw->nheader) % craw->nrec != 0) {
         return CRAWDB_ERR_BAD_IDX_SIZE;
     }
     craw->idx_size = idx_size;
-    craw->ntotal = (idx_size - CRAWDB_HEADER_SIZE) / craw->nrec;
+    craw->ntotal = (idx_size - craw->nheader) / craw->nrec;
     if (craw->nsorted > craw->ntotal) {
         return CRAWDB_ERR_BAD_NSORTED;
     }
@@ -738,18 +3676,35 @@ static int _crawdb_set_idx_size(crawdb_t *craw, uint64_t idx_size) {
 }
 
 static int _crawdb_lock(crawdb_t *craw) {
+    uint64_t start;
+
+    /* Already held by batch */
+    if (craw->batch) {
+        return CRAWDB_OK;
+    }
+
+    start = _crawdb_now_ns();
     if (flock(craw->fd_idx, LOCK_EX) != 0) {
         return CRAWDB_ERR_LOCK_EX;
     }
     craw->locked = 1;
+    craw->lock_ns = _crawdb_now_ns();
+    craw->stats.locks += 1;
+    craw->stats.lock_wait_ns += craw->lock_ns - start;
     return CRAWDB_OK;
 }
 
 static int _crawdb_unlock(crawdb_t *craw) {
+    /* Released by crawdb_batch_end */
+    if (craw->batch) {
+        return CRAWDB_OK;
+    }
+
     if (flock(craw->fd_idx, LOCK_UN) != 0) {
         return CRAWDB_ERR_LOCK_UN;
     }
     craw->locked = 0;
+    craw->stats.lock_hold_ns += _crawdb_now_ns() - craw->lock_ns;
     return CRAWDB_OK;
 }
 
@@ -760,39 +3715,438 @@ static int _crawdb_unlock_if_locked(crawdb_t *craw) {
     return CRAWDB_OK;
 }
 
+static int _crawdb_del_log(crawdb_t *craw, uint64_t *key_is, uint64_t n) {
+    char *path_del;
+    size_t path_len;
+    struct stat st;
+    uint64_t ndel;
+    uint64_t log_gen;
+    int fd;
+    int ok;
+
+    /* Version 1 headers have no delete count; caller holds the lock and fd_idx_rw */
+    if (craw->vers < 2 || n == 0) return CRAWDB_OK;
+    return_if_err(pread(craw->fd_idx, &ndel, 8, CRAWDB_OFFSET_NDEL) != 8, CRAWDB_ERR_DELETE_WRITE_FLAG);
+
+    /* Append record indexes to <idx>.del if it holds every earlier delete of this gen */
+    path_len = strlen(craw->idx_path) + 4; /* ".del" (4) */
+    path_del = malloc(path_len + 1);
+    snprintf(path_del, path_len + 1, "%s.del", craw->idx_path);
+    fd = open(path_del, O_RDWR | O_CREAT, 00644);
+    free(path_del);
+    if (fd >= 0) {
+        ok = pread(fd, &log_gen, 8, 0) == 8 && log_gen == craw->gen
+            && fstat(fd, &st) == 0 && (uint64_t)st.st_size >= CRAWDB_DEL_LOG_HEADER + (ndel * 8);
+        if (!ok && ndel == 0) {
+            /* First delete of a gen starts a new log */
+            ok = ftruncate(fd, 0) == 0 && pwrite(fd, &craw->gen, 8, 0) == 8;
+        }
+        if (ok && pwrite(fd, key_is, n * 8, CRAWDB_DEL_LOG_HEADER + (ndel * 8)) != (ssize_t)(n * 8)) {
+            /* A short log makes followers resend the idx instead */
+            ok = ftruncate(fd, 0);
+        }
+        close(fd);
+    }
+
+    /* Count deletes even when unlogged so followers notice */
+    ndel += n;
+    return_if_err(pwrite(craw->fd_idx_rw, &ndel, 8, CRAWDB_OFFSET_NDEL) != 8, CRAWDB_ERR_DELETE_WRITE_FLAG);
+    return CRAWDB_OK;
+}
+
+static uint64_t _crawdb_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
 #ifdef CRAWDB_MAIN
+#include <poll.h>
+
+int serve(char *idx_path, char *dat_path, char *addr, int nworkers); /* crawdb_serve.c */
+
+typedef struct batch_in_s batch_in_t;
+
+/* Line reader over stdin that can tell whether the next line would block */
+struct batch_in_s {
+    char *buf;
+    size_t abuf;
+    size_t pos;
+    size_t len;
+    int eof;
+};
 
 void usage(FILE *fp, int exit_code) {
     fprintf(fp, "Usage:\n");
-    fprintf(fp, "  crawdb -i <idx> -d <dat> -N\n");
-    fprintf(fp, "  crawdb -i <idx> -d <dat> -S -k key -v val\n");
+    fprintf(fp, "  crawdb -i <idx> -d <dat> -N [--prealloc | --segment-size=<n>]\n");
+    fprintf(fp, "  crawdb -i <idx> -d <dat> -S -k key [-v val | < val]\n");
     fprintf(fp, "  crawdb -i <idx> -d <dat> -G -k key\n");
     fprintf(fp, "  crawdb -i <idx> -d <dat> -X -k key\n");
     fprintf(fp, "  crawdb -i <idx> -d <dat> -I\n");
     fprintf(fp, "  crawdb -i <idx> -d <dat> -D\n");
+    fprintf(fp, "  crawdb -i <idx> -d <dat> -F\n");
+    fprintf(fp, "  crawdb -i <idx> -d <dat> -W [--prewarm-all]\n");
+    fprintf(fp, "  crawdb -i <idx> -d <dat> -V [-w threads] [--quarantine]\n");
+    fprintf(fp, "  crawdb -i <idx> -d <dat> -C\n");
+    fprintf(fp, "  crawdb -i <idx> -d <dat> -B < cmds.tsv\n");
+    fprintf(fp, "  crawdb -i <idx> -d <dat> -L <addr> [-w workers]\n");
+    fprintf(fp, "  crawdb -i <idx> -d <dat> -R --leader-idx=<idx> --leader-dat=<dat> [--once]\n");
     fprintf(fp, "\n");
     fprintf(fp, "Options:\n");
     fprintf(fp, "  -h, --help             Show this help\n");
     fprintf(fp, "  -N, --action-init      Init a database (use with -n)\n");
-    fprintf(fp, "  -S, --action-set       Set data (use with -k, -v)\n");
+    fprintf(fp, "  -S, --action-set       Set data (use with -k, -v; without -v stream from stdin)\n");
     fprintf(fp, "  -G, --action-get       Get data (use with -k)\n");
     fprintf(fp, "  -X, --action-delete    Remove data (use with -k)\n");
     fprintf(fp, "  -I, --action-index     Index a database\n");
     fprintf(fp, "  -D, --action-dump      Dump all key-vals in database\n");
+    fprintf(fp, "  -F, --action-freeze    Index and build perfect hash for read-only use\n");
+    fprintf(fp, "  -W, --action-prewarm   Load index search path (all with `--prewarm-all`) into page cache\n");
+    fprintf(fp, "  -V, --action-verify    Check header, key order, duplicates, and every value checksum\n");
+    fprintf(fp, "  -C, --action-reclaim   Unlink data segments with no live records\n");
+    fprintf(fp, "  -B, --batch            Run tab-separated commands from stdin (see below)\n");
+    fprintf(fp, "  -R, --action-follow    Keep replica at `-i`/`-d` up to date with leader\n");
+    fprintf(fp, "  -L, --serve=<addr>     Serve memcached text protocol on `addr` ([host:]port or /unix/path)\n");
+    fprintf(fp, "  -w, --workers=<n>      Use `n` threads with `--serve` or `--action-verify` (default=4)\n");
     fprintf(fp, "  -i, --path-idx=<path>  Use index file at `path`\n");
     fprintf(fp, "  -d, --path-dat=<path>  Use data file at `path`\n");
     fprintf(fp, "  -k, --key=<key>        Set or get `key`\n");
     fprintf(fp, "  -v, --val=<val>        Set `key` to `val`\n");
     fprintf(fp, "  -n, --key-size=<n>     Set key size to `n` (default=32)\n");
+    fprintf(fp, "      --stats            Print runtime stats to stderr\n");
+    fprintf(fp, "      --no-uring         Use pread instead of io_uring for batch gets\n");
+    fprintf(fp, "      --leader-idx=<path> Leader index file for `--action-follow`\n");
+    fprintf(fp, "      --leader-dat=<path> Leader data file for `--action-follow`\n");
+    fprintf(fp, "      --once             Stop following once caught up\n");
+    fprintf(fp, "      --prewarm-all      Read the whole index with `--action-prewarm`\n");
+    fprintf(fp, "      --quarantine       Mark records with bad values deleted with `--action-verify`\n");
+    fprintf(fp, "      --prealloc         Switch to preallocated appends (logical ends kept in the header)\n");
+    fprintf(fp, "      --segment-size=<n> Switch to segmented data files of `n` bytes (0 for default)\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "Batch commands (one per line, `\\t`, `\\n`, `\\\\` escapes in keys and vals):\n");
+    fprintf(fp, "  get<TAB>key            -> OK<TAB>val | NOT_FOUND | ERR<TAB>code\n");
+    fprintf(fp, "  set<TAB>key<TAB>val    -> OK | ERR<TAB>code\n");
+    fprintf(fp, "  del<TAB>key            -> OK | ERR<TAB>code\n");
     exit(exit_code);
 }
 
+size_t batch_unescape(char *str) {
+    char *src;
+    char *dst;
+
+    /* Decode escapes in place */
+    for (src = str, dst = str; *src; src++) {
+        if (*src == '\\' && *(src + 1)) {
+            src++;
+            switch (*src) {
+                case 't': *dst++ = '\t'; break;
+                case 'n': *dst++ = '\n'; break;
+                default:  *dst++ = *src;  break;
+            }
+        } else {
+            *dst++ = *src;
+        }
+    }
+    *dst = '\0';
+
+    return (size_t)(dst - str);
+}
+
+void batch_write_escaped(uchar *val, uint32_t nval) {
+    uint32_t i;
+
+    for (i = 0; i < nval; i++) {
+        switch (val[i]) {
+            case '\t':  fputs("\\t", stdout);  break;
+            case '\n':  fputs("\\n", stdout);  break;
+            case '\\': fputs("\\\\", stdout); break;
+            default:    putchar(val[i]);      break;
+        }
+    }
+}
+
+char *batch_readline(batch_in_t *in, int nonblock, int *out_would_block) {
+    char *nl;
+    char *line;
+    ssize_t n;
+    struct pollfd pfd;
+
+    *out_would_block = 0;
+    for (;;) {
+        /* Return a whole buffered line */
+        nl = memchr(in->buf + in->pos, '\n', in->len - in->pos);
+        if (nl) {
+            *nl = '\0';
+            line = in->buf + in->pos;
+            in->pos = (size_t)(nl - in->buf) + 1;
+            return line;
+        }
+
+        /* Last line may lack a newline */
+        if (in->eof) {
+            if (in->pos >= in->len) return NULL;
+            in->buf[in->len] = '\0';
+            line = in->buf + in->pos;
+            in->pos = in->len;
+            return line;
+        }
+
+        /* Report instead of waiting on an idle client */
+        if (nonblock) {
+            pfd.fd = STDIN_FILENO;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 0) <= 0) {
+                *out_would_block = 1;
+                return NULL;
+            }
+        }
+
+        /* Keep room for a terminator past the partial line */
+        if (in->pos > 0) {
+            memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+            in->len -= in->pos;
+            in->pos = 0;
+        }
+        if (in->len + 1 >= in->abuf) {
+            in->abuf = in->abuf ? in->abuf * 2 : 65536;
+            in->buf = realloc(in->buf, in->abuf);
+        }
+        n = read(STDIN_FILENO, in->buf + in->len, in->abuf - in->len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) in->eof = 1; else in->len += (size_t)n;
+    }
+}
+
+int batch_gets(crawdb_t *craw, crawdb_async_t **inout_async, char **keys, size_t *nkeys, int ngets) {
+    crawdb_async_result_t results[CRAWDB_ASYNC_DEPTH];
+    crawdb_async_t *async;
+    int rv;
+    int rc;
+    uchar **vals;
+    uint32_t *nvals;
+    int *rvs;
+    int nsubmit;
+    uint32_t n;
+    uint32_t i;
+    int j;
+
+    vals = calloc(ngets, sizeof(uchar*));
+    nvals = calloc(ngets, sizeof(uint32_t));
+    rvs = malloc(ngets * sizeof(int));
+    for (j = 0; j < ngets; j++) rvs[j] = CRAWDB_ERR_ASYNC_ENTER;
+
+    /* Keep up to depth lookups in flight; results arrive out of order */
+    async = *inout_async;
+    rv = CRAWDB_OK;
+    nsubmit = 0;
+    for (j = 0; j < (rv == CRAWDB_OK ? ngets : nsubmit); ) {
+        while (rv == CRAWDB_OK && nsubmit < ngets && crawdb_async_submit(async, (uchar*)keys[nsubmit], nkeys[nsubmit], nsubmit) == CRAWDB_OK) {
+            nsubmit += 1;
+        }
+        if ((rc = crawdb_async_complete(async, 1, results, CRAWDB_ASYNC_DEPTH, &n)) != CRAWDB_OK) {
+            /* Unanswered gets keep the error; drain those in flight so none land in a later call */
+            if (rv != CRAWDB_OK) break;
+            rv = rc;
+            continue;
+        }
+        for (i = 0; i < n; i++, j++) {
+            if (results[i].user >= (uint64_t)ngets) continue;
+            rvs[results[i].user] = results[i].rv;
+            if (results[i].val) {
+                vals[results[i].user] = malloc(results[i].nval > 0 ? results[i].nval : 1);
+                memcpy(vals[results[i].user], results[i].val, results[i].nval);
+                nvals[results[i].user] = results[i].nval;
+            }
+        }
+    }
+
+    /* Print in request order */
+    for (j = 0; j < ngets; j++) {
+        if (rvs[j] == CRAWDB_OK && vals[j]) {
+            fputs("OK\t", stdout);
+            batch_write_escaped(vals[j], nvals[j]);
+            putchar('\n');
+        } else if (rvs[j] == CRAWDB_OK) {
+            puts("NOT_FOUND");
+        } else {
+            printf("ERR\t%d\n", rvs[j]);
+        }
+        free(vals[j]);
+        free(keys[j]);
+    }
+
+    free(vals);
+    free(nvals);
+    free(rvs);
+
+    /* Reads the kernel still owns may land in the old handle; abandon it and fall back to pread */
+    if (j < nsubmit) {
+        crawdb_async_new(craw, CRAWDB_ASYNC_DEPTH, CRAWDB_ASYNC_PREAD, inout_async);
+        return rv;
+    }
+    return CRAWDB_OK;
+}
+
+int batch_reload(crawdb_t *craw, int *inout_nbatch) {
+    int rv;
+
+    /* Index swapped underneath us; drop the old lock, reopen, and lock the new idx */
+    if (*inout_nbatch > 0) {
+        crawdb_batch_end(craw);
+        *inout_nbatch = 0;
+    }
+    try(crawdb_reload(craw));
+    try(crawdb_batch_begin(craw));
+    *inout_nbatch = 1;
+    return CRAWDB_OK;
+}
+
+int batch(crawdb_t *craw, int async_flags) {
+    batch_in_t in;
+    char *line;
+    int would_block;
+    char *cmd;
+    char *key;
+    char *val;
+    size_t nkey;
+    size_t nval;
+    int nbatch;
+    int rv;
+    crawdb_async_t *async;
+    char *get_keys[CRAWDB_BATCH_MAX];
+    size_t get_nkeys[CRAWDB_BATCH_MAX];
+    int ngets;
+
+    memset(&in, 0, sizeof(in));
+    nbatch = 0;
+    ngets = 0;
+    crawdb_async_new(craw, CRAWDB_ASYNC_DEPTH, async_flags, &async);
+
+    for (;;) {
+        /* Answer grouped gets, release the lock, and flush replies before waiting on the client */
+        line = batch_readline(&in, 1, &would_block);
+        if (!line && would_block) {
+            if (ngets > 0) {
+                batch_gets(craw, &async, get_keys, get_nkeys, ngets);
+                ngets = 0;
+            }
+            if (nbatch > 0) {
+                crawdb_batch_end(craw);
+                nbatch = 0;
+            }
+            fflush(stdout);
+            line = batch_readline(&in, 0, &would_block);
+        }
+        if (!line) break;
+
+        /* Split line into cmd, key, val */
+        cmd = line;
+        key = strchr(cmd, '\t');
+        val = NULL;
+        if (key) {
+            *key++ = '\0';
+            val = strchr(key, '\t');
+            if (val) *val++ = '\0';
+        }
+        nkey = key ? batch_unescape(key) : 0;
+        nval = val ? batch_unescape(val) : 0;
+
+        /* Look up consecutive gets together */
+        if (ngets > 0 && (strcmp(cmd, "get") != 0 || ngets >= CRAWDB_BATCH_MAX)) {
+            batch_gets(craw, &async, get_keys, get_nkeys, ngets);
+            ngets = 0;
+        }
+
+        /* Hold one lock across consecutive sets and deletes */
+        if (nbatch > 0 && ((strcmp(cmd, "set") != 0 && strcmp(cmd, "del") != 0) || nbatch >= CRAWDB_BATCH_MAX)) {
+            crawdb_batch_end(craw);
+            nbatch = 0;
+        }
+
+        if (strcmp(cmd, "get") == 0 && key) {
+            get_keys[ngets] = malloc(nkey > 0 ? nkey : 1);
+            memcpy(get_keys[ngets], key, nkey);
+            get_nkeys[ngets] = nkey;
+            ngets += 1;
+        } else if (strcmp(cmd, "set") == 0 && key && val) {
+            if (nbatch == 0 && crawdb_batch_begin(craw) == CRAWDB_OK) {
+                nbatch = 1;
+            } else if (nbatch > 0) {
+                nbatch += 1;
+            }
+            rv = crawdb_set(craw, (uchar*)key, nkey, (uchar*)val, nval);
+            if (rv == CRAWDB_ERR_SET_IDX_DEAD && batch_reload(craw, &nbatch) == CRAWDB_OK) {
+                rv = crawdb_set(craw, (uchar*)key, nkey, (uchar*)val, nval);
+            }
+            if (rv == CRAWDB_OK) puts("OK"); else printf("ERR\t%d\n", rv);
+        } else if (strcmp(cmd, "del") == 0 && key) {
+            if (nbatch == 0 && crawdb_batch_begin(craw) == CRAWDB_OK) {
+                nbatch = 1;
+            } else if (nbatch > 0) {
+                nbatch += 1;
+            }
+            rv = crawdb_delete(craw, (uchar*)key, nkey);
+            if (rv == CRAWDB_ERR_SET_IDX_DEAD && batch_reload(craw, &nbatch) == CRAWDB_OK) {
+                rv = crawdb_delete(craw, (uchar*)key, nkey);
+            }
+            if (rv == CRAWDB_OK) puts("OK"); else printf("ERR\t%d\n", rv);
+        } else {
+            printf("ERR\t%d\n", CRAWDB_ERR);
+        }
+    }
+
+    if (ngets > 0) {
+        batch_gets(craw, &async, get_keys, get_nkeys, ngets);
+    }
+    if (nbatch > 0) {
+        crawdb_batch_end(craw);
+    }
+    crawdb_async_free(async);
+    free(in.buf);
+    fflush(stdout);
+
+    return CRAWDB_OK;
+}
+
+int follow(char *idx, char *dat, char *leader_idx, char *leader_dat, int once) {
+    crawdb_t *leader;
+    crawdb_tail_t tail;
+    uchar *buf;
+    uint64_t gen;
+    uint64_t idx_pos;
+    uint64_t dat_pos;
+    uint64_t del_pos;
+    int rv;
+
+    /* Only ever read the leader's files */
+    if ((rv = crawdb_open_snapshot(leader_idx, leader_dat, &leader)) != CRAWDB_OK) {
+        return rv;
+    }
+    buf = malloc(CRAWDB_FOLLOW_BUF);
+
+    /* Ship new bytes from leader to replica until caught up */
+    for (;;) {
+        if ((rv = crawdb_tail_pos(idx, dat, &gen, &idx_pos, &dat_pos, &del_pos)) != CRAWDB_OK) break;
+        if ((rv = crawdb_tail(leader, gen, idx_pos, dat_pos, del_pos, buf, CRAWDB_FOLLOW_BUF, &tail)) != CRAWDB_OK) break;
+        if ((rv = crawdb_tail_apply(idx, dat, &tail, buf)) != CRAWDB_OK) break;
+        if (tail.idx_len == 0 && tail.dat_len == 0 && tail.del_len == 0) {
+            if (once) break;
+            usleep(CRAWDB_FOLLOW_POLL_US);
+        }
+    }
+
+    free(buf);
+    crawdb_free(leader);
+    return rv;
+}
+
 int main(int argc, char **argv) {
     char action;
     char *dat;
     char *idx;
     char *key;
     crawdb_t *craw;
+    crawdb_t *snap;
     int c;
     int help;
     int rv;
@@ -802,6 +4156,27 @@ int main(int argc, char **argv) {
     uint32_t nval;
     uint64_t ntotal;
     uint64_t i;
+    uchar chunk[65536];
+    uint32_t pos;
+    uint32_t nread;
+    ssize_t iorv;
+    int pass;
+    int found;
+    int stats;
+    crawdb_stats_t st;
+    char *addr;
+    int nworkers;
+    int no_uring;
+    char *leader_idx;
+    char *leader_dat;
+    int once;
+    int prewarm_all;
+    int quarantine;
+    int prealloc;
+    int segment;
+    uint64_t seg_size;
+    uint64_t nunlinked;
+    crawdb_scrub_t sc;
 
     action = 0;
     dat = NULL;
@@ -816,6 +4191,23 @@ int main(int argc, char **argv) {
     nval = 0;
     ntotal = 0;
     i = 0;
+    pos = 0;
+    nread = 0;
+    pass = 0;
+    found = 0;
+    stats = 0;
+    addr = NULL;
+    nworkers = 4;
+    no_uring = 0;
+    leader_idx = NULL;
+    leader_dat = NULL;
+    once = 0;
+    prewarm_all = 0;
+    quarantine = 0;
+    prealloc = 0;
+    segment = 0;
+    seg_size = 0;
+    nunlinked = 0;
 
     struct option long_opts[] = {
         { "help",          no_argument,       NULL, 'h' },
@@ -828,11 +4220,28 @@ int main(int argc, char **argv) {
         { "action-get",    no_argument,       NULL, 'G' },
         { "action-delete", no_argument,       NULL, 'X' },
         { "action-index",  no_argument,       NULL, 'I' },
+        { "action-freeze", no_argument,       NULL, 'F' },
+        { "batch",         no_argument,       NULL, 'B' },
+        { "serve",         required_argument, NULL, 'L' },
+        { "workers",       required_argument, NULL, 'w' },
         { "key-size",      required_argument, NULL, 'n' },
+        { "stats",         no_argument,       &stats, 1   },
+        { "no-uring",      no_argument,       &no_uring, 1 },
+        { "action-follow", no_argument,       NULL, 'R' },
+        { "leader-idx",    required_argument, NULL, 'l' },
+        { "leader-dat",    required_argument, NULL, 'e' },
+        { "once",          no_argument,       &once, 1  },
+        { "action-prewarm", no_argument,      NULL, 'W' },
+        { "prewarm-all",   no_argument,       &prewarm_all, 1 },
+        { "action-verify", no_argument,       NULL, 'V' },
+        { "quarantine",    no_argument,       &quarantine, 1 },
+        { "prealloc",      no_argument,       &prealloc, 1 },
+        { "segment-size",  required_argument, NULL, 'z' },
+        { "action-reclaim", no_argument,      NULL, 'C' },
         { 0,               0,                 0,    0   }
     };
 
-    while ((c = getopt_long(argc, argv, "hi:d:k:v:NSGXIDn:", long_opts, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "hi:d:k:v:NSGXIDFBRWVCL:w:n:", long_opts, NULL)) != -1) {
         switch (c) {
             case 'h': help = 1;      break;
             case 'i': idx = optarg;  break;
@@ -844,8 +4253,19 @@ int main(int argc, char **argv) {
             case 'G':
             case 'X':
             case 'I':
-            case 'D': action = c;    break;
+            case 'D':
+            case 'F':
+            case 'B':
+            case 'R':
+            case 'W':
+            case 'V':
+            case 'C': action = c;    break;
+            case 'l': leader_idx = optarg; break;
+            case 'e': leader_dat = optarg; break;
+            case 'L': action = c; addr = optarg; break;
+            case 'w': nworkers = strtol(optarg, NULL, 10); break;
             case 'n': nkey = strtol(optarg, NULL, 10); break;
+            case 'z': segment = 1; seg_size = strtoull(optarg, NULL, 10); break;
         }
     }
 
@@ -858,10 +4278,18 @@ int main(int argc, char **argv) {
         usage(stderr, 0);
     }
 
-    if (strchr("SGXID", action) != NULL) {
+    if (strchr("SGXIDFBWVC", action) != NULL) {
         if ((rv = crawdb_open(idx, dat, &craw)) != CRAWDB_OK) {
             goto main_err;
         }
+        if (prealloc && (rv = crawdb_prealloc(craw)) != CRAWDB_OK) {
+            crawdb_free(craw);
+            goto main_err;
+        }
+        if (segment && (rv = crawdb_segment(craw, seg_size)) != CRAWDB_OK) {
+            crawdb_free(craw);
+            goto main_err;
+        }
     }
 
     switch (action) {
@@ -869,15 +4297,38 @@ int main(int argc, char **argv) {
             /* INIT */
             nkey = (nkey < 1 ? 32 : nkey);
             rv = crawdb_new(idx, dat, nkey, &craw);
+            if (rv == CRAWDB_OK && prealloc) {
+                rv = crawdb_prealloc(craw);
+            }
+            if (rv == CRAWDB_OK && segment) {
+                rv = crawdb_segment(craw, seg_size);
+            }
             break;
 
         case 'S':
             /* SET */
-            if (!key || !val) {
-                fprintf(stderr, "Expected `--key` and `--val` with `--action-set`\n");
+            if (!key) {
+                fprintf(stderr, "Expected `--key` with `--action-set`\n");
                 usage(stderr, 1);
             }
-            rv = crawdb_set(craw, (uchar*)key, strlen(key), (uchar*)val, strlen(val));
+            if (val) {
+                rv = crawdb_set(craw, (uchar*)key, strlen(key), (uchar*)val, strlen(val));
+                break;
+            }
+
+            /* Stream stdin in chunks */
+            rv = crawdb_set_begin(craw, (uchar*)key, strlen(key));
+            iorv = 0;
+            while (rv == CRAWDB_OK) {
+                iorv = read(STDIN_FILENO, chunk, sizeof(chunk));
+                if (iorv <= 0) break;
+                rv = crawdb_set_chunk(craw, chunk, (uint32_t)iorv);
+            }
+            if (rv == CRAWDB_OK && iorv < 0) {
+                crawdb_set_abort(craw);
+                rv = CRAWDB_ERR_SET_WRITE_DAT;
+            }
+            if (rv == CRAWDB_OK) rv = crawdb_set_commit(craw);
             break;
 
         case 'G':
@@ -886,9 +4337,22 @@ int main(int argc, char **argv) {
                 fprintf(stderr, "Expected `--key` with `--action-get`\n");
                 usage(stderr, 1);
             }
-            rv = crawdb_get(craw, (uchar*)key, strlen(key), &oval, &nval, &i);
+            rv = crawdb_get_into(craw, (uchar*)key, strlen(key), chunk, sizeof(chunk), &nval, &found);
             if (rv == CRAWDB_OK) {
-                write(STDOUT_FILENO, oval, nval);
+                if (found) write(STDOUT_FILENO, chunk, nval);
+                break;
+            }
+
+            /* Stream values larger than chunk; a first pass verifies the checksum so nothing bad is printed */
+            if (rv != CRAWDB_ERR_GET_BUF) break;
+            for (pass = 0, rv = CRAWDB_OK; pass < 2 && rv == CRAWDB_OK; pass++) {
+                rv = crawdb_get_begin(craw, (uchar*)key, strlen(key), &nval, &found);
+                for (pos = 0; rv == CRAWDB_OK && found && pos < nval; pos += nread) {
+                    rv = crawdb_get_chunk(craw, pos, chunk, sizeof(chunk), &nread);
+                    if (rv == CRAWDB_OK && pass == 1) {
+                        write(STDOUT_FILENO, chunk, nread);
+                    }
+                }
             }
             break;
 
@@ -906,17 +4370,68 @@ int main(int argc, char **argv) {
             rv = crawdb_index(craw);
             break;
 
+        case 'F':
+            /* FREEZE */
+            rv = crawdb_freeze(craw);
+            break;
+
+        case 'B':
+            /* BATCH */
+            rv = batch(craw, no_uring ? CRAWDB_ASYNC_PREAD : 0);
+            break;
+
+        case 'W':
+            /* PREWARM */
+            rv = crawdb_prewarm(craw, prewarm_all ? CRAWDB_PREWARM_ALL : 0);
+            break;
+
+        case 'V':
+            /* VERIFY */
+            rv = crawdb_scrub(craw, nworkers, quarantine ? CRAWDB_SCRUB_QUARANTINE : 0, &sc);
+            printf("crawdb_scrub_recs %llu\n",        (unsigned long long)sc.nrecs);
+            printf("crawdb_scrub_deleted %llu\n",     (unsigned long long)sc.ndeleted);
+            printf("crawdb_scrub_bad_header %llu\n",  (unsigned long long)sc.bad_header);
+            printf("crawdb_scrub_bad_order %llu\n",   (unsigned long long)sc.bad_order);
+            printf("crawdb_scrub_dups %llu\n",        (unsigned long long)sc.dups);
+            printf("crawdb_scrub_bad_bounds %llu\n",  (unsigned long long)sc.bad_bounds);
+            printf("crawdb_scrub_bad_cksum %llu\n",   (unsigned long long)sc.bad_cksum);
+            printf("crawdb_scrub_quarantined %llu\n", (unsigned long long)sc.quarantined);
+            printf("crawdb_scrub_dat_bytes %llu\n",   (unsigned long long)sc.dat_bytes);
+            printf("crawdb_scrub_mb_per_s %.1f\n",    sc.ns ? (sc.dat_bytes / 1048576.0) / (sc.ns / 1e9) : 0.0);
+            break;
+
+        case 'C':
+            /* RECLAIM */
+            rv = crawdb_reclaim(craw, &nunlinked);
+            printf("crawdb_reclaim_unlinked %llu\n", (unsigned long long)nunlinked);
+            break;
+
+        case 'R':
+            /* FOLLOW */
+            if (!leader_idx || !leader_dat) {
+                fprintf(stderr, "Expected `--leader-idx` and `--leader-dat` with `--action-follow`\n");
+                usage(stderr, 1);
+            }
+            rv = follow(idx, dat, leader_idx, leader_dat, once);
+            break;
+
+        case 'L':
+            /* SERVE */
+            rv = serve(idx, dat, addr, nworkers);
+            break;
+
         case 'D':
-            /* DUMP */
-            if ((rv = crawdb_get_ntotal(craw, &ntotal)) != CRAWDB_OK) {
-                goto main_err;
+            /* DUMP from a snapshot so concurrent writes and indexing do not shift records */
+            if ((rv = crawdb_snapshot(craw, &snap)) != CRAWDB_OK) {
+                break;
             }
-            for (i = 0; i < ntotal; i++) {
-                if ((rv = crawdb_get_i(craw, i, (uchar**)&key, &nkey, &oval, &nval)) != CRAWDB_OK) {
-                    goto main_err;
+            rv = crawdb_get_ntotal(snap, &ntotal);
+            for (i = 0; rv == CRAWDB_OK && i < ntotal; i++) {
+                if ((rv = crawdb_get_i(snap, i, (uchar**)&key, &nkey, &oval, &nval)) == CRAWDB_OK) {
+                    printf("%-*.*s %-.*s\n", nkey, nkey, key, nval, oval);
                 }
-                printf("%-*.*s %-.*s\n", nkey, nkey, key, nval, oval);
             }
+            crawdb_free(snap);
             break;
 
         default:
@@ -925,6 +4440,30 @@ int main(int argc, char **argv) {
             break;
     }
 
+    if (craw && stats) {
+        crawdb_stats(craw, &st);
+        fprintf(stderr, "crawdb_idx_probes %llu\n",     (unsigned long long)st.idx_probes);
+        fprintf(stderr, "crawdb_preads %llu\n",         (unsigned long long)st.preads);
+        fprintf(stderr, "crawdb_pread_bytes %llu\n",    (unsigned long long)st.pread_bytes);
+        fprintf(stderr, "crawdb_mph_hits %llu\n",       (unsigned long long)st.mph_hits);
+        fprintf(stderr, "crawdb_bsearch_hits %llu\n",   (unsigned long long)st.bsearch_hits);
+        fprintf(stderr, "crawdb_lsearch_hits %llu\n",   (unsigned long long)st.lsearch_hits);
+        fprintf(stderr, "crawdb_misses %llu\n",         (unsigned long long)st.misses);
+        fprintf(stderr, "crawdb_cksum_bytes %llu\n",    (unsigned long long)st.cksum_bytes);
+        fprintf(stderr, "crawdb_cksum_failures %llu\n", (unsigned long long)st.cksum_failures);
+        fprintf(stderr, "crawdb_locks %llu\n",          (unsigned long long)st.locks);
+        fprintf(stderr, "crawdb_lock_wait_ns %llu\n",   (unsigned long long)st.lock_wait_ns);
+        fprintf(stderr, "crawdb_lock_hold_ns %llu\n",   (unsigned long long)st.lock_hold_ns);
+        fprintf(stderr, "crawdb_dead_flags %llu\n",     (unsigned long long)st.dead_flags);
+        fprintf(stderr, "crawdb_reloads %llu\n",        (unsigned long long)st.reloads);
+        fprintf(stderr, "crawdb_bsearch_ns %llu\n",     (unsigned long long)st.bsearch_ns);
+        fprintf(stderr, "crawdb_lsearch_ns %llu\n",     (unsigned long long)st.lsearch_ns);
+        fprintf(stderr, "crawdb_get_data_ns %llu\n",    (unsigned long long)st.get_data_ns);
+        fprintf(stderr, "crawdb_index_copy_ns %llu\n",  (unsigned long long)st.index_copy_ns);
+        fprintf(stderr, "crawdb_index_sort_ns %llu\n",  (unsigned long long)st.index_sort_ns);
+        fprintf(stderr, "crawdb_index_swap_ns %llu\n",  (unsigned long long)st.index_swap_ns);
+    }
+
     if (craw) crawdb_free(craw);
 
 main_err:
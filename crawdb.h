@@ -1,13 +1,17 @@
 #define _GNU_SOURCE
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <time.h>
 
@@ -19,9 +23,26 @@
                 <nkey:4>
                 <nsorted:8>
                 <dead:1>
+                <gen:8>          (vers 2+; bumped by each index)
+                <reserved:102>   (vers 2+; header is 18 bytes in vers 1)
       SORTED    <key:nkey> <offset:8> <len:4> <cksum:2> <del:1>
                 ...
     UNSORTED    ...
+
+  MPH FORMAT (<idx>.mph, written by crawdb_freeze)
+
+      HEADER    "CMPH":4
+                <vers:1>
+                <pad:3>
+                <nkey:4>
+                <nlevels:4>
+                <ntotal:8>
+                <idx_ino:8>
+                <nwords:8>
+      LEVELS    <word_offset:8> * (nlevels + 1)
+      BITS      <word:8> * nwords
+      RANKS     <rank:8> * nwords
+      TABLE     <key_i:8> * ntotal
 */
 
 #define CRAWDB_OK                      0
@@ -70,28 +91,171 @@
 #define CRAWDB_ERR_DELETE_NOT_FOUND   -42
 #define CRAWDB_ERR_DELETE_WRITE_FLAG  -43
 #define CRAWDB_ERR_DELETE_RELOAD      -44
+#define CRAWDB_ERR_FREEZE_UNSORTED    -45
+#define CRAWDB_ERR_FREEZE_READ        -46
+#define CRAWDB_ERR_FREEZE_LEVELS      -47
+#define CRAWDB_ERR_FREEZE_OPEN        -48
+#define CRAWDB_ERR_FREEZE_WRITE       -49
+#define CRAWDB_ERR_FREEZE_RENAME      -50
+#define CRAWDB_ERR_SET_STREAM         -51
+#define CRAWDB_ERR_SET_TOO_LARGE      -52
+#define CRAWDB_ERR_GET_STREAM         -53
+#define CRAWDB_ERR_BATCH_ACTIVE       -54
+#define CRAWDB_ERR_ASYNC_FULL         -55
+#define CRAWDB_ERR_ASYNC_ENTER        -56
+#define CRAWDB_ERR_TAIL_POS           -57
+#define CRAWDB_ERR_TAIL_READ          -58
+#define CRAWDB_ERR_APPLY_OPEN         -59
+#define CRAWDB_ERR_APPLY_WRITE        -60
+#define CRAWDB_ERR_APPLY_RENAME       -61
+#define CRAWDB_ERR_TAIL_BUF           -62
+#define CRAWDB_ERR_PREWARM_MLOCK      -63
+#define CRAWDB_ERR_DELETE_OPEN        -64
+#define CRAWDB_ERR_GET_BUF            -65
+#define CRAWDB_ERR_SCRUB_BAD          -66
+#define CRAWDB_ERR_SCRUB_READ         -67
+#define CRAWDB_ERR_SCRUB_THREAD       -68
+#define CRAWDB_ERR_SNAPSHOT_WRITE     -69
+#define CRAWDB_ERR_GET_NOT_FOUND      -70
+#define CRAWDB_ERR_PREALLOC           -71
+#define CRAWDB_ERR_PREALLOC_VERS      -72
+#define CRAWDB_ERR_OPEN_BAD_FLAGS     -73
+#define CRAWDB_ERR_SEGMENT_OPEN       -74
+#define CRAWDB_ERR_SEGMENT_MODE       -75
+#define CRAWDB_ERR_SEGMENT_IDS        -76
+#define CRAWDB_ERR_RECLAIM_READ       -77
+#define CRAWDB_ERR_RECLAIM_PINNED     -78
+#define CRAWDB_ERR_SET_TRUNCATE       -79
+#define CRAWDB_ERR_LOCK_SH            -80
+#define CRAWDB_ERR_SET_STAGE          -81
+#define CRAWDB_ERR_LIVE_WRITE         -82
 
-#define CRAWDB_HEADER_SIZE             18
-#define CRAWDB_HEADER_VERS             1
+#define CRAWDB_HEADER_SIZE             128
+#define CRAWDB_HEADER_SIZE_V1          18
+#define CRAWDB_HEADER_VERS             2
 #define CRAWDB_OFFSET_NSORTED          9
 #define CRAWDB_OFFSET_DEAD             17
+#define CRAWDB_OFFSET_GEN              18
+#define CRAWDB_OFFSET_FLAGS            26
+#define CRAWDB_OFFSET_IDX_END          32
+#define CRAWDB_OFFSET_DAT_END          40
+#define CRAWDB_OFFSET_SEG_SIZE         48
+#define CRAWDB_OFFSET_SEG_NEXT         56
+#define CRAWDB_OFFSET_NDEL             64
+#define CRAWDB_DEL_LOG_HEADER          8
+#define CRAWDB_LIVE_HEADER             8
+#define CRAWDB_FLAG_PREALLOC           1
+#define CRAWDB_FLAG_SEGMENTED          2
+#define CRAWDB_FLAGS_KNOWN             (CRAWDB_FLAG_PREALLOC | CRAWDB_FLAG_SEGMENTED)
+#define CRAWDB_PREALLOC_IDX_CHUNK      (1 << 20)
+#define CRAWDB_PREALLOC_DAT_CHUNK      (16 << 20)
+#define CRAWDB_SEGMENT_SHIFT           48
+#define CRAWDB_SEGMENT_MASK            ((1ULL << 48) - 1)
+#define CRAWDB_SEGMENT_MAX             65535
+#define CRAWDB_SEGMENT_SIZE            (256 << 20)
+#define CRAWDB_SEGMENT_ACTIVE          8
+#define CRAWDB_BATCH_MAX               1024
+#define CRAWDB_CKSUM_INIT              0xffff
+#define CRAWDB_MPH_HEADER_SIZE         48
+#define CRAWDB_MPH_VERS                2
+#define CRAWDB_MPH_GAMMA               2
+#define CRAWDB_MPH_MAX_LEVELS          32
+#define CRAWDB_ASYNC_DEPTH             256
+#define CRAWDB_PREWARM_ALL             1
+#define CRAWDB_PREWARM_MLOCK           2
+#define CRAWDB_PREWARM_LEVELS          16
+#define CRAWDB_PREWARM_CHUNK           (1 << 20)
+#define CRAWDB_SCRUB_QUARANTINE        1
+#define CRAWDB_SCRUB_CHUNK             (4 << 20)
+#define CRAWDB_SCRUB_MAX_THREADS       64
+#define CRAWDB_FOLLOW_BUF              (1 << 20)
+#define CRAWDB_FOLLOW_POLL_US          100000
+#define CRAWDB_ASYNC_PREAD             1
+#define CRAWDB_OPEN_APPEND             0
+#define CRAWDB_OPEN_INDEX              1
+#define CRAWDB_OPEN_SNAPSHOT           2
+#define CRAWDB_KERNEL_GENERIC          0
+#define CRAWDB_KERNEL_8                1
+#define CRAWDB_KERNEL_16               2
+#define CRAWDB_KERNEL_32               4
+#define CRAWDB_KERNEL_64               8
+#define CRAWDB_SORT_INSERTION          16
+#define CRAWDB_SORT_CHUNK              (1 << 20)
 #define CRAWDB_API                     __attribute__ ((visibility ("default")))
+#define CRAWDB_INLINE                  static inline __attribute__ ((always_inline))
 
 #define try(__call)                         do { if ((rv = (__call)) != CRAWDB_OK) return rv; } while(0)
 #define goto_if_err(__cond, __errv, __labl) do { if (__cond) { rv = (__errv); goto __labl; }  } while(0);
 #define return_if_err(__cond, __errv)       do { if (__cond) return (__errv);                 } while(0);
 
+#ifdef CRAWDB_TIMERS
+#define timer_start(__t)                    uint64_t __t = _crawdb_now_ns()
+#define timer_add(__t, __field)             do { craw->stats.__field += _crawdb_now_ns() - (__t); } while(0)
+#else
+#define timer_start(__t)
+#define timer_add(__t, __field)
+#endif
+
 typedef struct crawdb_s crawdb_t;
+typedef struct crawdb_mph_s crawdb_mph_t;
+typedef struct crawdb_stats_s crawdb_stats_t;
+typedef struct crawdb_async_s crawdb_async_t;
+typedef struct crawdb_async_result_s crawdb_async_result_t;
+typedef struct crawdb_tail_s crawdb_tail_t;
+typedef struct crawdb_scrub_s crawdb_scrub_t;
+typedef struct crawdb_scrub_job_s crawdb_scrub_job_t;
 typedef unsigned char uchar;
 
+struct crawdb_mph_s {
+    uchar *map;
+    size_t nmap;
+    uint32_t nlevels;
+    uint64_t ntotal;
+    uint64_t nkeys;
+    uint64_t *levels;
+    uint64_t *words;
+    uint64_t *ranks;
+    uint64_t *table;
+};
+
+struct crawdb_stats_s {
+    uint64_t idx_probes;
+    uint64_t preads;
+    uint64_t pread_bytes;
+    uint64_t mph_hits;
+    uint64_t bsearch_hits;
+    uint64_t lsearch_hits;
+    uint64_t misses;
+    uint64_t cksum_bytes;
+    uint64_t cksum_failures;
+    uint64_t locks;
+    uint64_t lock_wait_ns;
+    uint64_t lock_hold_ns;
+    uint64_t dead_flags;
+    uint64_t reloads;
+    uint64_t bsearch_ns;     /* CRAWDB_TIMERS only */
+    uint64_t lsearch_ns;     /* CRAWDB_TIMERS only */
+    uint64_t get_data_ns;    /* CRAWDB_TIMERS only */
+    uint64_t index_copy_ns;  /* CRAWDB_TIMERS only */
+    uint64_t index_sort_ns;  /* CRAWDB_TIMERS only */
+    uint64_t index_swap_ns;  /* CRAWDB_TIMERS only */
+};
+
 struct crawdb_s {
     char *idx_path;
     char *dat_path;
     int fd_idx;
     int fd_dat;
+    int fd_idx_rw;
+    int fd_dat_rw;
     long idx_size;
     int locked;
+    int batch;
+    int snapshot;
     uint8_t vers;
+    uint8_t flags;
+    size_t nheader;
+    uint64_t gen;
     uint32_t nkey;
     uint64_t nsorted;
     uint64_t nunsorted;
@@ -99,21 +263,124 @@ struct crawdb_s {
     uint8_t dead;
     uchar *rec;
     size_t nrec;
+    int kernel;
     uchar *data;
     size_t ndata;
+    crawdb_mph_t *mph;
+    uchar *warm_map;
+    size_t nwarm_map;
+    uchar *set_key;
+    uint64_t set_offset;
+    uint64_t set_len;
+    uint16_t set_crc;
+    int set_active;
+    int set_staged;
+    int fd_stage;
+    uint64_t idx_alloc;
+    uint64_t dat_alloc;
+    int fd_seg;
+    int fd_live;
+    uint32_t seg;
+    uint64_t seg_size;
+    int *seg_fds;
+    uint32_t nseg_fds;
+    uint64_t get_offset;
+    uint32_t get_len;
+    uint32_t get_pos;
+    uint16_t get_cksum;
+    uint16_t get_crc;
+    int get_verify;
+    int get_active;
+    uint64_t lock_ns;
+    crawdb_stats_t stats;
+};
+
+struct crawdb_tail_s {
+    uint64_t gen;
+    uint64_t idx_pos;
+    uint64_t idx_len;
+    uint64_t idx_end;
+    uint64_t dat_pos;
+    uint64_t dat_len;
+    uint64_t del_pos;
+    uint64_t del_len;
+};
+
+struct crawdb_scrub_s {
+    uint64_t nrecs;
+    uint64_t ndeleted;
+    uint64_t bad_header;
+    uint64_t bad_order;
+    uint64_t dups;
+    uint64_t bad_bounds;
+    uint64_t bad_cksum;
+    uint64_t quarantined;
+    uint64_t dat_bytes;
+    uint64_t ns;
+};
+
+struct crawdb_scrub_job_s {
+    crawdb_t *craw;
+    uchar *buf;
+    uint64_t *order;
+    uint64_t start;
+    uint64_t end;
+    uint64_t *seg_sizes;
+    uchar *bad;
+    uint64_t bad_bounds;
+    uint64_t bad_cksum;
+    uint64_t dat_bytes;
+};
+
+struct crawdb_async_result_s {
+    uint64_t user;
+    int rv;
+    int found;
+    uchar *val;
+    uint32_t nval;
+    uint64_t key_i;
 };
 
 CRAWDB_API int crawdb_new(char *idx_path, char *dat_path, uint32_t nkey, crawdb_t **out_craw);
 CRAWDB_API int crawdb_open(char *idx_path, char *dat_path, crawdb_t **out_craw);
 CRAWDB_API int crawdb_reload(crawdb_t *craw);
+CRAWDB_API int crawdb_refresh(crawdb_t *craw);
+CRAWDB_API int crawdb_prealloc(crawdb_t *craw);
+CRAWDB_API int crawdb_segment(crawdb_t *craw, uint64_t seg_size);
+CRAWDB_API int crawdb_reclaim(crawdb_t *craw, uint64_t *out_nunlinked);
+CRAWDB_API int crawdb_snapshot(crawdb_t *craw, crawdb_t **out_snap);
+CRAWDB_API int crawdb_open_snapshot(char *idx_path, char *dat_path, crawdb_t **out_snap);
 CRAWDB_API int crawdb_set(crawdb_t *craw, uchar *key, uint32_t nkey, uchar *val, uint32_t nval);
+CRAWDB_API int crawdb_set_begin(crawdb_t *craw, uchar *key, uint32_t nkey);
+CRAWDB_API int crawdb_set_chunk(crawdb_t *craw, uchar *val, uint32_t nval);
+CRAWDB_API int crawdb_set_commit(crawdb_t *craw);
+CRAWDB_API int crawdb_set_abort(crawdb_t *craw);
 CRAWDB_API int crawdb_get(crawdb_t *craw, uchar *key, uint32_t nkey, uchar **out_val, uint32_t *out_nval, uint64_t *out_idx);
+CRAWDB_API int crawdb_batch_begin(crawdb_t *craw);
+CRAWDB_API int crawdb_batch_end(crawdb_t *craw);
 CRAWDB_API int crawdb_delete(crawdb_t *craw, uchar *key, uint32_t nkey);
+CRAWDB_API int crawdb_delete_many(crawdb_t *craw, uchar **keys, uint32_t *nkeys, uint64_t n, int *out_rvs, uint64_t *out_ndeleted);
+CRAWDB_API int crawdb_get_into(crawdb_t *craw, uchar *key, uint32_t nkey, uchar *buf, uint32_t nbuf, uint32_t *out_nval, int *out_found);
+CRAWDB_API int crawdb_get_multi(crawdb_t *craw, uchar **keys, uint32_t *nkeys, uint64_t n, uchar *buf, uint64_t nbuf, uint64_t *out_offsets, uint32_t *out_nvals, int *out_rvs);
 CRAWDB_API int crawdb_get_i(crawdb_t *craw, uint64_t i, uchar **out_key, uint32_t *out_nkey, uchar **out_val, uint32_t *out_nval);
+CRAWDB_API int crawdb_get_begin(crawdb_t *craw, uchar *key, uint32_t nkey, uint32_t *out_nval, int *out_found);
+CRAWDB_API int crawdb_get_chunk(crawdb_t *craw, uint32_t pos, uchar *buf, uint32_t nbuf, uint32_t *out_nread);
+CRAWDB_API int crawdb_async_new(crawdb_t *craw, uint32_t depth, int flags, crawdb_async_t **out_async);
+CRAWDB_API int crawdb_async_submit(crawdb_async_t *async, uchar *key, uint32_t nkey, uint64_t user);
+CRAWDB_API int crawdb_async_complete(crawdb_async_t *async, uint32_t min_complete, crawdb_async_result_t *out_results, uint32_t nresults, uint32_t *out_n);
+CRAWDB_API int crawdb_async_free(crawdb_async_t *async);
+CRAWDB_API int crawdb_tail(crawdb_t *craw, uint64_t gen, uint64_t idx_pos, uint64_t dat_pos, uint64_t del_pos, uchar *buf, uint64_t nbuf, crawdb_tail_t *out_tail);
+CRAWDB_API int crawdb_tail_pos(char *idx_path, char *dat_path, uint64_t *out_gen, uint64_t *out_idx_pos, uint64_t *out_dat_pos, uint64_t *out_del_pos);
+CRAWDB_API int crawdb_tail_apply(char *idx_path, char *dat_path, crawdb_tail_t *tail, uchar *buf);
 CRAWDB_API int crawdb_cksum(uchar *val, uint32_t len, uint16_t *out_cksum);
 CRAWDB_API int crawdb_index(crawdb_t *craw);
+CRAWDB_API int crawdb_freeze(crawdb_t *craw);
+CRAWDB_API int crawdb_prewarm(crawdb_t *craw, int flags);
+CRAWDB_API int crawdb_scrub(crawdb_t *craw, uint32_t nthreads, int flags, crawdb_scrub_t *out_scrub);
 CRAWDB_API int crawdb_get_nkey(crawdb_t *craw, uint32_t *out_nkey);
 CRAWDB_API int crawdb_get_ntotal(crawdb_t *craw, uint64_t *out_ntotal);
 CRAWDB_API int crawdb_get_nsorted(crawdb_t *craw, uint64_t *out_nsorted);
 CRAWDB_API int crawdb_get_nunsorted(crawdb_t *craw, uint64_t *out_nunsorted);
+CRAWDB_API int crawdb_stats(crawdb_t *craw, crawdb_stats_t *out_stats);
+CRAWDB_API int crawdb_stats_reset(crawdb_t *craw);
 CRAWDB_API int crawdb_free(crawdb_t *craw);
@@ -3,6 +3,11 @@ declare(strict_types=1);
 
 define('CRAWDB_PHP_ERROR_FFI', -1000);
 define('CRAWDB_PHP_ERROR_HEADER', -1001);
+define('CRAWDB_PHP_MULTI_BUF', 65536);
+
+/* Mirrors of crawdb.h codes used by the binding */
+define('_CRAWDB_ERR_GET_BUF', -65);
+define('_CRAWDB_ERR_GET_NOT_FOUND', -70);
 
 function crawdb_new(string $idx_path, string $dat_path, int $nkey, int &$errno = 0, ?string $crawdb_h = null, ?string $libcrawdb_so = null): ?object {
     return _crawdb_new_open($idx_path, $dat_path, $nkey, $is_new = true, $errno, $crawdb_h, $libcrawdb_so);
@@ -12,6 +17,39 @@ function crawdb_open(string $idx_path, string $dat_path, int &$errno = 0, ?strin
     return _crawdb_new_open($idx_path, $dat_path, 0, $is_new = false, $errno, $crawdb_h, $libcrawdb_so);
 }
 
+/*
+  Returns a handle from a per-process pool keyed by path, opening it on first
+  use. Pooled handles are refreshed on each call, which costs one pread and
+  one lseek unless the index was swapped. Do not share a handle across threads.
+*/
+function crawdb_pool_open(string $idx_path, string $dat_path, int &$errno = 0, ?string $crawdb_h = null, ?string $libcrawdb_so = null): ?object {
+    $pool = &_crawdb_pool();
+    $pool_key = "{$idx_path}\0{$dat_path}";
+
+    if (isset($pool[$pool_key])) {
+        $crawh = $pool[$pool_key];
+        if (crawdb_refresh($crawh) === 0) {
+            return $crawh;
+        }
+        crawdb_free($crawh);
+    }
+
+    $crawh = crawdb_open($idx_path, $dat_path, $errno, $crawdb_h, $libcrawdb_so);
+    if (!$crawh) {
+        return null;
+    }
+    $crawh->pool_key = $pool_key;
+    $pool[$pool_key] = $crawh;
+
+    return $crawh;
+}
+
+function crawdb_pool_close_all(): void {
+    foreach (_crawdb_pool() as $crawh) {
+        crawdb_free($crawh);
+    }
+}
+
 function crawdb_set(object $crawh, string $key, string $data): int {
     $nkey = _crawdb_set_key($crawh, $key);
 
@@ -52,12 +90,82 @@ function crawdb_get(object $crawh, string $key): ?string {
         return null;
     }
 
-    $get_data = '';
-    for ($i = 0; $i < $crawh->get_nval->cdata; ++$i) {
-        $get_data .= chr($crawh->get_val[$i]);
+    return FFI::string($crawh->get_val, $crawh->get_nval->cdata);
+}
+
+/* Returns values keyed by key, null for keys not found */
+function crawdb_get_multi(object $crawh, array $keys): array {
+    $keys = array_values($keys);
+    $n = count($keys);
+    if ($n === 0) {
+        return [];
+    }
+
+    $ffi = $crawh->ffi;
+    $nkey = $crawh->nkey->cdata;
+    $key_buf = $ffi->new('uchar[' . ($n * $nkey) . ']');
+    $key_ptrs = $ffi->new("uchar*[{$n}]");
+    $key_lens = $ffi->new("uint32_t[{$n}]");
+    $offsets = $ffi->new("uint64_t[{$n}]");
+    $nvals = $ffi->new("uint32_t[{$n}]");
+    $rvs = $ffi->new("int[{$n}]");
+
+    $key_base = $ffi->cast('uchar*', $key_buf);
+    foreach ($keys as $i => $key) {
+        $len = min(strlen($key), $nkey);
+        $key_ptr = $key_base + ($i * $nkey);
+        FFI::memcpy($key_ptr, $key, $len);
+        $key_ptrs[$i] = $key_ptr;
+        $key_lens[$i] = $len;
+    }
+
+    do {
+        $crawh->last_error = $ffi->crawdb_get_multi(
+            $crawh->craw,
+            $key_ptrs,
+            $key_lens,
+            $n,
+            $crawh->multi_buf,
+            $crawh->multi_nbuf,
+            $offsets,
+            $nvals,
+            $rvs
+        );
+        if ($crawh->last_error !== 0) {
+            return [];
+        }
+
+        /* Grow buf to fit every value and retry if any did not fit */
+        $need = 0;
+        $retry = false;
+        for ($i = 0; $i < $n; ++$i) {
+            if ($rvs[$i] === 0 || $rvs[$i] === _CRAWDB_ERR_GET_BUF) {
+                $need += $nvals[$i];
+            }
+            $retry = $retry || $rvs[$i] === _CRAWDB_ERR_GET_BUF;
+        }
+        if ($retry) {
+            $crawh->multi_buf = $ffi->new("uchar[{$need}]");
+            $crawh->multi_nbuf = $need;
+        }
+    } while ($retry);
+
+    $vals = [];
+    $val_base = $ffi->cast('uchar*', $crawh->multi_buf);
+    foreach ($keys as $i => $key) {
+        if ($rvs[$i] !== 0) {
+            if ($rvs[$i] !== _CRAWDB_ERR_GET_NOT_FOUND) {
+                $crawh->last_error = $rvs[$i];
+            }
+            $vals[$key] = null;
+        } else if ($nvals[$i] === 0) {
+            $vals[$key] = '';
+        } else {
+            $vals[$key] = FFI::string($val_base + $offsets[$i], $nvals[$i]);
+        }
     }
 
-    return $get_data;
+    return $vals;
 }
 
 function crawdb_get_i(object $crawh, int $i, string &$key_data): ?string {
@@ -78,17 +186,9 @@ function crawdb_get_i(object $crawh, int $i, string &$key_data): ?string {
         return null;
     }
 
-    $key_data = '';
-    for ($i = 0; $i < $crawh->key_nval->cdata; ++$i) {
-        $key_data .= chr($crawh->key_val[$i]);
-    }
-
-    $get_data = '';
-    for ($i = 0; $i < $crawh->get_nval->cdata; ++$i) {
-        $get_data .= chr($crawh->get_val[$i]);
-    }
+    $key_data = FFI::string($crawh->key_val, $crawh->key_nval->cdata);
 
-    return $get_data;
+    return FFI::string($crawh->get_val, $crawh->get_nval->cdata);
 }
 
 function crawdb_delete(object $crawh, string $key): int {
@@ -121,6 +221,11 @@ function crawdb_get_nkey(object $crawh): int {
     return (int)$nkey->cdata;
 }
 
+function crawdb_refresh(object $crawh): int {
+    $crawh->last_error = $crawh->ffi->crawdb_refresh($crawh->craw);
+    return $crawh->last_error;
+}
+
 function crawdb_reload(object $crawh): int {
     $crawh->last_error = $crawh->ffi->crawdb_reload($crawh->craw);
     return $crawh->last_error;
@@ -132,6 +237,11 @@ function crawdb_index(object $crawh): int {
 }
 
 function crawdb_free(object $crawh): int {
+    if ($crawh->pool_key !== null) {
+        $pool = &_crawdb_pool();
+        unset($pool[$crawh->pool_key]);
+        $crawh->pool_key = null;
+    }
     $crawh->last_error = $crawh->ffi->crawdb_free($crawh->craw);
     return $crawh->last_error;
 }
@@ -177,14 +287,20 @@ function _crawdb_new_open(string $idx_path, string $dat_path, int $nkey, bool $i
         return null;
     }
 
-    try {
-        $header_file = file_get_contents($crawdb_h);
-        $header_file = preg_replace('/^CRAWDB_API\s+/m', '', $header_file);
-        $ffi = FFI::cdef($header_file, $libcrawdb_so);
-    } catch (FFI\Exception $e) {
-        $errno = CRAWDB_PHP_ERROR_FFI;
-        return null;
+    /* Parse the header once per process */
+    static $ffis = [];
+    $ffi_key = "{$crawdb_h}\0{$libcrawdb_so}";
+    if (!isset($ffis[$ffi_key])) {
+        try {
+            $header_file = file_get_contents($crawdb_h);
+            $header_file = preg_replace('/^CRAWDB_API\s+/m', '', $header_file);
+            $ffis[$ffi_key] = FFI::cdef($header_file, $libcrawdb_so);
+        } catch (FFI\Exception $e) {
+            $errno = CRAWDB_PHP_ERROR_FFI;
+            return null;
+        }
     }
+    $ffi = $ffis[$ffi_key];
 
     $crawh = (object)[];
 
@@ -199,6 +315,9 @@ function _crawdb_new_open(string $idx_path, string $dat_path, int $nkey, bool $i
     $crawh->get_key_i = $ffi->new('uint64_t');
     $crawh->key_val = $ffi->new('uchar*');
     $crawh->key_nval = $ffi->new('uint32_t');
+    $crawh->multi_buf = $ffi->new('uchar[' . CRAWDB_PHP_MULTI_BUF . ']');
+    $crawh->multi_nbuf = CRAWDB_PHP_MULTI_BUF;
+    $crawh->pool_key = null;
     $crawh->ffi = $ffi;
     $crawh->last_error = 0;
 
@@ -228,6 +347,11 @@ function _crawdb_new_open(string $idx_path, string $dat_path, int $nkey, bool $i
     return $crawh;
 }
 
+function &_crawdb_pool(): array {
+    static $pool = [];
+    return $pool;
+}
+
 function _crawdb_set_key(object $crawh, string $key): int {
     $nkey = min(strlen($key), $crawh->nkey->cdata);
     FFI::memset($crawh->key, 0, $crawh->nkey->cdata);
@@ -271,6 +395,35 @@ function _crawdb_test() {
         $val = crawdb_get($crawh, 'hello');
         if ($val !== null) break;
 
+        $rv = crawdb_set($crawh, 'big', str_repeat('x', 70000));
+        if ($rv !== 0) break;
+
+        $vals = crawdb_get_multi($crawh, ['big', 'hello', 'nope', 'hello2']);
+        if ($vals !== ['big' => str_repeat('x', 70000), 'hello' => null, 'nope' => null, 'hello2' => null]) break;
+
+        $pooled = crawdb_pool_open('/tmp/idx', '/tmp/dat');
+        if (!$pooled) break;
+        if (crawdb_pool_open('/tmp/idx', '/tmp/dat') !== $pooled) break;
+
+        $rv = crawdb_set($crawh, 'late', 'seen');
+        if ($rv !== 0) break;
+
+        $rv = crawdb_index($crawh);
+        if ($rv !== 0) break;
+
+        $pooled = crawdb_pool_open('/tmp/idx', '/tmp/dat');
+        if (!$pooled) break;
+        if (crawdb_get($pooled, 'late') !== 'seen') break;
+
+        $rv = crawdb_set($crawh, 'later', 'also');
+        if ($rv !== 0) break;
+
+        $pooled = crawdb_pool_open('/tmp/idx', '/tmp/dat');
+        if (!$pooled) break;
+        if (crawdb_get($pooled, 'later') !== 'also') break;
+
+        crawdb_pool_close_all();
+
         $result = 'PASS';
     } while (0);
     if ($crawh) {
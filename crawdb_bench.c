@@ -0,0 +1,559 @@
+#include "crawdb.h"
+#include <errno.h>
+#include <math.h>
+#include <sys/wait.h>
+
+#define BENCH_WORKLOADS "get-uniform,get-zipf,get-miss,get-async,mixed,index-concurrent"
+#define BENCH_INDEX_EVERY 10000
+#define BENCH_NCOUNTS 4
+
+typedef struct bench_s bench_t;
+typedef struct bench_zipf_s bench_zipf_t;
+
+struct bench_s {
+    char *dir;
+    char idx_path[4096];
+    char dat_path[4096];
+    uint64_t nrecs;
+    uint32_t nkey;
+    uint32_t nval;
+    uint64_t nops;
+    int nprocs;
+    double theta;
+    int set_pct;
+    int prealloc;
+    int segment;
+    uint64_t seg_size;
+    uint64_t *lat;      /* shared: nprocs * nops latencies in ns */
+    uint64_t *counts;   /* shared: per-proc [done, errors, retries, finished] */
+};
+
+struct bench_zipf_s {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+static uint64_t bench_now_ns(void);
+static uint64_t bench_rand(uint64_t *state);
+static void bench_key(bench_t *b, uint64_t id, uchar *key);
+static uint64_t bench_gcd(uint64_t a, uint64_t b);
+static void bench_zipf_init(bench_zipf_t *z, uint64_t n, double theta);
+static uint64_t bench_zipf_next(bench_zipf_t *z, uint64_t *state);
+static int bench_load(bench_t *b);
+static int bench_run(bench_t *b, char *workload);
+static int bench_child(bench_t *b, char *workload, int proc);
+static int bench_child_async(bench_t *b, crawdb_t *craw, uchar *key, uint64_t *lat, uint64_t *counts, uint64_t *state);
+static void bench_report(bench_t *b, char *label, int proc_from, int proc_to, uint64_t elapsed_ns);
+static int bench_writers_done(bench_t *b);
+static int bench_cmp_u64(const void *a, const void *b);
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t bench_rand(uint64_t *state) {
+    uint64_t z;
+
+    /* splitmix64 */
+    z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void bench_key(bench_t *b, uint64_t id, uchar *key) {
+    char tmp[32];
+    int n;
+
+    /* Zero-padded decimal id; main checks nkey fits the largest id */
+    n = snprintf(tmp, sizeof(tmp), "%020llu", (unsigned long long)id);
+    memset(key, '0', b->nkey);
+    if ((uint32_t)n <= b->nkey) {
+        memcpy(key + (b->nkey - n), tmp, n);
+    } else {
+        memcpy(key, tmp + (n - b->nkey), b->nkey);
+    }
+}
+
+static uint64_t bench_gcd(uint64_t a, uint64_t b) {
+    uint64_t t;
+    while (b) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static void bench_zipf_init(bench_zipf_t *z, uint64_t n, double theta) {
+    uint64_t i;
+    double zeta2;
+
+    /* Gray et al., "Quickly generating billion-record synthetic databases" */
+    z->n = n;
+    z->theta = theta;
+    z->zetan = 0;
+    for (i = 1; i <= n; i++) {
+        z->zetan += 1.0 / pow((double)i, theta);
+    }
+    zeta2 = 1.0 + (1.0 / pow(2.0, theta));
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - (zeta2 / z->zetan));
+}
+
+static uint64_t bench_zipf_next(bench_zipf_t *z, uint64_t *state) {
+    double u;
+    double uz;
+
+    u = (double)(bench_rand(state) >> 11) / (double)(1ULL << 53);
+    uz = u * z->zetan;
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + pow(0.5, z->theta)) return 1;
+    return (uint64_t)((double)z->n * pow((z->eta * u) - z->eta + 1.0, z->alpha)) % z->n;
+}
+
+static int bench_load(bench_t *b) {
+    int rv;
+    crawdb_t *craw;
+    uchar *key;
+    uchar *val;
+    uint64_t i;
+    uint64_t id;
+    uint64_t stride;
+    uint64_t start;
+
+    key = malloc(b->nkey);
+    val = malloc(b->nval);
+    memset(val, 'v', b->nval);
+
+    if ((rv = crawdb_new(b->idx_path, b->dat_path, b->nkey, &craw)) != CRAWDB_OK) {
+        fprintf(stderr, "crawdb_new: %d\n", rv);
+        return rv;
+    }
+    if (b->prealloc && (rv = crawdb_prealloc(craw)) != CRAWDB_OK) {
+        fprintf(stderr, "crawdb_prealloc: %d\n", rv);
+        goto bench_load_end;
+    }
+    if (b->segment && (rv = crawdb_segment(craw, b->seg_size)) != CRAWDB_OK) {
+        fprintf(stderr, "crawdb_segment: %d\n", rv);
+        goto bench_load_end;
+    }
+
+    /* Insert in a scrambled order, indexing periodically to keep dupe checks cheap */
+    for (stride = 2654435761ULL % b->nrecs; bench_gcd(stride, b->nrecs) != 1; stride++);
+    start = bench_now_ns();
+    for (i = 0; i < b->nrecs; i++) {
+        id = (i * stride) % b->nrecs;
+        bench_key(b, id, key);
+        if ((rv = crawdb_set(craw, key, b->nkey, val, b->nval)) != CRAWDB_OK) {
+            fprintf(stderr, "crawdb_set: %d\n", rv);
+            goto bench_load_end;
+        }
+        if ((i + 1) % BENCH_INDEX_EVERY == 0) {
+            if ((rv = crawdb_index(craw)) != CRAWDB_OK) {
+                fprintf(stderr, "crawdb_index: %d\n", rv);
+                goto bench_load_end;
+            }
+        }
+    }
+    if ((rv = crawdb_index(craw)) != CRAWDB_OK) {
+        fprintf(stderr, "crawdb_index: %d\n", rv);
+        goto bench_load_end;
+    }
+
+    printf("load: nrecs=%llu nkey=%u nval=%u %.0f sets/s\n",
+        (unsigned long long)b->nrecs, b->nkey, b->nval,
+        (double)b->nrecs / ((double)(bench_now_ns() - start) / 1e9));
+
+bench_load_end:
+    crawdb_free(craw);
+    free(key);
+    free(val);
+    return rv;
+}
+
+static int bench_run(bench_t *b, char *workload) {
+    int rv;
+    int proc;
+    int status;
+    pid_t pid;
+    uint64_t start;
+
+    memset(b->lat, 0, sizeof(uint64_t) * b->nops * b->nprocs);
+    memset(b->counts, 0, sizeof(uint64_t) * BENCH_NCOUNTS * b->nprocs);
+
+    /* Run one process per proc against a shared database */
+    fflush(stdout);
+    start = bench_now_ns();
+    for (proc = 0; proc < b->nprocs; proc++) {
+        pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return CRAWDB_ERR;
+        } else if (pid == 0) {
+            exit(bench_child(b, workload, proc) == CRAWDB_OK ? 0 : 1);
+        }
+    }
+    rv = CRAWDB_OK;
+    for (proc = 0; proc < b->nprocs; proc++) {
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            rv = CRAWDB_ERR;
+        }
+    }
+
+    /* Proc 0 is the indexer in index-concurrent */
+    if (strcmp(workload, "index-concurrent") == 0) {
+        bench_report(b, "index-concurrent:set", 1, b->nprocs, bench_now_ns() - start);
+        bench_report(b, "index-concurrent:idx", 0, 1, bench_now_ns() - start);
+    } else {
+        bench_report(b, workload, 0, b->nprocs, bench_now_ns() - start);
+    }
+    return rv;
+}
+
+static int bench_child(bench_t *b, char *workload, int proc) {
+    int rv;
+    crawdb_t *craw;
+    uchar *key;
+    uchar *val;
+    uchar *oval;
+    uint32_t noval;
+    uint64_t key_i;
+    uint64_t *lat;
+    uint64_t *counts;
+    uint64_t state;
+    uint64_t i;
+    uint64_t t;
+    uint64_t next_id;
+    bench_zipf_t zipf;
+    int is_set;
+    int indexer;
+
+    if ((rv = crawdb_open(b->idx_path, b->dat_path, &craw)) != CRAWDB_OK) {
+        fprintf(stderr, "crawdb_open: %d\n", rv);
+        return rv;
+    }
+
+    key = malloc(b->nkey);
+    val = malloc(b->nval);
+    memset(val, 'w', b->nval);
+    lat = b->lat + (b->nops * proc);
+    counts = b->counts + (BENCH_NCOUNTS * proc);
+    state = 0x1234 + proc;
+    next_id = b->nrecs + (b->nops * proc); /* disjoint new keys per proc */
+    indexer = (strcmp(workload, "index-concurrent") == 0 && proc == 0);
+
+    memset(&zipf, 0, sizeof(zipf));
+    if (strcmp(workload, "get-zipf") == 0) {
+        bench_zipf_init(&zipf, b->nrecs, b->theta);
+    }
+
+    /* Async lookups are pipelined rather than timed one at a time */
+    i = 0;
+    if (strcmp(workload, "get-async") == 0) {
+        bench_child_async(b, craw, key, lat, counts, &state);
+        i = b->nops;
+    }
+
+    for (; i < b->nops; i++) {
+        /* Indexer stops once all writers are done */
+        if (indexer && bench_writers_done(b)) {
+            break;
+        }
+
+        /* Pick op and key */
+        is_set = 0;
+        if (strcmp(workload, "get-uniform") == 0) {
+            bench_key(b, bench_rand(&state) % b->nrecs, key);
+        } else if (strcmp(workload, "get-zipf") == 0) {
+            bench_key(b, bench_zipf_next(&zipf, &state), key);
+        } else if (strcmp(workload, "get-miss") == 0) {
+            bench_key(b, b->nrecs + (b->nops * b->nprocs) + (bench_rand(&state) % b->nrecs), key);
+        } else if (strcmp(workload, "mixed") == 0) {
+            is_set = (int)(bench_rand(&state) % 100) < b->set_pct;
+            bench_key(b, is_set ? next_id++ : bench_rand(&state) % b->nrecs, key);
+        } else if (strcmp(workload, "index-concurrent") == 0) {
+            is_set = !indexer;
+            bench_key(b, next_id++, key);
+        } else {
+            fprintf(stderr, "Unknown workload: %s\n", workload);
+            rv = CRAWDB_ERR;
+            break;
+        }
+
+        /* Time op */
+        t = bench_now_ns();
+        if (indexer) {
+            rv = crawdb_index(craw);
+        } else if (is_set) {
+            rv = crawdb_set(craw, key, b->nkey, val, b->nval);
+            while (rv == CRAWDB_ERR_SET_IDX_DEAD) {
+                /* Index swapped underneath us; reload and retry */
+                counts[2] += 1;
+                if ((rv = crawdb_reload(craw)) == CRAWDB_OK) {
+                    rv = crawdb_set(craw, key, b->nkey, val, b->nval);
+                }
+            }
+        } else {
+            rv = crawdb_get(craw, key, b->nkey, &oval, &noval, &key_i);
+        }
+        lat[i] = bench_now_ns() - t;
+
+        counts[0] += 1;
+        if (rv != CRAWDB_OK) counts[1] += 1;
+    }
+    __atomic_store_n(&counts[3], 1, __ATOMIC_RELEASE);
+
+    crawdb_free(craw);
+    free(key);
+    free(val);
+    return CRAWDB_OK;
+}
+
+static int bench_child_async(bench_t *b, crawdb_t *craw, uchar *key, uint64_t *lat, uint64_t *counts, uint64_t *state) {
+    crawdb_async_t *async;
+    crawdb_async_result_t results[CRAWDB_ASYNC_DEPTH];
+    uint64_t *submitted;
+    uint64_t nsubmit;
+    uint64_t ndone;
+    uint64_t now;
+    uint32_t n;
+    uint32_t i;
+    int rv;
+
+    try(crawdb_async_new(craw, CRAWDB_ASYNC_DEPTH, 0, &async));
+    submitted = malloc(sizeof(uint64_t) * b->nops);
+
+    /* Keep the queue full; latency is submit to completion */
+    nsubmit = 0;
+    ndone = 0;
+    while (ndone < b->nops) {
+        while (nsubmit < b->nops) {
+            bench_key(b, bench_rand(state) % b->nrecs, key);
+            submitted[nsubmit] = bench_now_ns();
+            if (crawdb_async_submit(async, key, b->nkey, nsubmit) != CRAWDB_OK) break;
+            nsubmit += 1;
+        }
+        if ((rv = crawdb_async_complete(async, 1, results, CRAWDB_ASYNC_DEPTH, &n)) != CRAWDB_OK) {
+            break;
+        }
+        now = bench_now_ns();
+        for (i = 0; i < n; i++) {
+            lat[ndone++] = now - submitted[results[i].user];
+            counts[0] += 1;
+            if (results[i].rv != CRAWDB_OK || !results[i].found) counts[1] += 1;
+        }
+    }
+
+    crawdb_async_free(async);
+    free(submitted);
+    return rv;
+}
+
+static int bench_writers_done(bench_t *b) {
+    int proc;
+    for (proc = 1; proc < b->nprocs; proc++) {
+        if (!__atomic_load_n(&b->counts[(BENCH_NCOUNTS * proc) + 3], __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void bench_report(bench_t *b, char *label, int proc_from, int proc_to, uint64_t elapsed_ns) {
+    uint64_t *lat;
+    uint64_t n;
+    uint64_t i;
+    uint64_t nerr;
+    uint64_t nretry;
+    int proc;
+
+    /* Gather non-zero latencies from all procs */
+    lat = malloc(sizeof(uint64_t) * b->nops * b->nprocs);
+    n = 0;
+    nerr = 0;
+    nretry = 0;
+    for (proc = proc_from; proc < proc_to; proc++) {
+        for (i = 0; i < b->counts[BENCH_NCOUNTS * proc]; i++) {
+            lat[n++] = b->lat[(b->nops * proc) + i];
+        }
+        nerr += b->counts[(BENCH_NCOUNTS * proc) + 1];
+        nretry += b->counts[(BENCH_NCOUNTS * proc) + 2];
+    }
+    qsort(lat, n, sizeof(uint64_t), bench_cmp_u64);
+
+    if (n == 0) {
+        printf("%-20s no ops\n", label);
+    } else {
+        printf("%-20s procs=%-3d ops=%-9llu ops/s=%-11.0f p50=%-8llu p99=%-8llu p999=%-8llu max=%-10llu errors=%llu retries=%llu\n",
+            label, proc_to - proc_from, (unsigned long long)n,
+            (double)n / ((double)elapsed_ns / 1e9),
+            (unsigned long long)lat[(n * 50) / 100],
+            (unsigned long long)lat[(n * 99) / 100],
+            (unsigned long long)lat[(n * 999) / 1000],
+            (unsigned long long)lat[n - 1],
+            (unsigned long long)nerr,
+            (unsigned long long)nretry);
+    }
+
+    free(lat);
+}
+
+static int bench_cmp_u64(const void *a, const void *b) {
+    uint64_t x;
+    uint64_t y;
+    x = *(const uint64_t*)a;
+    y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+void usage(FILE *fp, int exit_code) {
+    fprintf(fp, "Usage:\n");
+    fprintf(fp, "  crawdb-bench [options]\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "  -h, --help             Show this help\n");
+    fprintf(fp, "  -D, --dir=<path>       Create databases in `path` (default=mkdtemp)\n");
+    fprintf(fp, "  -r, --records=<n>      Load `n` records (default=100000)\n");
+    fprintf(fp, "  -n, --key-size=<n>     Set key size to `n` (default=16)\n");
+    fprintf(fp, "  -s, --val-size=<n>     Set value size to `n` (default=100)\n");
+    fprintf(fp, "  -o, --ops=<n>          Run `n` ops per process (default=100000)\n");
+    fprintf(fp, "  -p, --procs=<n>        Run `n` processes (default=1)\n");
+    fprintf(fp, "  -z, --zipf=<theta>     Zipfian skew (default=0.99)\n");
+    fprintf(fp, "  -m, --set-pct=<n>      Percent sets in mixed workload (default=10)\n");
+    fprintf(fp, "  -w, --workloads=<list> Comma-separated workloads (default=%s)\n", BENCH_WORKLOADS);
+    fprintf(fp, "  -P, --prealloc         Load with preallocated appends\n");
+    fprintf(fp, "  -g, --segment-size=<n> Load with segmented data files of `n` bytes (0 for default)\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "Latencies are reported in nanoseconds.\n");
+    exit(exit_code);
+}
+
+int main(int argc, char **argv) {
+    bench_t b;
+    int c;
+    int rv;
+    char *workloads;
+    char *workload;
+    char *saveptr;
+    char tmpdir[] = "/tmp/crawdb-bench.XXXXXX";
+    int own_dir;
+    char seg_path[4096 + 12];
+    uint32_t seg;
+    int nprocs;
+    int nprocs_max;
+    uint64_t max_id;
+    int ndigits;
+
+    memset(&b, 0, sizeof(b));
+    b.nrecs = 100000;
+    b.nkey = 16;
+    b.nval = 100;
+    b.nops = 100000;
+    b.nprocs = 1;
+    b.theta = 0.99;
+    b.set_pct = 10;
+    workloads = BENCH_WORKLOADS;
+    own_dir = 0;
+    rv = 0;
+
+    struct option long_opts[] = {
+        { "help",      no_argument,       NULL, 'h' },
+        { "dir",       required_argument, NULL, 'D' },
+        { "records",   required_argument, NULL, 'r' },
+        { "key-size",  required_argument, NULL, 'n' },
+        { "val-size",  required_argument, NULL, 's' },
+        { "ops",       required_argument, NULL, 'o' },
+        { "procs",     required_argument, NULL, 'p' },
+        { "zipf",      required_argument, NULL, 'z' },
+        { "set-pct",   required_argument, NULL, 'm' },
+        { "workloads", required_argument, NULL, 'w' },
+        { "prealloc",  no_argument,       NULL, 'P' },
+        { "segment-size", required_argument, NULL, 'g' },
+        { 0,           0,                 0,    0   }
+    };
+
+    while ((c = getopt_long(argc, argv, "hD:r:n:s:o:p:z:m:w:Pg:", long_opts, NULL)) != -1) {
+        switch (c) {
+            case 'h': usage(stdout, 0); break;
+            case 'D': b.dir = optarg; break;
+            case 'r': b.nrecs = strtoull(optarg, NULL, 10); break;
+            case 'n': b.nkey = strtoul(optarg, NULL, 10); break;
+            case 's': b.nval = strtoul(optarg, NULL, 10); break;
+            case 'o': b.nops = strtoull(optarg, NULL, 10); break;
+            case 'p': b.nprocs = atoi(optarg); break;
+            case 'z': b.theta = strtod(optarg, NULL); break;
+            case 'm': b.set_pct = atoi(optarg); break;
+            case 'w': workloads = optarg; break;
+            case 'P': b.prealloc = 1; break;
+            case 'g': b.segment = 1; b.seg_size = strtoull(optarg, NULL, 10); break;
+            default: usage(stderr, 1); break;
+        }
+    }
+
+    if (b.nrecs < 2 || b.nkey < 1 || b.nops < 1 || b.nprocs < 1) {
+        usage(stderr, 1);
+    }
+
+    /* index-concurrent needs an indexer and at least one writer */
+    nprocs = b.nprocs;
+    nprocs_max = b.nprocs < 2 ? 2 : b.nprocs;
+
+    /* Keys are decimal ids; truncating them would make distinct ids collide */
+    max_id = (2 * b.nrecs) + (b.nops * (uint64_t)nprocs_max);
+    ndigits = snprintf(NULL, 0, "%llu", (unsigned long long)max_id);
+    if ((uint32_t)ndigits > b.nkey) {
+        fprintf(stderr, "--key-size=%u is too small for ids below %llu; need at least %d\n", b.nkey, (unsigned long long)max_id, ndigits);
+        return 1;
+    }
+
+    /* Make db dir */
+    if (!b.dir) {
+        if (!mkdtemp(tmpdir)) {
+            perror("mkdtemp");
+            return 1;
+        }
+        b.dir = tmpdir;
+        own_dir = 1;
+    }
+    snprintf(b.idx_path, sizeof(b.idx_path), "%s/idx", b.dir);
+    snprintf(b.dat_path, sizeof(b.dat_path), "%s/dat", b.dir);
+
+    /* Shared result arrays */
+    b.lat = mmap(NULL, sizeof(uint64_t) * b.nops * nprocs_max, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    b.counts = mmap(NULL, sizeof(uint64_t) * BENCH_NCOUNTS * nprocs_max, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (b.lat == MAP_FAILED || b.counts == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    /* Run each workload against a freshly loaded db */
+    workloads = strdup(workloads);
+    for (workload = strtok_r(workloads, ",", &saveptr); workload; workload = strtok_r(NULL, ",", &saveptr)) {
+        b.nprocs = nprocs;
+        if (strcmp(workload, "index-concurrent") == 0 && b.nprocs < 2) {
+            fprintf(stderr, "Running index-concurrent with 2 procs (one indexer, one writer)\n");
+            b.nprocs = 2;
+        }
+        if ((rv = bench_load(&b)) != CRAWDB_OK) break;
+        if ((rv = bench_run(&b, workload)) != CRAWDB_OK) break;
+    }
+    free(workloads);
+
+    if (own_dir) {
+        unlink(b.idx_path);
+        unlink(b.dat_path);
+        for (seg = 1; ; seg++) {
+            snprintf(seg_path, sizeof(seg_path), "%s.%u", b.dat_path, seg);
+            if (unlink(seg_path) != 0) break;
+        }
+        rmdir(b.dir);
+    }
+
+    return rv == CRAWDB_OK ? 0 : 1;
+}
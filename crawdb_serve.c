@@ -0,0 +1,796 @@
+#include "crawdb.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+  Serves a crawdb over the memcached text protocol.
+
+  The main thread accepts connections and hands them round-robin to worker
+  threads. Each worker runs an epoll loop over its connections with its own
+  crawdb handle and answers gets directly. Sets and deletes are queued to a
+  single writer thread which drains the queue and applies its writes under
+  one lock hold. Completions are posted back to the owning worker via
+  an eventfd, and the connection resumes parsing. A connection processes one
+  write at a time so replies stay in request order. Workers refresh their
+  handle before each get, so writes from this server and from other
+  processes are visible, and reopen only when the index was swapped.
+
+  crawdb values cannot be overwritten, so `set` behaves like `add` and
+  replies NOT_STORED for an existing key. Flags and exptime are ignored.
+*/
+
+#define SERVE_BACKLOG       128
+#define SERVE_MAX_EVENTS    64
+#define SERVE_READ_SIZE     16384
+#define SERVE_MAX_LINE      2048
+#define SERVE_MAX_GET_LINE  (1 << 20)
+#define SERVE_GET_BUF       (1 << 20)
+#define SERVE_MAX_KEY       250
+#define SERVE_OP_SET        1
+#define SERVE_OP_DELETE     2
+
+typedef struct serve_s serve_t;
+typedef struct serve_worker_s serve_worker_t;
+typedef struct serve_conn_s serve_conn_t;
+typedef struct serve_job_s serve_job_t;
+
+struct serve_s {
+    char *idx_path;
+    char *dat_path;
+    int fd_listen;
+    int nworkers;
+    serve_worker_t *workers;
+    pthread_t writer;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    serve_job_t *jobs_head;
+    serve_job_t *jobs_tail;
+};
+
+struct serve_worker_s {
+    serve_t *srv;
+    pthread_t thread;
+    int epfd;
+    int evfd;
+    crawdb_t *craw;
+    uchar *buf;                 /* values packed by crawdb_get_multi */
+    pthread_mutex_t mutex;
+    int *new_fds;
+    int nnew_fds;
+    int anew_fds;
+    serve_job_t *done_head;
+    serve_job_t *done_tail;
+    serve_conn_t *closed;       /* freed at the end of each epoll batch */
+};
+
+struct serve_conn_s {
+    int fd;
+    serve_worker_t *w;
+    char *rbuf;
+    size_t rlen;
+    size_t arbuf;
+    char *line;                 /* tokenized copy of the current command */
+    size_t aline;
+    char *wbuf;
+    size_t wlen;
+    size_t woff;
+    size_t awbuf;
+    int pending;
+    int closing;
+    int want_out;
+    serve_conn_t *next_closed;
+};
+
+struct serve_job_s {
+    int op;
+    uchar *key;
+    uint32_t nkey;
+    uchar *val;
+    uint32_t nval;
+    int noreply;
+    int rv;
+    serve_conn_t *c;
+    serve_job_t *next;
+};
+
+int serve(char *idx_path, char *dat_path, char *addr, int nworkers);
+static int serve_listen(char *addr);
+static void *serve_writer_main(void *arg);
+static void serve_writer_apply(serve_t *srv, crawdb_t **craw, serve_job_t *jobs);
+static void *serve_worker_main(void *arg);
+static void serve_worker_notify(serve_worker_t *w);
+static void serve_worker_wake(serve_worker_t *w);
+static void serve_conn_open(serve_worker_t *w, int fd);
+static void serve_conn_close(serve_conn_t *c);
+static void serve_conn_reap(serve_worker_t *w);
+static void serve_conn_read(serve_conn_t *c);
+static void serve_conn_process(serve_conn_t *c);
+static int serve_conn_command(serve_conn_t *c, char *line, size_t nline, size_t *out_consumed);
+static void serve_conn_get(serve_conn_t *c, char *keys, int with_cas);
+static void serve_conn_flush(serve_conn_t *c);
+static void serve_conn_reply(serve_conn_t *c, char *data, size_t len);
+static void serve_conn_replys(serve_conn_t *c, char *str);
+static void serve_job_done(serve_job_t *job);
+
+int serve(char *idx_path, char *dat_path, char *addr, int nworkers) {
+    serve_t srv;
+    serve_worker_t *w;
+    int fd;
+    int i;
+    int rv;
+    int one;
+
+    memset(&srv, 0, sizeof(srv));
+    srv.idx_path = idx_path;
+    srv.dat_path = dat_path;
+    srv.nworkers = nworkers < 1 ? 1 : nworkers;
+    pthread_mutex_init(&srv.mutex, NULL);
+    pthread_cond_init(&srv.cond, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Listen */
+    srv.fd_listen = serve_listen(addr);
+    if (srv.fd_listen < 0) {
+        return CRAWDB_ERR;
+    }
+
+    /* Start workers, each with its own handle */
+    srv.workers = calloc(srv.nworkers, sizeof(serve_worker_t));
+    for (i = 0; i < srv.nworkers; i++) {
+        w = &srv.workers[i];
+        w->srv = &srv;
+        pthread_mutex_init(&w->mutex, NULL);
+        if ((rv = crawdb_open(idx_path, dat_path, &w->craw)) != CRAWDB_OK) {
+            fprintf(stderr, "crawdb_open: %d\n", rv);
+            return rv;
+        }
+        w->buf = malloc(SERVE_GET_BUF);
+        w->epfd = epoll_create1(0);
+        w->evfd = eventfd(0, EFD_NONBLOCK);
+        if (w->epfd < 0 || w->evfd < 0) {
+            perror("epoll/eventfd");
+            return CRAWDB_ERR;
+        }
+        pthread_create(&w->thread, NULL, serve_worker_main, w);
+    }
+
+    /* Start writer */
+    pthread_create(&srv.writer, NULL, serve_writer_main, &srv);
+
+    /* Accept loop */
+    for (i = 0; ; i = (i + 1) % srv.nworkers) {
+        fd = accept(srv.fd_listen, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            return CRAWDB_ERR;
+        }
+        one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); /* fails harmlessly on unix sockets */
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        /* Hand off to worker */
+        w = &srv.workers[i];
+        pthread_mutex_lock(&w->mutex);
+        if (w->nnew_fds >= w->anew_fds) {
+            w->anew_fds = w->anew_fds ? w->anew_fds * 2 : 16;
+            w->new_fds = realloc(w->new_fds, w->anew_fds * sizeof(int));
+        }
+        w->new_fds[w->nnew_fds++] = fd;
+        pthread_mutex_unlock(&w->mutex);
+        serve_worker_wake(w);
+    }
+
+    return CRAWDB_OK;
+}
+
+static int serve_listen(char *addr) {
+    int fd;
+    int one;
+    char *colon;
+    char host[256];
+    char *port;
+    struct sockaddr_un sun;
+    struct addrinfo hints;
+    struct addrinfo *res;
+
+    if (strchr(addr, '/')) {
+        /* Unix socket path */
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", addr);
+        unlink(addr);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0) {
+            perror("bind");
+            return -1;
+        }
+    } else {
+        /* [host:]port, default host 127.0.0.1 */
+        colon = strrchr(addr, ':');
+        snprintf(host, sizeof(host), "%.*s", colon ? (int)(colon - addr) : 0, addr);
+        port = colon ? colon + 1 : addr;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(host[0] ? host : "127.0.0.1", port, &hints, &res) != 0) {
+            fprintf(stderr, "Bad address: %s\n", addr);
+            return -1;
+        }
+        fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen) != 0) {
+            perror("bind");
+            freeaddrinfo(res);
+            return -1;
+        }
+        freeaddrinfo(res);
+    }
+
+    if (listen(fd, SERVE_BACKLOG) != 0) {
+        perror("listen");
+        return -1;
+    }
+
+    return fd;
+}
+
+static void *serve_writer_main(void *arg) {
+    serve_t *srv;
+    serve_job_t *jobs;
+    crawdb_t *craw;
+    int rv;
+
+    srv = arg;
+    if ((rv = crawdb_open(srv->idx_path, srv->dat_path, &craw)) != CRAWDB_OK) {
+        fprintf(stderr, "crawdb_open: %d\n", rv);
+        exit(1);
+    }
+
+    for (;;) {
+        /* Take everything queued so far */
+        pthread_mutex_lock(&srv->mutex);
+        while (!srv->jobs_head) {
+            pthread_cond_wait(&srv->cond, &srv->mutex);
+        }
+        jobs = srv->jobs_head;
+        srv->jobs_head = NULL;
+        srv->jobs_tail = NULL;
+        pthread_mutex_unlock(&srv->mutex);
+
+        serve_writer_apply(srv, &craw, jobs);
+    }
+
+    return NULL;
+}
+
+static void serve_writer_apply(serve_t *srv, crawdb_t **craw, serve_job_t *jobs) {
+    serve_job_t *job;
+    serve_job_t *next;
+    int nbatch;
+    int retry;
+
+    /* Apply in order, one lock hold per run of writes */
+    nbatch = 0;
+    for (job = jobs; job; job = job->next) {
+        for (retry = 0; retry < 2; retry++) {
+            if (nbatch >= CRAWDB_BATCH_MAX) {
+                crawdb_batch_end(*craw);
+                nbatch = 0;
+            }
+            if (nbatch == 0 && crawdb_batch_begin(*craw) == CRAWDB_OK) {
+                nbatch = 1;
+            } else if (nbatch > 0) {
+                nbatch += 1;
+            }
+            if (job->op == SERVE_OP_SET) {
+                job->rv = crawdb_set(*craw, job->key, job->nkey, job->val, job->nval);
+            } else {
+                job->rv = crawdb_delete(*craw, job->key, job->nkey);
+            }
+
+            /* Index was swapped underneath us; reload and retry once */
+            if (job->rv != CRAWDB_ERR_SET_IDX_DEAD) break;
+            if (nbatch > 0) {
+                crawdb_batch_end(*craw);
+                nbatch = 0;
+            }
+            crawdb_reload(*craw);
+        }
+    }
+    if (nbatch > 0) {
+        crawdb_batch_end(*craw);
+    }
+
+    for (job = jobs; job; job = next) {
+        next = job->next;
+        serve_job_done(job);
+    }
+}
+
+static void serve_job_done(serve_job_t *job) {
+    serve_worker_t *w;
+
+    w = job->c->w;
+    job->next = NULL;
+    pthread_mutex_lock(&w->mutex);
+    if (w->done_tail) {
+        w->done_tail->next = job;
+    } else {
+        w->done_head = job;
+    }
+    w->done_tail = job;
+    pthread_mutex_unlock(&w->mutex);
+    serve_worker_wake(w);
+}
+
+static void *serve_worker_main(void *arg) {
+    serve_worker_t *w;
+    struct epoll_event ev;
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    serve_conn_t *c;
+    int n;
+    int i;
+
+    w = arg;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; /* NULL marks the eventfd */
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->evfd, &ev);
+
+    for (;;) {
+        n = epoll_wait(w->epfd, events, SERVE_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+            if (!c) {
+                serve_worker_notify(w);
+                continue;
+            }
+            if (c->closing) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                serve_conn_read(c);
+            } else if (events[i].events & EPOLLOUT) {
+                serve_conn_flush(c);
+            }
+        }
+        serve_conn_reap(w);
+    }
+
+    return NULL;
+}
+
+static void serve_worker_wake(serve_worker_t *w) {
+    uint64_t one;
+    one = 1;
+    if (write(w->evfd, &one, sizeof(one)) != sizeof(one)) {
+        /* Counter saturated; worker is already due to wake */
+    }
+}
+
+static void serve_worker_notify(serve_worker_t *w) {
+    uint64_t count;
+    int *fds;
+    int nfds;
+    int i;
+    serve_job_t *jobs;
+    serve_job_t *job;
+    serve_conn_t *c;
+    char *reply;
+    int noreply;
+
+    if (read(w->evfd, &count, sizeof(count)) != sizeof(count)) {
+        /* Spurious wake */
+    }
+
+    /* Take new fds and completions */
+    pthread_mutex_lock(&w->mutex);
+    fds = w->new_fds;
+    nfds = w->nnew_fds;
+    w->new_fds = NULL;
+    w->nnew_fds = 0;
+    w->anew_fds = 0;
+    jobs = w->done_head;
+    w->done_head = NULL;
+    w->done_tail = NULL;
+    pthread_mutex_unlock(&w->mutex);
+
+    for (i = 0; i < nfds; i++) {
+        serve_conn_open(w, fds[i]);
+    }
+    free(fds);
+
+    while ((job = jobs)) {
+        jobs = job->next;
+        c = job->c;
+        c->pending = 0;
+        if (job->op == SERVE_OP_SET) {
+            if (job->rv == CRAWDB_OK)                         reply = "STORED\r\n";
+            else if (job->rv == CRAWDB_ERR_SET_ALREADY_EXISTS) reply = "NOT_STORED\r\n";
+            else if (job->rv == CRAWDB_ERR_SET_BAD_KEY)       reply = "CLIENT_ERROR bad key\r\n";
+            else                                              reply = "SERVER_ERROR set failed\r\n";
+        } else {
+            if (job->rv == CRAWDB_OK)                         reply = "DELETED\r\n";
+            else if (job->rv == CRAWDB_ERR_DELETE_NOT_FOUND)  reply = "NOT_FOUND\r\n";
+            else if (job->rv == CRAWDB_ERR_SET_BAD_KEY)       reply = "CLIENT_ERROR bad key\r\n";
+            else                                              reply = "SERVER_ERROR delete failed\r\n";
+        }
+        noreply = job->noreply;
+        free(job->key);
+        free(job->val);
+        free(job);
+
+        if (c->closing) {
+            continue;
+        }
+        if (!noreply) {
+            serve_conn_replys(c, reply);
+        }
+        serve_conn_process(c);
+        serve_conn_flush(c);
+    }
+}
+
+static void serve_conn_open(serve_worker_t *w, int fd) {
+    serve_conn_t *c;
+    struct epoll_event ev;
+
+    c = calloc(1, sizeof(serve_conn_t));
+    c->fd = fd;
+    c->w = w;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        close(fd);
+        free(c);
+    }
+}
+
+static void serve_conn_close(serve_conn_t *c) {
+    if (c->closing) return;
+    epoll_ctl(c->w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->closing = 1;
+    c->next_closed = c->w->closed;
+    c->w->closed = c;
+}
+
+static void serve_conn_reap(serve_worker_t *w) {
+    serve_conn_t **pc;
+    serve_conn_t *c;
+
+    /* Keep conns whose write is still with the writer */
+    pc = &w->closed;
+    while ((c = *pc)) {
+        if (c->pending) {
+            pc = &c->next_closed;
+            continue;
+        }
+        *pc = c->next_closed;
+        free(c->rbuf);
+        free(c->line);
+        free(c->wbuf);
+        free(c);
+    }
+}
+
+static void serve_conn_read(serve_conn_t *c) {
+    ssize_t n;
+
+    for (;;) {
+        if (c->arbuf - c->rlen < SERVE_READ_SIZE) {
+            c->arbuf = c->rlen + SERVE_READ_SIZE;
+            c->rbuf = realloc(c->rbuf, c->arbuf);
+        }
+        n = read(c->fd, c->rbuf + c->rlen, c->arbuf - c->rlen);
+        if (n > 0) {
+            c->rlen += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            serve_conn_close(c);
+            return;
+        }
+    }
+
+    serve_conn_process(c);
+    serve_conn_flush(c);
+}
+
+static void serve_conn_process(serve_conn_t *c) {
+    char *eol;
+    size_t consumed;
+    size_t nline;
+    int is_get;
+    char *line;
+
+    /* Parse complete commands until a write is pending or input runs out */
+    while (!c->closing && !c->pending && c->rlen > 0) {
+        eol = memchr(c->rbuf, '\n', c->rlen);
+        nline = eol ? (size_t)(eol - c->rbuf) + 1 : c->rlen;
+
+        /* Multi-key gets may run long; other commands are short */
+        is_get = (c->rlen >= 4 && memcmp(c->rbuf, "get ", 4) == 0) || (c->rlen >= 5 && memcmp(c->rbuf, "gets ", 5) == 0);
+        if (nline > (is_get ? SERVE_MAX_GET_LINE : SERVE_MAX_LINE)) {
+            serve_conn_replys(c, "CLIENT_ERROR line too long\r\n");
+            serve_conn_flush(c);
+            serve_conn_close(c);
+            return;
+        } else if (!eol) {
+            return;
+        }
+
+        /* Tokenize a copy so an incomplete set can be retried */
+        if (nline > c->aline) {
+            c->aline = nline;
+            c->line = realloc(c->line, c->aline);
+        }
+        line = c->line;
+        memcpy(line, c->rbuf, nline - 1);
+        line[nline - 1] = '\0';
+        if (nline > 1 && line[nline - 2] == '\r') line[nline - 2] = '\0';
+
+        if (serve_conn_command(c, line, nline, &consumed) != CRAWDB_OK) {
+            return; /* Need more data */
+        }
+        if (c->closing) return;
+
+        memmove(c->rbuf, c->rbuf + consumed, c->rlen - consumed);
+        c->rlen -= consumed;
+    }
+}
+
+static int serve_conn_command(serve_conn_t *c, char *line, size_t nline, size_t *out_consumed) {
+    char *cmd;
+    char *key;
+    char *arg;
+    char *saveptr;
+    unsigned long nbytes;
+    int noreply;
+    serve_job_t *job;
+    serve_t *srv;
+    int op;
+
+    *out_consumed = nline;
+    cmd = strtok_r(line, " ", &saveptr);
+    if (!cmd) {
+        serve_conn_replys(c, "ERROR\r\n");
+        return CRAWDB_OK;
+    }
+
+    if (strcmp(cmd, "get") == 0 || strcmp(cmd, "gets") == 0) {
+        serve_conn_get(c, saveptr, strcmp(cmd, "gets") == 0);
+        return CRAWDB_OK;
+    } else if (strcmp(cmd, "version") == 0) {
+        serve_conn_replys(c, "VERSION crawdb\r\n");
+        return CRAWDB_OK;
+    } else if (strcmp(cmd, "quit") == 0) {
+        serve_conn_flush(c);
+        serve_conn_close(c);
+        return CRAWDB_OK;
+    } else if (strcmp(cmd, "set") != 0 && strcmp(cmd, "add") != 0 && strcmp(cmd, "delete") != 0) {
+        serve_conn_replys(c, "ERROR\r\n");
+        return CRAWDB_OK;
+    }
+
+    op = strcmp(cmd, "delete") == 0 ? SERVE_OP_DELETE : SERVE_OP_SET;
+    key = strtok_r(NULL, " ", &saveptr);
+    nbytes = 0;
+    noreply = 0;
+    if (!key || strlen(key) > SERVE_MAX_KEY) {
+        serve_conn_replys(c, "CLIENT_ERROR bad command line format\r\n");
+        return CRAWDB_OK;
+    }
+
+    if (op == SERVE_OP_SET) {
+        /* <key> <flags> <exptime> <bytes> [noreply] */
+        if (!strtok_r(NULL, " ", &saveptr) || !strtok_r(NULL, " ", &saveptr) || !(arg = strtok_r(NULL, " ", &saveptr))) {
+            serve_conn_replys(c, "CLIENT_ERROR bad command line format\r\n");
+            return CRAWDB_OK;
+        }
+        nbytes = strtoul(arg, NULL, 10);
+        if (nbytes > UINT32_MAX - 2) {
+            serve_conn_replys(c, "CLIENT_ERROR bad data chunk\r\n");
+            return CRAWDB_OK;
+        }
+
+        /* Wait for data block */
+        if (c->rlen < nline + nbytes + 2) {
+            return CRAWDB_ERR;
+        }
+        if (memcmp(c->rbuf + nline + nbytes, "\r\n", 2) != 0) {
+            serve_conn_replys(c, "CLIENT_ERROR bad data chunk\r\n");
+            *out_consumed = nline + nbytes + 2;
+            return CRAWDB_OK;
+        }
+        *out_consumed = nline + nbytes + 2;
+    }
+    arg = strtok_r(NULL, " ", &saveptr);
+    noreply = arg && strcmp(arg, "noreply") == 0;
+
+    /* Queue for writer */
+    job = calloc(1, sizeof(serve_job_t));
+    job->op = op;
+    job->nkey = strlen(key);
+    job->key = malloc(job->nkey);
+    memcpy(job->key, key, job->nkey);
+    if (op == SERVE_OP_SET) {
+        job->nval = (uint32_t)nbytes;
+        job->val = malloc(nbytes > 0 ? nbytes : 1);
+        memcpy(job->val, c->rbuf + nline, nbytes);
+    }
+    job->noreply = noreply;
+    job->c = c;
+    c->pending = 1;
+
+    srv = c->w->srv;
+    pthread_mutex_lock(&srv->mutex);
+    if (srv->jobs_tail) {
+        srv->jobs_tail->next = job;
+    } else {
+        srv->jobs_head = job;
+    }
+    srv->jobs_tail = job;
+    pthread_cond_signal(&srv->cond);
+    pthread_mutex_unlock(&srv->mutex);
+
+    return CRAWDB_OK;
+}
+
+static void serve_conn_get(serve_conn_t *c, char *keys, int with_cas) {
+    serve_worker_t *w;
+    char *key;
+    char *saveptr;
+    uchar **gkeys;
+    uint32_t *gnkeys;
+    uint64_t *offsets;
+    uint32_t *nvals;
+    int *rvs;
+    uint64_t ngkeys;
+    uint64_t agkeys;
+    uint64_t i;
+    uchar *val;
+    uint32_t nval;
+    uint64_t key_i;
+    char header[SERVE_MAX_KEY + 64];
+    int n;
+    int rv;
+
+    /* Pick up writes from any process; reopens only after an index swap */
+    w = c->w;
+    if (crawdb_refresh(w->craw) != CRAWDB_OK) {
+        crawdb_reload(w->craw);
+    }
+
+    /* Collect keys that fit the key width and reply header */
+    gkeys = NULL;
+    gnkeys = NULL;
+    ngkeys = 0;
+    agkeys = 0;
+    for (key = strtok_r(keys, " ", &saveptr); key; key = strtok_r(NULL, " ", &saveptr)) {
+        if (strlen(key) > w->craw->nkey || strlen(key) > SERVE_MAX_KEY) {
+            continue;
+        }
+        if (ngkeys >= agkeys) {
+            agkeys = agkeys ? agkeys * 2 : 16;
+            gkeys = realloc(gkeys, agkeys * sizeof(uchar*));
+            gnkeys = realloc(gnkeys, agkeys * sizeof(uint32_t));
+        }
+        gkeys[ngkeys] = (uchar*)key;
+        gnkeys[ngkeys] = strlen(key);
+        ngkeys += 1;
+    }
+
+    /* Look up all keys in one call; gets needs each record index for its cas */
+    offsets = NULL;
+    nvals = NULL;
+    rvs = NULL;
+    if (!with_cas && ngkeys > 0) {
+        offsets = malloc(ngkeys * sizeof(uint64_t));
+        nvals = malloc(ngkeys * sizeof(uint32_t));
+        rvs = malloc(ngkeys * sizeof(int));
+        crawdb_get_multi(w->craw, gkeys, gnkeys, ngkeys, w->buf, SERVE_GET_BUF, offsets, nvals, rvs);
+    }
+
+    for (i = 0; i < ngkeys; i++) {
+        key_i = 0;
+        if (rvs && rvs[i] == CRAWDB_OK) {
+            val = w->buf + offsets[i];
+            nval = nvals[i];
+        } else if (rvs && rvs[i] != CRAWDB_ERR_GET_BUF) {
+            continue;
+        } else {
+            /* Values that did not fit the packed buffer are read on their own */
+            rv = crawdb_get(w->craw, gkeys[i], gnkeys[i], &val, &nval, &key_i);
+            if (rv != CRAWDB_OK || !val) {
+                continue;
+            }
+        }
+        if (with_cas) {
+            n = snprintf(header, sizeof(header), "VALUE %s 0 %u %llu\r\n", (char*)gkeys[i], nval, (unsigned long long)key_i + 1);
+        } else {
+            n = snprintf(header, sizeof(header), "VALUE %s 0 %u\r\n", (char*)gkeys[i], nval);
+        }
+        serve_conn_reply(c, header, (size_t)n);
+        serve_conn_reply(c, (char*)val, nval);
+        serve_conn_reply(c, "\r\n", 2);
+    }
+    serve_conn_replys(c, "END\r\n");
+
+    free(gkeys);
+    free(gnkeys);
+    free(offsets);
+    free(nvals);
+    free(rvs);
+}
+
+static void serve_conn_reply(serve_conn_t *c, char *data, size_t len) {
+    if (c->awbuf - c->wlen < len) {
+        c->awbuf = (c->wlen + len) * 2;
+        c->wbuf = realloc(c->wbuf, c->awbuf);
+    }
+    memcpy(c->wbuf + c->wlen, data, len);
+    c->wlen += len;
+}
+
+static void serve_conn_replys(serve_conn_t *c, char *str) {
+    serve_conn_reply(c, str, strlen(str));
+}
+
+static void serve_conn_flush(serve_conn_t *c) {
+    ssize_t n;
+    struct epoll_event ev;
+    int want_out;
+
+    if (c->closing) return;
+
+    while (c->woff < c->wlen) {
+        n = write(c->fd, c->wbuf + c->woff, c->wlen - c->woff);
+        if (n > 0) {
+            c->woff += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            serve_conn_close(c);
+            return;
+        }
+    }
+    if (c->woff == c->wlen) {
+        c->woff = 0;
+        c->wlen = 0;
+    }
+
+    /* Only watch for writability while output is backed up */
+    want_out = c->wlen > 0;
+    if (want_out != c->want_out) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(c->w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_out = want_out;
+    }
+}
@@ -4,7 +4,8 @@ set -eux
 test_dir=$(mktemp -d)
 pass=0
 
-cleanup() { rm -rf $test_dir; [ $pass -ne 1 ] && { echo FAIL; exit 1; } || echo PASS; }
+serve_pid=
+cleanup() { [ -n "$serve_pid" ] && kill $serve_pid; rm -rf $test_dir; [ $pass -ne 1 ] && { echo FAIL; exit 1; } || echo PASS; }
 trap cleanup EXIT
 
 # Create db
@@ -20,11 +21,18 @@ trap cleanup EXIT
 ./crawdb -i $test_dir/idx -d $test_dir/dat -S -k key2 -v hi
 [ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k key2)" = "hi" ]
 
+# Write key of full width
+./crawdb -i $test_dir/idx -d $test_dir/dat -S -k fullkey8 -v wide
+
 # Index and read keys
 ./crawdb -i $test_dir/idx -d $test_dir/dat -I
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k fullkey8)" = "wide" ]
 [ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k key1)" = "val42" ]
 [ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k key2)" = "hi" ]
 
+# Prefix of a key is a different key
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k key)" = "" ]
+
 # Ensure dup key fails
 ok=0
 ./crawdb -i $test_dir/idx -d $test_dir/dat -S -k key2 -v again || ok=1
@@ -38,4 +46,253 @@ ok=0
 ./crawdb -i $test_dir/idx -d $test_dir/dat -X -k key3
 [ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k key3)" = "" ]
 
+# Write and read value larger than one get chunk
+bigval=$(printf 'x%.0s' $(seq 1 70000))
+./crawdb -i $test_dir/idx -d $test_dir/dat -S -k big -v "$bigval"
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k big)" = "$bigval" ]
+cp $test_dir/idx $test_dir/gidx
+cp $test_dir/dat $test_dir/gdat
+printf 'y' | dd of=$test_dir/gdat bs=1 seek=$(( $(stat -c %s $test_dir/gdat) - 1 )) conv=notrunc 2>/dev/null
+ok=0
+out=$(./crawdb -i $test_dir/gidx -d $test_dir/gdat -G -k big) || ok=1
+[ "$ok" -eq 1 ]
+[ -z "$out" ]
+
+# Stream a set from stdin; the lock is only taken to commit
+seq 1 40000 > $test_dir/sval
+./crawdb -i $test_dir/idx -d $test_dir/dat -S -k sbig < $test_dir/sval
+./crawdb -i $test_dir/idx -d $test_dir/dat -G -k sbig | cmp - $test_dir/sval
+(sleep 2; printf 'late') | ./crawdb -i $test_dir/idx -d $test_dir/dat -S -k slow &
+STREAM_PID=$!
+sleep 0.3
+timeout 1 ./crawdb -i $test_dir/idx -d $test_dir/dat -S -k fast -v quick
+wait $STREAM_PID
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k slow)" = "late" ]
+ok=0
+printf 'again' | ./crawdb -i $test_dir/idx -d $test_dir/dat -S -k fast || ok=1
+[ "$ok" -eq 1 ]
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k fast)" = "quick" ]
+
+# Freeze and read keys via perfect hash
+./crawdb -i $test_dir/idx -d $test_dir/dat -F
+[ -f $test_dir/idx.mph ]
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k key1)" = "val42" ]
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k key2)" = "hi" ]
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k key4)" = "" ]
+
+# Prewarm index into page cache
+./crawdb -i $test_dir/idx -d $test_dir/dat -W
+./crawdb -i $test_dir/idx -d $test_dir/dat -W --prewarm-all
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k key1)" = "val42" ]
+
+# Write after freeze falls back to normal search
+./crawdb -i $test_dir/idx -d $test_dir/dat -S -k key4 -v frozen
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k key4)" = "frozen" ]
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k key1)" = "val42" ]
+
+# Freeze hashes only the last live record of a deleted then re-set key
+./crawdb -i $test_dir/idx -d $test_dir/dat -S -k fz1 -v first
+./crawdb -i $test_dir/idx -d $test_dir/dat -S -k fz2 -v gone
+./crawdb -i $test_dir/idx -d $test_dir/dat -I
+./crawdb -i $test_dir/idx -d $test_dir/dat -X -k fz1
+./crawdb -i $test_dir/idx -d $test_dir/dat -X -k fz2
+./crawdb -i $test_dir/idx -d $test_dir/dat -S -k fz1 -v again
+./crawdb -i $test_dir/idx -d $test_dir/dat -F
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k fz1)" = "again" ]
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k fz2)" = "" ]
+[ "$(./crawdb -i $test_dir/idx -d $test_dir/dat -G -k key1)" = "val42" ]
+
+# Index keeps duplicate keys in record order, and every lookup finds the live copy
+for n in 8 5; do
+    ./crawdb -i $test_dir/didx$n -d $test_dir/ddat$n -N -n$n
+    for r in 1 2 3; do
+        for i in $(seq 0 49); do
+            if [ $r -gt 1 ]; then printf 'del\td%d\n' $i; fi
+            printf 'set\td%d\tv%d.%d\n' $i $i $r
+        done
+    done | ./crawdb -i $test_dir/didx$n -d $test_dir/ddat$n -B >/dev/null
+    ./crawdb -i $test_dir/didx$n -d $test_dir/ddat$n -I
+    ./crawdb -i $test_dir/didx$n -d $test_dir/ddat$n -D | awk '{ if ($1 == key && live) bad = 1; key = $1; live = NF > 1 } END { exit bad }'
+    printf 'del\td0\nset\td0\tv0.3\n' | ./crawdb -i $test_dir/didx$n -d $test_dir/ddat$n -B >/dev/null
+    for i in $(seq 0 49); do
+        [ "$(./crawdb -i $test_dir/didx$n -d $test_dir/ddat$n -G -k d$i)" = "v$i.3" ]
+    done
+    out=$(for i in $(seq 0 49); do printf 'get\td%d\n' $i; done | ./crawdb -i $test_dir/didx$n -d $test_dir/ddat$n -B)
+    [ "$out" = "$(for i in $(seq 0 49); do printf 'OK\tv%d.3\n' $i; done)" ]
+done
+
+# Frozen and binary search lookups agree on re-set keys, including after a write
+./crawdb -i $test_dir/didx8 -d $test_dir/ddat8 -F
+for i in $(seq 0 49); do
+    [ "$(./crawdb -i $test_dir/didx8 -d $test_dir/ddat8 -G -k d$i)" = "v$i.3" ]
+done
+./crawdb -i $test_dir/didx8 -d $test_dir/ddat8 -S -k newkey -v new
+for i in $(seq 0 49); do
+    [ "$(./crawdb -i $test_dir/didx8 -d $test_dir/ddat8 -G -k d$i)" = "v$i.3" ]
+done
+
+# Batch commands from stdin
+out=$(printf 'set\tb1\tone\nset\tb2\ttwo\\tx\nget\tb1\nget\tb2\nget\tb3\ndel\tb1\nget\tb1\nset\tb2\tdup\n' | ./crawdb -i $test_dir/idx -d $test_dir/dat -B)
+[ "$out" = "$(printf 'OK\nOK\nOK\tone\nOK\ttwo\\tx\nNOT_FOUND\nOK\nNOT_FOUND\nERR\t-25')" ]
+
+# Batch sets and deletes under one lock
+out=$(printf 'set\tbd1\tone\nset\tbd2\ttwo\ndel\tbd1\ndel\tbd1\nset\tbd3\tthree\nget\tbd1\nget\tbd2\n' | ./crawdb -i $test_dir/idx -d $test_dir/dat -B)
+[ "$out" = "$(printf 'OK\nOK\nOK\nERR\t-42\nOK\nNOT_FOUND\nOK\ttwo')" ]
+
+# Idle batch client neither holds the lock nor its replies, and sets after an index swap
+out=$( (printf 'set\tbi1\tone\n'; sleep 0.5; timeout 10 ./crawdb -i $test_dir/idx -d $test_dir/dat -I; printf 'set\tbi2\ttwo\nget\tbi1\n') | timeout 10 ./crawdb -i $test_dir/idx -d $test_dir/dat -B)
+[ "$out" = "$(printf 'OK\nOK\nOK\tone')" ]
+coproc BATCH { ./crawdb -i $test_dir/idx -d $test_dir/dat -B; }
+batch_pid=$BATCH_PID
+printf 'del\tbi2\n' >&${BATCH[1]}
+read -t 10 -r line <&${BATCH[0]}
+[ "$line" = "OK" ]
+printf 'get\tbi1\n' >&${BATCH[1]}
+read -t 10 -r line <&${BATCH[0]}
+[ "$line" = "$(printf 'OK\tone')" ]
+exec {BATCH[1]}>&-
+wait $batch_pid
+
+# Batch gets via pread fallback match io_uring
+out=$(printf 'get\tkey1\nget\tb2\nget\tnope\nget\tkey2\n' | ./crawdb -i $test_dir/idx -d $test_dir/dat -B)
+[ "$out" = "$(printf 'OK\tval42\nOK\ttwo\\tx\nNOT_FOUND\nOK\thi')" ]
+[ "$out" = "$(printf 'get\tkey1\nget\tb2\nget\tnope\nget\tkey2\n' | ./crawdb -i $test_dir/idx -d $test_dir/dat -B --no-uring)" ]
+
+# Dump from a snapshot
+./crawdb -i $test_dir/idx -d $test_dir/dat -D | grep -q '^key1 *val42$'
+
+# Print stats
+./crawdb -i $test_dir/idx -d $test_dir/dat -G -k key1 --stats 2>&1 >/dev/null | grep -q '^crawdb_idx_probes [1-9]'
+
+# Follow leader into a replica, across an index swap
+./crawdb -i $test_dir/ridx -d $test_dir/rdat -R --leader-idx=$test_dir/idx --leader-dat=$test_dir/dat --once
+cmp $test_dir/idx $test_dir/ridx
+./crawdb -i $test_dir/idx -d $test_dir/dat -S -k key5 -v more
+./crawdb -i $test_dir/idx -d $test_dir/dat -I
+./crawdb -i $test_dir/ridx -d $test_dir/rdat -R --leader-idx=$test_dir/idx --leader-dat=$test_dir/dat --once
+cmp $test_dir/idx $test_dir/ridx
+cmp $test_dir/dat $test_dir/rdat
+[ "$(./crawdb -i $test_dir/ridx -d $test_dir/rdat -G -k key5)" = "more" ]
+ino=$(stat -c %i $test_dir/ridx)
+./crawdb -i $test_dir/idx -d $test_dir/dat -X -k key5
+./crawdb -i $test_dir/ridx -d $test_dir/rdat -R --leader-idx=$test_dir/idx --leader-dat=$test_dir/dat --once
+cmp $test_dir/idx $test_dir/ridx
+[ "$(./crawdb -i $test_dir/ridx -d $test_dir/rdat -G -k key5)" = "" ]
+./crawdb -i $test_dir/idx -d $test_dir/dat -S -k key7 -v gone
+./crawdb -i $test_dir/idx -d $test_dir/dat -X -k key7
+./crawdb -i $test_dir/ridx -d $test_dir/rdat -R --leader-idx=$test_dir/idx --leader-dat=$test_dir/dat --once
+cmp $test_dir/idx $test_dir/ridx
+[ "$(./crawdb -i $test_dir/ridx -d $test_dir/rdat -G -k key7)" = "" ]
+[ "$(stat -c %i $test_dir/ridx)" = "$ino" ]
+ok=0
+./crawdb -i $test_dir/ridx -d $test_dir/rdat -R --leader-idx=$test_dir/nidx --leader-dat=$test_dir/ndat --once 2>/dev/null || ok=1
+[ "$ok" -eq 1 ]
+[ ! -e $test_dir/nidx ]
+
+# Open and upgrade a version 1 idx
+printf 'CRAW\x01\x04\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00' > $test_dir/v1idx
+./crawdb -i $test_dir/v1idx -d $test_dir/v1dat -S -k old -v one
+[ "$(./crawdb -i $test_dir/v1idx -d $test_dir/v1dat -G -k old)" = "one" ]
+./crawdb -i $test_dir/v1idx -d $test_dir/v1dat -I
+[ "$(./crawdb -i $test_dir/v1idx -d $test_dir/v1dat -G -k old)" = "one" ]
+[ "$(head -c5 $test_dir/v1idx | tail -c1 | od -An -tu1 | tr -d ' ')" = "2" ]
+
+# Preallocated appends keep their ends in the header, across index and follow
+./crawdb -i $test_dir/pidx -d $test_dir/pdat -N -n8 --prealloc
+./crawdb -i $test_dir/pidx -d $test_dir/pdat -S -k p1 -v one
+./crawdb -i $test_dir/pidx -d $test_dir/pdat -S -k p2 -v two
+[ "$(stat -c %s $test_dir/pdat)" -gt 6 ]
+./crawdb -i $test_dir/pidx -d $test_dir/pdat -I
+./crawdb -i $test_dir/pidx -d $test_dir/pdat -S -k p3 -v three
+[ "$(./crawdb -i $test_dir/pidx -d $test_dir/pdat -G -k p1)" = "one" ]
+[ "$(./crawdb -i $test_dir/pidx -d $test_dir/pdat -G -k p3)" = "three" ]
+./crawdb -i $test_dir/pidx -d $test_dir/pdat -V | grep -q '^crawdb_scrub_recs 3$'
+./crawdb -i $test_dir/rpidx -d $test_dir/rpdat -R --leader-idx=$test_dir/pidx --leader-dat=$test_dir/pdat --once
+[ "$(./crawdb -i $test_dir/rpidx -d $test_dir/rpdat -G -k p3)" = "three" ]
+[ "$(stat -c %s $test_dir/rpdat)" -eq 11 ]
+seq 1 20000 > $test_dir/pval
+./crawdb -i $test_dir/pidx -d $test_dir/pdat -S -k p4 < $test_dir/pval
+./crawdb -i $test_dir/pidx -d $test_dir/pdat -G -k p4 | cmp - $test_dir/pval
+
+# Segmented values fill and seal segments, and dead segments are unlinked
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -N -n8 --segment-size=16
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -S -k s1 -v 01234567890123456789
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -S -k s2 -v bb
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -S -k s3 -v cc
+[ "$(stat -c %s $test_dir/sdat.1)" -eq 20 ]
+[ "$(stat -c %s $test_dir/sdat.2)" -eq 4 ]
+ok=0
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -S -k s2 -v again || ok=1
+[ "$ok" -eq 1 ]
+[ "$(stat -c %s $test_dir/sdat.2)" -eq 4 ]
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -I
+[ "$(./crawdb -i $test_dir/sidx -d $test_dir/sdat -G -k s1)" = "01234567890123456789" ]
+[ "$(./crawdb -i $test_dir/sidx -d $test_dir/sdat -G -k s3)" = "cc" ]
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -X -k s1
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -C | grep -q '^crawdb_reclaim_unlinked 1$'
+[ ! -f $test_dir/sdat.1 ]
+[ "$(./crawdb -i $test_dir/sidx -d $test_dir/sdat -G -k s2)" = "bb" ]
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -V | grep -q '^crawdb_scrub_recs 3$'
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -X -k s3
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -C | grep -q '^crawdb_reclaim_unlinked 0$'
+[ -f $test_dir/sdat.2 ]
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -S -k s4 -v 0123456789ab
+[ "$(od -An -tu8 -j24 -N8 $test_dir/sidx.live | tr -d ' ')" = "2" ]
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -X -k s2
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -X -k s4
+[ "$(od -An -tu8 -j24 -N8 $test_dir/sidx.live | tr -d ' ')" = "0" ]
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -C | grep -q '^crawdb_reclaim_unlinked 1$'
+[ ! -f $test_dir/sdat.2 ]
+
+# Without live counts reclaim scans the idx, until the next index rebuilds them
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -S -k s5 -v 0123456789abcdef
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -S -k s6 -v 0123456789abcdef
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -X -k s5
+rm $test_dir/sidx.live
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -C | grep -q '^crawdb_reclaim_unlinked 1$'
+[ ! -f $test_dir/sdat.3 ]
+[ -f $test_dir/sdat.4 ]
+./crawdb -i $test_dir/sidx -d $test_dir/sdat -I
+[ "$(od -An -tu8 -j40 -N8 $test_dir/sidx.live | tr -d ' ')" = "1" ]
+[ "$(./crawdb -i $test_dir/sidx -d $test_dir/sdat -G -k s6)" = "0123456789abcdef" ]
+
+# Verify, then corrupt a value in a copy and quarantine it
+./crawdb -i $test_dir/idx -d $test_dir/dat -V -w 2 | grep -q '^crawdb_scrub_bad_cksum 0$'
+cp $test_dir/idx $test_dir/qidx
+cp $test_dir/dat $test_dir/qdat
+printf 'X' | dd of=$test_dir/qdat bs=1 seek=0 conv=notrunc 2>/dev/null
+ok=0
+./crawdb -i $test_dir/qidx -d $test_dir/qdat -V >/dev/null || ok=1
+[ "$ok" -eq 1 ]
+./crawdb -i $test_dir/qidx -d $test_dir/qdat -V --quarantine | grep -q '^crawdb_scrub_quarantined 1$'
+./crawdb -i $test_dir/qidx -d $test_dir/qdat -V >/dev/null
+[ "$(./crawdb -i $test_dir/qidx -d $test_dir/qdat -G -k key1)" = "" ]
+
+# Serve memcached protocol over tcp
+port=$((20000 + $$ % 10000))
+./crawdb -i $test_dir/idx -d $test_dir/dat -L 127.0.0.1:$port -w 2 &
+serve_pid=$!
+for i in $(seq 1 50); do { exec 3<>/dev/tcp/127.0.0.1/$port; } 2>/dev/null && break; sleep 0.1; done
+printf 'get key1 nope key2\r\nset m1 0 0 5\r\nhello\r\nset m1 0 0 1\r\nx\r\nget m1\r\ndelete m1\r\nget m1\r\nquit\r\n' >&3
+out=$(cat <&3 | tr -d '\r')
+exec 3<&-
+[ "$out" = "$(printf 'VALUE key1 0 5\nval42\nVALUE key2 0 2\nhi\nEND\nSTORED\nNOT_STORED\nVALUE m1 0 5\nhello\nEND\nDELETED\nEND')" ]
+
+# Server refreshes for sets, index swaps, and deletes from other processes; multi-key gets
+# of hits and misses go through crawdb_get_multi and may run longer than 2 KB
+./crawdb -i $test_dir/idx -d $test_dir/dat -S -k ext1 -v outside
+./crawdb -i $test_dir/idx -d $test_dir/dat -I
+misses=$(printf 'miss%04d ' $(seq 1 400))
+exec 3<>/dev/tcp/127.0.0.1/$port
+printf 'get %sext1 key1\r\nquit\r\n' "$misses" >&3
+out=$(cat <&3 | tr -d '\r')
+exec 3<&-
+[ "$out" = "$(printf 'VALUE ext1 0 7\noutside\nVALUE key1 0 5\nval42\nEND')" ]
+./crawdb -i $test_dir/idx -d $test_dir/dat -X -k ext1
+exec 3<>/dev/tcp/127.0.0.1/$port
+printf 'get ext1 nope key1\r\ngets key2\r\nquit\r\n' >&3
+out=$(cat <&3 | tr -d '\r')
+exec 3<&-
+[ "$(echo "$out" | sed 's/^VALUE key2 0 2 [1-9][0-9]*$/VALUE key2 0 2 CAS/')" = "$(printf 'VALUE key1 0 5\nval42\nEND\nVALUE key2 0 2 CAS\nhi\nEND')" ]
+
 pass=1